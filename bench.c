@@ -0,0 +1,405 @@
+#if !defined(_WIN32) && !defined(_POSIX_C_SOURCE)
+#define _POSIX_C_SOURCE 199309L
+#endif
+#include "qgcjson.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#if defined(__unix__) || defined(__APPLE__)
+#include <sys/resource.h>
+#define BENCH_RUSAGE
+#endif
+
+/*
+ * qgcjson_bench [seconds per measurement]
+ * corpora are generated in memory from a fixed seed, so numbers are comparable between builds
+ */
+
+typedef struct corpus {
+    const char* name;
+    char** docs;
+    size_t* lens;
+    size_t count, bytes;
+} corpus;
+
+typedef struct buffer {
+    char* s;
+    size_t len, cap;
+} buffer;
+
+size_t alloc_count = 0;
+double min_seconds = 0.5;
+unsigned long long rng_state = 0x9E3779B97F4A7C15ULL;
+
+void* bench_malloc(void* ctx, size_t size) {
+    (void)ctx;
+    alloc_count++;
+    return malloc(size);
+}
+
+void* bench_realloc(void* ctx, void* ptr, size_t size) {
+    (void)ctx;
+    alloc_count++;
+    return realloc(ptr, size);
+}
+
+void bench_free(void* ctx, void* ptr) {
+    (void)ctx;
+    free(ptr);
+}
+
+double now() {
+#if defined(_POSIX_C_SOURCE)
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+#else
+    return (double)clock() / CLOCKS_PER_SEC;
+#endif
+}
+
+unsigned rng() {
+    rng_state ^= rng_state << 13;
+    rng_state ^= rng_state >> 7;
+    rng_state ^= rng_state << 17;
+    return (unsigned)(rng_state >> 16);
+}
+
+void buf_put(buffer* b, const char* s, size_t len) {
+    if (b->len + len + 1 > b->cap) {
+        while (b->len + len + 1 > b->cap) b->cap = b->cap ? b->cap * 2 : 4096;
+        b->s = (char*)realloc(b->s, b->cap);
+    }
+    memcpy(b->s + b->len, s, len);
+    b->len += len;
+    b->s[b->len] = '\0';
+}
+
+void buf_puts(buffer* b, const char* s) {
+    buf_put(b, s, strlen(s));
+}
+
+void buf_printf(buffer* b, const char* format, double d) {
+    char tmp[256];
+    buf_put(b, tmp, (size_t)sprintf(tmp, format, d));
+}
+
+void corpus_add(corpus* c, buffer* b) {
+    c->docs = (char**)realloc(c->docs, (c->count + 1) * sizeof(char*));
+    c->lens = (size_t*)realloc(c->lens, (c->count + 1) * sizeof(size_t));
+    c->docs[c->count] = b->s;
+    c->lens[c->count++] = b->len;
+    c->bytes += b->len;
+    b->s = NULL;
+    b->len = b->cap = 0;
+}
+
+/* canada-like: polygons of coordinate pairs with full-precision doubles */
+void make_numbers(corpus* c) {
+    buffer b = { NULL, 0, 0 };
+    size_t i, j;
+    buf_puts(&b, "{\"type\":\"FeatureCollection\",\"features\":[{\"type\":\"Polygon\",\"coordinates\":[");
+    for (i = 0; i < 480; i++) {
+        buf_puts(&b, i ? ",[" : "[");
+        for (j = 0; j < 100; j++) {
+            buf_printf(&b, j ? ",[%.15g," : "[%.15g,", -141.0 + (rng() % 1000000) / 7919.0);
+            buf_printf(&b, "%.15g]", 41.0 + (rng() % 1000000) / 104729.0);
+        }
+        buf_puts(&b, "]");
+    }
+    buf_puts(&b, "]}]}");
+    corpus_add(c, &b);
+}
+
+/* twitter-like: statuses with unicode text, escapes and nested user objects */
+void make_strings(corpus* c) {
+    static const char* words[] = { "hello", "\\u3053\\u3093\\u306b\\u3061\\u306f", "json", "\xe4\xba\x93", "\\\"quoted\\\"",
+        "line\\nbreak", "\xf0\x9d\x84\x9e", "caf\xc3\xa9", "http:\\/\\/example.com\\/path", "RT", "@user", "#tag" };
+    buffer b = { NULL, 0, 0 };
+    size_t i, j;
+    buf_puts(&b, "{\"statuses\":[");
+    for (i = 0; i < 1500; i++) {
+        if (i) buf_puts(&b, ",");
+        buf_printf(&b, "{\"id\":%.0f,\"text\":\"", 5e17 + i);
+        for (j = 0; j < 20; j++) {
+            if (j) buf_puts(&b, " ");
+            buf_puts(&b, words[rng() % (sizeof(words) / sizeof(words[0]))]);
+        }
+        buf_puts(&b, "\",\"lang\":\"ja\",\"truncated\":false,\"user\":{\"name\":\"");
+        buf_puts(&b, words[rng() % (sizeof(words) / sizeof(words[0]))]);
+        buf_puts(&b, "\",\"screen_name\":\"bench_user\",\"description\":\"");
+        for (j = 0; j < 8; j++) buf_puts(&b, words[rng() % (sizeof(words) / sizeof(words[0]))]);
+        buf_printf(&b, "\",\"followers_count\":%.0f,\"verified\":true},\"entities\":{\"hashtags\":[],\"urls\":[]}}", rng() % 100000);
+    }
+    buf_puts(&b, "]}");
+    corpus_add(c, &b);
+}
+
+/* deeply nested arrays and objects, many times over */
+void make_nested(corpus* c) {
+    buffer b = { NULL, 0, 0 };
+    size_t i, j;
+    buf_puts(&b, "[");
+    for (i = 0; i < 200; i++) {
+        if (i) buf_puts(&b, ",");
+        for (j = 0; j < 64; j++) buf_puts(&b, j % 2 ? "[" : "{\"k\":");
+        buf_puts(&b, "1");
+        for (j = 64; j > 0; j--) buf_puts(&b, (j - 1) % 2 ? "]" : "}");
+    }
+    buf_puts(&b, "]");
+    corpus_add(c, &b);
+}
+
+/* array of same-shaped records */
+void make_records(corpus* c) {
+    buffer b = { NULL, 0, 0 };
+    size_t i;
+    buf_puts(&b, "[");
+    for (i = 0; i < 20000; i++) {
+        buf_printf(&b, i ? ",{\"id\":%.0f," : "{\"id\":%.0f,", (double)i);
+        buf_printf(&b, "\"ts\":%.0f,\"type\":\"event\",\"name\":\"record\",", 1.7e9 + rng() % 100000);
+        buf_printf(&b, "\"score\":%.6g,\"active\":true,\"tags\":[\"a\",\"b\"],\"parent\":null}", (rng() % 10000) / 100.0);
+    }
+    buf_puts(&b, "]");
+    corpus_add(c, &b);
+}
+
+/* many tiny standalone messages */
+void make_tiny(corpus* c) {
+    buffer b = { NULL, 0, 0 };
+    size_t i;
+    for (i = 0; i < 20000; i++) {
+        buf_printf(&b, "{\"id\":%.0f,\"type\":\"ping\",\"ok\":true}", (double)(rng() % 1000000));
+        corpus_add(c, &b);
+    }
+}
+
+/* looks up every key of every object in the tree */
+size_t lookup_all(const json_value* v) {
+    size_t i, found = 0;
+    if (get_value_type(v) == VALUE_ARRAY) {
+        for (i = 0; i < get_value_array_size(v); i++) found += lookup_all(get_value_array_element(v, i));
+    }
+    else if (get_value_type(v) == VALUE_OBJECT) {
+        for (i = 0; i < get_value_object_size(v); i++) {
+            json_member* m = get_value_object_member(v, i);
+            size_t len;
+            const char* key = get_member_key(m, &len);
+            found += object_find_member(v, key, len);
+            found += lookup_all(get_member_value(m));
+        }
+    }
+    return found;
+}
+
+/* looks up the same few keys in every object, by name or through json_key handles */
+size_t lookup_hot(const json_value* v, json_key* keys, size_t n, int keyed) {
+    size_t i, found = 0;
+    if (get_value_type(v) == VALUE_ARRAY) {
+        for (i = 0; i < get_value_array_size(v); i++) found += lookup_hot(get_value_array_element(v, i), keys, n, keyed);
+    }
+    else if (get_value_type(v) == VALUE_OBJECT) {
+        for (i = 0; i < n; i++) {
+            if (keyed) found += object_find_key(v, &keys[i]);
+            else found += object_find_member(v, keys[i].key, keys[i].length);
+        }
+        for (i = 0; i < get_value_object_size(v); i++) found += lookup_hot(get_member_value(get_value_object_member(v, i)), keys, n, keyed);
+    }
+    return found;
+}
+
+void report(const corpus* c, const char* op, double seconds, size_t rounds, size_t allocs) {
+    double docs = (double)c->count * rounds;
+    printf("%-8s %-10s %10.1f MB/s %12.0f docs/s %10.1f allocs/doc\n", c->name, op,
+        c->bytes * (double)rounds / seconds / (1024 * 1024), docs / seconds, allocs / docs);
+}
+
+void bench_corpus(const corpus* c) {
+    json_value* vals = (json_value*)malloc(c->count * sizeof(json_value));
+    json_value* copies = (json_value*)malloc(c->count * sizeof(json_value));
+    size_t* lens = (size_t*)malloc(c->count * sizeof(size_t));
+    double t_parse = 0, t_free = 0, t_valid = 0, t_lazy = 0, t_gen = 0, t_copy = 0, t_eq = 0, t_find = 0, t0, t1;
+    size_t a_parse = 0, a_lazy = 0, a_gen = 0, a_copy = 0, rounds, i, found = 0, equal = 0;
+    json_key keys[3];
+    int keyed;
+
+    for (rounds = 0; rounds == 0 || t_parse + t_free < min_seconds; rounds++) {
+        alloc_count = 0;
+        t0 = now();
+        for (i = 0; i < c->count; i++) {
+            value_init(&vals[i]);
+            if (json_parse(&vals[i], c->docs[i]) != PARSE_OK) {
+                fprintf(stderr, "%s: parse failed\n", c->name);
+                exit(1);
+            }
+        }
+        t1 = now();
+        a_parse += alloc_count;
+        t_parse += t1 - t0;
+        for (i = 0; i < c->count; i++) free_value(&vals[i]);
+        t_free += now() - t1;
+    }
+    report(c, "parse", t_parse, rounds, a_parse);
+    report(c, "free", t_free, rounds, 0);
+
+    for (i = 0; i < c->count; i++) lens[i] = strlen(c->docs[i]);
+    for (rounds = 0; rounds == 0 || t_valid < min_seconds; rounds++) {
+        t0 = now();
+        for (i = 0; i < c->count; i++) {
+            if (json_validate(c->docs[i], lens[i]) != PARSE_OK) {
+                fprintf(stderr, "%s: validate failed\n", c->name);
+                exit(1);
+            }
+        }
+        t_valid += now() - t0;
+    }
+    report(c, "validate", t_valid, rounds, 0);
+
+    /* parse, re-emit and free with numbers left as text, the proxy path */
+    for (rounds = 0; rounds == 0 || t_lazy < min_seconds; rounds++) {
+        json_parse_options opt;
+        memset(&opt, 0, sizeof(opt));
+        opt.lazy_numbers = 1;
+        alloc_count = 0;
+        t0 = now();
+        for (i = 0; i < c->count; i++) {
+            char* json;
+            size_t len;
+            value_init(&vals[i]);
+            json_parse_ex(&vals[i], c->docs[i], &opt);
+            json_generate(&vals[i], &json, &len, 0);
+            json_free(json);
+            free_value(&vals[i]);
+        }
+        t_lazy += now() - t0;
+        a_lazy += alloc_count;
+    }
+    report(c, "lazy-trip", t_lazy, rounds, a_lazy);
+
+    for (i = 0; i < c->count; i++) {
+        value_init(&vals[i]);
+        json_parse(&vals[i], c->docs[i]);
+    }
+
+    for (rounds = 0; rounds == 0 || t_gen < min_seconds; rounds++) {
+        alloc_count = 0;
+        t0 = now();
+        for (i = 0; i < c->count; i++) {
+            char* json;
+            size_t len;
+            json_generate(&vals[i], &json, &len, 0);
+            json_free(json);
+        }
+        t_gen += now() - t0;
+        a_gen += alloc_count;
+    }
+    report(c, "stringify", t_gen, rounds, a_gen);
+
+    for (rounds = 0; rounds == 0 || t_copy < min_seconds; rounds++) {
+        alloc_count = 0;
+        t0 = now();
+        for (i = 0; i < c->count; i++) {
+            value_init(&copies[i]);
+            value_copy(&copies[i], &vals[i]);
+        }
+        t_copy += now() - t0;
+        a_copy += alloc_count;
+        for (i = 0; i < c->count; i++) free_value(&copies[i]);
+    }
+    report(c, "copy", t_copy, rounds, a_copy);
+
+    for (i = 0; i < c->count; i++) {
+        value_init(&copies[i]);
+        value_copy(&copies[i], &vals[i]);
+    }
+    for (rounds = 0; rounds == 0 || t_eq < min_seconds; rounds++) {
+        t0 = now();
+        for (i = 0; i < c->count; i++) equal += value_is_equal(&vals[i], &copies[i]);
+        t_eq += now() - t0;
+    }
+    report(c, "equal", t_eq, rounds, 0);
+    if (equal != c->count * rounds) fprintf(stderr, "%s: copies compare unequal\n", c->name);
+
+    for (rounds = 0; rounds == 0 || t_find < min_seconds; rounds++) {
+        t0 = now();
+        for (i = 0; i < c->count; i++) found += lookup_all(&vals[i]);
+        t_find += now() - t0;
+    }
+    report(c, "lookup", t_find, rounds, 0);
+    printf("%-8s %-10s %10.0f lookups/s\n", c->name, "", found / t_find);
+
+    /* the same walk over trees compacted into one block each */
+    t0 = now();
+    for (i = 0; i < c->count; i++) json_value_compact(&copies[i]);
+    report(c, "compact", now() - t0, 1, 0);
+    for (found = 0, t_find = 0, rounds = 0; rounds == 0 || t_find < min_seconds; rounds++) {
+        t0 = now();
+        for (i = 0; i < c->count; i++) found += lookup_all(&copies[i]);
+        t_find += now() - t0;
+    }
+    report(c, "lookup-c", t_find, rounds, 0);
+
+    /* hot keys by name, then through handles that remember the last slot */
+    json_key_init(&keys[0], "id", 2);
+    json_key_init(&keys[1], "ts", 2);
+    json_key_init(&keys[2], "type", 4);
+    for (keyed = 0; keyed < 2; keyed++) {
+        for (found = 0, t_find = 0, rounds = 0; rounds == 0 || t_find < min_seconds; rounds++) {
+            t0 = now();
+            for (i = 0; i < c->count; i++) found += lookup_hot(&vals[i], keys, 3, keyed);
+            t_find += now() - t0;
+        }
+        report(c, keyed ? "hot-keys-k" : "hot-keys", t_find, rounds, 0);
+    }
+
+    for (i = 0; i < c->count; i++) {
+        free_value(&vals[i]);
+        free_value(&copies[i]);
+    }
+    free(vals);
+    free(copies);
+    free(lens);
+}
+
+void free_corpus(corpus* c) {
+    size_t i;
+    for (i = 0; i < c->count; i++) free(c->docs[i]);
+    free(c->docs);
+    free(c->lens);
+}
+
+int main(int argc, char** argv) {
+    json_allocator a = { bench_malloc, bench_realloc, bench_free, NULL };
+    corpus corpora[] = {
+        { "numbers", NULL, NULL, 0, 0 },
+        { "strings", NULL, NULL, 0, 0 },
+        { "nested", NULL, NULL, 0, 0 },
+        { "records", NULL, NULL, 0, 0 },
+        { "tiny", NULL, NULL, 0, 0 },
+    };
+    size_t i;
+    if (argc > 1) min_seconds = atof(argv[1]);
+    json_set_allocator(&a);
+    make_numbers(&corpora[0]);
+    make_strings(&corpora[1]);
+    make_nested(&corpora[2]);
+    make_records(&corpora[3]);
+    make_tiny(&corpora[4]);
+
+    for (i = 0; i < sizeof(corpora) / sizeof(corpora[0]); i++) {
+        printf("%-8s %.2f MB in %zu docs\n", corpora[i].name, corpora[i].bytes / (1024.0 * 1024.0), corpora[i].count);
+        bench_corpus(&corpora[i]);
+        free_corpus(&corpora[i]);
+    }
+#ifdef BENCH_RUSAGE
+    {
+        struct rusage ru;
+        getrusage(RUSAGE_SELF, &ru);
+        printf("peak rss %ld KB\n", (long)ru.ru_maxrss);  /* bytes on macOS */
+    }
+#endif
+    json_set_allocator(NULL);
+    return 0;
+}
@@ -1,43 +1,480 @@
+#if (defined(__unix__) || defined(__APPLE__)) && !defined(_POSIX_C_SOURCE)
+#define _POSIX_C_SOURCE 200809L  /* st_mtim and pthreads under -std=c99 */
+#endif
 #include "qgcjson.h"
 
 #include <assert.h>
 #include <errno.h>
+#include <limits.h>
 #include <math.h>
+#include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
 #include <stdio.h>
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#include <emmintrin.h>
+#define QGCJSON_SSE2
+#endif
+#if defined(_MSC_VER)
+#include <intrin.h>
+#elif defined(QGCJSON_STATS) && (defined(__x86_64__) || defined(__i386__))
+#include <x86intrin.h>
+#endif
+#if defined(__unix__) || defined(__APPLE__)
+#include <fcntl.h>
+#include <pthread.h>
+#include <sched.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#define QGCJSON_MMAP
+#elif defined(_WIN32)
+#define WIN32_LEAN_AND_MEAN
+#define NOMINMAX
+#include <windows.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#endif
+
+/* 
+ * key sequence of an object, learned while parsing an array so that same-shaped siblings match
+ * each key with one compare. the keys follow the header and such siblings point at them, the
+ * templates carry the prefix and index links each sibling copies.
+ */
+typedef struct json_shape {
+    long refs;
+    size_t size;
+    json_member* members;
+} json_shape;
+#define SHAPE_OF(members) ((json_shape*)(members)[0].key - 1)
+#define SHAPE_RELEARN 4  /* times an array adopts a new shape after a sibling diverges */
+typedef struct shape_slot {
+    json_shape* shape;
+    size_t objects;  /* parsed without the shape */
+    unsigned relearned;
+} shape_slot;
+
 typedef struct parse_helper {
     const char* json;
     char* stack;
     size_t size, top;
+    int lazy_numbers;
+    int (*raw)(void* ctx, const char* key, size_t key_length, size_t depth);
+    void* raw_ctx;
+    const char* end;  /* of the input, only kept while raw capture is on */
+    size_t depth;
+    size_t nodes;
+    json_parse_limits limits;  /* SIZE_MAX where unbounded */
+    shape_slot* shape;  /* of the array whose element is parsed next */
+#ifdef QGCJSON_STATS
+    json_parse_stats* stats;
+    int timing;
+#endif
 } parse_helper;
+void helper_init(parse_helper* ph, const char* json);
+void helper_limits(parse_helper* ph, const json_parse_limits* limits);
 void* helper_push(parse_helper* ph, size_t size);
 void* helper_pop(parse_helper* ph, size_t size);
 
 void parse_whitespace(parse_helper* ph);
+parse_result parse_document(parse_helper* ph, json_value* val);
 parse_result parse_value(parse_helper* ph, json_value* val);
 
 parse_result parse_string(parse_helper* ph, char** str, size_t* len);
 void set_string(json_value* val, const char* s, size_t len);
 const char* parse_hex4(const char* p, unsigned* codepoint);
+size_t utf8_sequence(const unsigned char* s, size_t avail);
 void encode_utf8(parse_helper* ph, unsigned codepoint);
 
 parse_result parse_value_string(parse_helper* ph, json_value* val);
 parse_result parse_value_number(parse_helper* ph, json_value* val);
+parse_result parse_number(parse_helper* ph, json_value* val);
 parse_result parse_value_object(parse_helper* ph, json_value* val);
 parse_result parse_value_array(parse_helper* ph, json_value* val);
+int shape_match(const char* json, const json_member* t);
+void shape_learn(shape_slot* slot, json_value* val);
+void shape_release(json_shape* shape);
+void shape_unshape(json_value* val);
 parse_result parse_value_true(parse_helper* ph, json_value* val);
 parse_result parse_value_false(parse_helper* ph, json_value* val);
 parse_result parse_value_null(parse_helper* ph, json_value* val);
+parse_result parse_value_raw(parse_helper* ph, json_value* val);
+void set_raw(json_value* val, const char* json, size_t len);
+void raw_expand(const json_value* val, json_value* tmp);
 
 generate_result stringify_value(parse_helper* ph, const json_value* val, int isFile);
 
 generate_result stringify_value_string(parse_helper* ph, const char* str, size_t len);
+generate_result stringify_escaped(parse_helper* ph, const char* str, size_t len, const char* hex_digits);
+size_t string_clean_prefix(const char* str, size_t len);
 generate_result stringify_value_array(parse_helper* ph, const json_value* val, int isFile);
 generate_result stringify_value_object(parse_helper* ph, const json_value* val, int isFile);
 
+/* header in front of shared storage, the value still points at the payload */
+typedef struct json_refcount {
+    long refs;
+    uint64_t hash;  /* 0 until json_value_hash fills it in */
+} json_refcount;
+#define REFCOUNT(p) ((json_refcount*)(p) - 1)
+#define STORAGE(val, p) ((val)->flags & VALUE_SHARED ? (void*)REFCOUNT(p) : (void*)(p))
+#if defined(_MSC_VER)
+#define REF_INC(p) _InterlockedIncrement(p)
+#define REF_DEC(p) _InterlockedDecrement(p)
+#define REF_LOAD(p) _InterlockedOr(p, 0)
+#define HASH_LOAD(p) ((uint64_t)_InterlockedOr64((volatile __int64*)(p), 0))
+#define HASH_STORE(p, h) _InterlockedExchange64((volatile __int64*)(p), (__int64)(h))
+#else
+#define REF_INC(p) __atomic_add_fetch(p, 1, __ATOMIC_RELAXED)
+#define REF_DEC(p) __atomic_sub_fetch(p, 1, __ATOMIC_ACQ_REL)
+#define REF_LOAD(p) __atomic_load_n(p, __ATOMIC_ACQUIRE)
+#define HASH_LOAD(p) __atomic_load_n(p, __ATOMIC_RELAXED)
+#define HASH_STORE(p, h) __atomic_store_n(p, h, __ATOMIC_RELAXED)
+#endif
+#if defined(_MSC_VER)
+#define RCU_LOAD(p) _InterlockedOr(p, 0)
+#define RCU_ADD(p, n) _InterlockedExchangeAdd(p, n)
+#define RCU_SWAP(p, v) _InterlockedExchange(p, v)
+#define RCU_LOAD_PTR(p) _InterlockedCompareExchangePointer((void* volatile*)(p), NULL, NULL)
+#define RCU_SWAP_PTR(p, v) _InterlockedExchangePointer((void* volatile*)(p), (v))
+#else
+#define RCU_LOAD(p) __atomic_load_n(p, __ATOMIC_SEQ_CST)
+#define RCU_ADD(p, n) __atomic_fetch_add(p, n, __ATOMIC_SEQ_CST)
+#define RCU_SWAP(p, v) __atomic_exchange_n(p, v, __ATOMIC_SEQ_CST)
+#define RCU_LOAD_PTR(p) __atomic_load_n(p, __ATOMIC_SEQ_CST)
+#define RCU_SWAP_PTR(p, v) __atomic_exchange_n(p, v, __ATOMIC_SEQ_CST)
+#endif
+#if defined(_WIN32)
+#define RCU_YIELD() SwitchToThread()
+#else
+#define RCU_YIELD() sched_yield()
+#endif
+#if defined(_MSC_VER)
+#define THREAD_LOCAL __declspec(thread)
+#elif defined(__GNUC__)
+#define THREAD_LOCAL __thread
+#elif defined(__STDC_VERSION__) && __STDC_VERSION__ >= 201112L && !defined(__STDC_NO_THREADS__)
+#define THREAD_LOCAL _Thread_local
+#else
+#define THREAD_LOCAL  /* no thread-local storage, json_set_thread_allocator applies to every thread */
+#endif
+void freeze_value(json_value* val);
+json_value* rcu_adopt(json_value* doc);
+
+/* source text of a VALUE_RAW_NUMBER, bits holds the double once something has read it */
+typedef struct raw_number {
+    uint64_t bits;
+    char text[1];
+} raw_number;
+#define RAW_NUMBER(val) ((raw_number*)(val)->str.s)
+#define RAW_NUMBER_SIZE(len) (offsetof(raw_number, text) + (len) + 1)
+#define RAW_PENDING 0x7FFC0DED0DEC0DEDULL  /* a nan, which strtod never makes of a json number */
+void set_raw_number(json_value* val, const char* text, size_t len);
+double raw_number_value(const json_value* val);
+
+/* 
+ * json_value_compact puts a tree into one block of entries, each shared storage with a refcount
+ * of its own. the block counts the entries still referenced and is freed with the last of them.
+ */
+typedef struct compact_block {
+    long live;
+} compact_block;
+typedef struct compact_header {
+    compact_block* block;
+    json_refcount rc;  /* right in front of the payload, so REFCOUNT works unchanged */
+} compact_header;
+#define COMPACT_ALIGN(n) (((n) + 7) & ~(size_t)7)
+void free_storage(const json_value* val, void* p);
+void compact_release(json_refcount* rc);
+size_t compact_size(const json_value* val);
+void compact_place(json_value* val, compact_block* block, char** cursor);
+
+void release_value(json_value* val);
+int value_release(const json_value* val, void* p);
+void value_retain(const json_value* val);
+/* 
+ * mutating a frozen tree races the threads reading it, so unlike other misuse this is checked
+ * in release builds as well
+ */
+#define ASSERT_ALWAYS(cond) do { assert(cond); if (!(cond)) abort(); } while(0)
+#define ASSERT_THAWED(val) ASSERT_ALWAYS(!((val)->flags & VALUE_FROZEN))
+void make_shared(json_value* val);
+uint64_t* cached_hash(const json_value* val);
+uint64_t hash_mix(uint64_t h);
+uint64_t hash_bytes(const char* p, size_t len, uint64_t seed);
+uint64_t value_hash(const json_value* val);
+
+void* default_malloc(void* ctx, size_t size);
+void* default_realloc(void* ctx, void* ptr, size_t size);
+void default_free(void* ctx, void* ptr);
+/* 
+ * the process allocator is published by pointer so that switching it is a single atomic swap.
+ * the copies json_set_allocator makes are never freed, another thread may still be reading one
+ */
+typedef struct allocator_record {
+    json_allocator a;
+    struct allocator_record* prev;  /* the copy made before, so all of them stay reachable */
+} allocator_record;
+static allocator_record default_allocator = { { default_malloc, default_realloc, default_free, NULL }, NULL };
+static allocator_record* process_allocator = &default_allocator;
+static allocator_record* allocator_records;
+static THREAD_LOCAL const json_allocator* thread_allocator;
+const json_allocator* current_allocator(void);
+void* allocator_malloc(size_t size);
+void* allocator_realloc(void* ptr, size_t size);
+void allocator_free(void* ptr);
+
+size_t grow_capacity(size_t capacity);
+json_member* object_append(json_value* v);
+int key_compare(const char* lhs, size_t lhs_len, const char* rhs, size_t rhs_len);
+uint64_t key_prefix(const char* key, size_t len);
+int member_compare(const json_member* m, const char* key, size_t len, uint64_t prefix);
+json_member* search_prefixed(json_member* members, const char* key, size_t len, uint64_t prefix);
+#define MEMBER_TREE_DEPTH 72  /* 2 log2 of the members uint32_t links can address, with room to spare */
+size_t member_tree_size(const json_member* members, uint32_t son);
+uint32_t* member_tree_flatten(const json_member* members, uint32_t son, uint32_t* out);
+uint32_t member_tree_build(json_member* members, const uint32_t* order, size_t n);
+int object_is_equal(const json_value* lhs, const json_value* rhs);
+int member_repeats(json_member* members, const json_member* m);
+typedef struct member_ref {
+    const json_member* m;
+    uint64_t hash;
+} member_ref;
+int member_ref_compare(const void* lhs, const void* rhs);
+int object_match_members(const json_value* lhs, const json_value* rhs);
+
+typedef struct builder_frame {
+    size_t parent, count;
+    char* key;  /* the container's own key when its parent is an object */
+    size_t key_length;
+    int is_object;
+} builder_frame;
+struct json_builder {
+    parse_helper ph;
+    size_t frame;
+    char* key;  /* pending key for the next value */
+    size_t key_length;
+};
+void builder_open(json_builder* b, int is_object);
+
+char* read_file(const char* path, size_t* len);
+int write_file(const char* path, const char* buf, size_t len);
+
+typedef struct binary_helper {
+    const unsigned char* p;
+    const unsigned char* end;
+    size_t depth;  /* containers that may still be opened, decoders recurse once per level */
+} binary_helper;
+#ifndef QGCJSON_MAX_DEPTH
+#define QGCJSON_MAX_DEPTH 1024  /* nesting accepted where no json_parse_limits apply */
+#endif
+typedef parse_result (*binary_parse_func)(binary_helper* bh, json_value* val);
+typedef generate_result (*binary_stringify_func)(parse_helper* ph, const json_value* val);
+
+parse_result binary_parse(json_value* val, const char* buf, size_t len, binary_parse_func f);
+parse_result binaryfile_parse(json_value* val, const char* path, binary_parse_func f);
+generate_result binary_generate(const json_value* val, char** buf, size_t* len, binary_stringify_func f);
+generate_result binaryfile_generate(const json_value* val, const char* path, binary_stringify_func f);
+int binary_get_be(binary_helper* bh, size_t bytes, uint64_t* n);
+void binary_put_be(parse_helper* ph, uint64_t n, size_t bytes);
+parse_result binary_parse_number(binary_helper* bh, json_value* val, size_t bytes);
+parse_result binary_parse_string(binary_helper* bh, json_value* val, uint64_t len);
+parse_result binary_parse_array(binary_helper* bh, json_value* val, uint64_t size, binary_parse_func f);
+parse_result binary_parse_object(binary_helper* bh, json_value* val, uint64_t size, binary_parse_func f);
+
+/* json_validate reuses the bounded cursor, reading past the end yields '\0' like the parser's terminator */
+#define VPEEK(vh) ((vh)->p < (vh)->end ? *(vh)->p : '\0')
+size_t string_plain_prefix(const unsigned char* str, size_t len);
+void validate_whitespace(binary_helper* vh);
+parse_result validate_value(binary_helper* vh);
+parse_result validate_literal(binary_helper* vh, const char* literal, size_t len);
+parse_result validate_number(binary_helper* vh);
+parse_result validate_string(binary_helper* vh);
+parse_result validate_container(binary_helper* vh);
+
+parse_result cbor_parse_value(binary_helper* bh, json_value* val);
+void cbor_put_head(parse_helper* ph, unsigned major, uint64_t n);
+generate_result cbor_stringify_value(parse_helper* ph, const json_value* val);
+parse_result msgpack_parse_value(binary_helper* bh, json_value* val);
+void msgpack_put_head(parse_helper* ph, unsigned char fix, unsigned char base, uint64_t n, size_t fix_max);
+generate_result msgpack_stringify_value(parse_helper* ph, const json_value* val);
+
+/* snapshot layout, all offsets are relative to the start of the blob and 8-byte aligned */
+typedef struct snapshot_node {
+    uint32_t type, reserved;
+    uint64_t a, b;  /* number bits | string, array, object: payload offset, length */
+} snapshot_node;
+typedef struct snapshot_member {
+    uint64_t key, key_length;
+    snapshot_node value;
+} snapshot_member;  /* object payload: members, then a uint32_t index sorted by key */
+typedef struct snapshot_header {
+    char magic[8];
+    uint32_t version, endian;
+    uint64_t size;
+    snapshot_node root;
+} snapshot_header;
+typedef struct snapshot_checker {
+    const char* base;
+    size_t size;
+    size_t next;   /* where snapshot_reserve would have put the next payload */
+    size_t depth;
+    int too_deep;  /* nesting ran out, the blob may still be well-formed */
+} snapshot_checker;
+
+size_t snapshot_reserve(parse_helper* ph, size_t size);
+void snapshot_stringify_value(parse_helper* ph, size_t node, const json_value* val);
+int snapshot_member_compare(const void* lhs, const void* rhs);
+int snapshot_check_payload(snapshot_checker* sc, uint64_t off, uint64_t size);
+int snapshot_check_value(snapshot_checker* sc, const snapshot_node* node);
+
+const json_field* schema_find(const json_schema* s, const char* key, size_t len);
+parse_result struct_parse_object(parse_helper* ph, char* out, const json_schema* s);
+parse_result struct_parse_field(parse_helper* ph, char* out, const json_field* f);
+parse_result struct_skip_value(parse_helper* ph);
+void struct_stringify_object(parse_helper* ph, const char* in, const json_schema* s);
+
+typedef struct canonical_helper {
+    parse_helper ph;
+    parse_helper trail;  /* members waiting in the in-order walk of an object's index */
+    const json_sink* sink;
+} canonical_helper;
+#define CANONICAL_FLUSH_SIZE 4096
+void canonical_number(parse_helper* ph, double d);
+generate_result canonical_value(canonical_helper* ch, const json_value* val);
+void fnv1a_write(void* ctx, const char* data, size_t len);
+
+typedef struct file_cache_key {
+    unsigned long long dev, ino, size;
+    long long mtime_sec;
+    long mtime_nsec;
+} file_cache_key;
+typedef struct file_cache_entry file_cache_entry;
+struct file_cache_entry {
+    file_cache_entry *prev, *next;  /* lru list, most recent first */
+    file_cache_entry* chain;  /* next in the bucket */
+    char* path;
+    size_t path_length;
+    uint64_t path_hash, content_hash;
+    file_cache_key key;
+    size_t bytes;
+    json_value doc;  /* shared, handed out with value_copy */
+};
+#if defined(_WIN32)
+#define CACHE_LOCK_T SRWLOCK
+#define CACHE_LOCK_INIT(l) InitializeSRWLock(l)
+#define CACHE_LOCK_DESTROY(l) ((void)(l))
+#define CACHE_LOCK(l) AcquireSRWLockExclusive(l)
+#define CACHE_UNLOCK(l) ReleaseSRWLockExclusive(l)
+#else
+#define CACHE_LOCK_T pthread_mutex_t
+#define CACHE_LOCK_INIT(l) pthread_mutex_init(l, NULL)
+#define CACHE_LOCK_DESTROY(l) pthread_mutex_destroy(l)
+#define CACHE_LOCK(l) pthread_mutex_lock(l)
+#define CACHE_UNLOCK(l) pthread_mutex_unlock(l)
+#endif
+struct json_file_cache {
+    CACHE_LOCK_T lock;
+    file_cache_entry** buckets;
+    size_t mask;
+    file_cache_entry *head, *tail;
+    size_t budget;
+    int verify;
+    const json_allocator* allocator;  /* current at creation, installed around every call */
+    json_file_cache_stats stats;
+};
+#define FILE_CACHE_INITIAL_BUCKETS 16
+int file_cache_stat(const char* path, file_cache_key* key);
+int file_cache_key_equal(const file_cache_key* lhs, const file_cache_key* rhs);
+file_cache_entry* file_cache_find(json_file_cache* c, const char* path, size_t len, uint64_t hash);
+void file_cache_touch(json_file_cache* c, file_cache_entry* e);
+void file_cache_unlink(json_file_cache* c, file_cache_entry* e);
+void file_cache_insert(json_file_cache* c, file_cache_entry* e);
+void file_cache_release(file_cache_entry* e);
+parse_result file_cache_load(json_file_cache* c, json_value* val, const char* path);
+size_t value_footprint(const json_value* val);
+
+typedef struct load_job {
+    const char* const* paths;
+    json_value* vals;
+    parse_result* results;
+    size_t n;
+    size_t next;  /* shared cursor, claimed with FETCH_ADD */
+    const json_allocator* allocator;  /* the caller's, installed on every worker */
+} load_job;
+#if defined(_MSC_VER)
+#define FETCH_ADD(p, n) (size_t)InterlockedExchangeAdd64((volatile LONG64*)(p), (LONG64)(n))
+#else
+#define FETCH_ADD(p, n) __atomic_fetch_add(p, n, __ATOMIC_RELAXED)
+#endif
+FILE* load_open(const char* path);
+parse_result load_parse(parse_helper* ph, json_value* val, FILE* file, char** buf, size_t* cap);
+void load_files(load_job* job);
+#if defined(_WIN32)
+DWORD WINAPI load_thread(LPVOID job);
+#else
+void* load_thread(void* job);
+#endif
+
+#define CURSOR_BLOCK_SIZE 65536
+typedef enum { CURSOR_START, CURSOR_FIRST, CURSOR_NEXT, CURSOR_LAST, CURSOR_DONE } cursor_state;
+struct json_cursor {
+    FILE* file;
+    char* buf;
+    size_t pos, len, cap;  /* unread input is buf[pos, len), buf[len] is kept writable */
+    int eof;
+    cursor_state state;
+    parse_result error;
+    char* path;
+    parse_helper ph;  /* parser scratch, reused for every element */
+    parse_helper token;
+    shape_slot slot;  /* elements are siblings, even though each is parsed on its own */
+};
+int cursor_fill(json_cursor* cur);
+int cursor_peek(json_cursor* cur);
+size_t cursor_extent(json_cursor* cur);
+parse_result cursor_parse(json_cursor* cur, json_value* val);
+parse_result cursor_skip(json_cursor* cur);
+parse_result cursor_key(json_cursor* cur, int* found);
+parse_result cursor_seek(json_cursor* cur);
+parse_result cursor_end(json_cursor* cur);
+
+int diff_same(const json_value* a, const json_value* b);
+void diff_push_token(parse_helper* ph, const char* key, size_t len);
+void diff_push_index(parse_helper* ph, size_t idx);
+json_value* diff_op(json_value* patch, parse_helper* ph, const char* op, const json_value* val);
+void diff_value(json_value* patch, parse_helper* ph, const json_value* a, const json_value* b);
+int pointer_token(parse_helper* ph, const char** p, const char* end);
+int pointer_index(const parse_helper* ph, size_t size, int append, size_t* idx);
+json_value* pointer_child(json_value* v, parse_helper* ph, int mut);
+json_value* pointer_resolve(json_value* v, const json_value* path, parse_helper* ph, int parent, int mut);
+patch_result patch_add(json_value* doc, const json_value* path, json_value* val, parse_helper* ph);
+patch_result patch_remove(json_value* doc, const json_value* path, json_value* out, parse_helper* ph);
+patch_result patch_operation(json_value* doc, json_value* op, parse_helper* ph);
+
 #define HELPER_STACK_INITIAL_SIZE 256
 
+#ifdef QGCJSON_STATS
+unsigned long long stats_cycles(void);
+#define STAT(ph, expr) do { if ((ph)->stats != NULL) (ph)->stats->expr; } while(0)
+#define STAT_CLOCK(ph) ((ph)->stats != NULL && (ph)->timing ? stats_cycles() : 0)
+#define STAT_TIME(ph, field, t0) do { if ((ph)->stats != NULL && (ph)->timing) (ph)->stats->field += stats_cycles() - (t0); } while(0)
+#define STAT_DEPTH(ph, d)\
+    do {\
+        (ph)->depth += (d);\
+        if ((ph)->stats != NULL && (ph)->depth > (ph)->stats->max_depth) (ph)->stats->max_depth = (ph)->depth;\
+    } while(0)
+#else
+#define STAT(ph, expr) do { } while(0)
+#define STAT_CLOCK(ph) 0
+#define STAT_TIME(ph, field, t0) do { (void)(t0); } while(0)
+#define STAT_DEPTH(ph, d) do { (ph)->depth += (d); } while(0)  /* raw capture reports it */
+#endif
+
+#define JSON_MALLOC(size) allocator_malloc(size)
+#define JSON_REALLOC(ptr, size) allocator_realloc((ptr), (size))
+#define JSON_FREE(ptr) allocator_free(ptr)
+
 #define EXPECT(ph, ch) do { assert(*ph->json == (ch)); ph->json++; } while(0)
 #define ISDIGIT(ch) ((ch) >= '0' && (ch) <= '9') 
 #define ISDIGIT1TO9(ch) ((ch) >= '1' && (ch) <= '9')
@@ -46,47 +483,123 @@ generate_result stringify_value_object(parse_helper* ph, const json_value* val,
 #define PUTM(ph, m) do { memcpy(helper_push(ph, sizeof(json_member)), &m, sizeof(json_member)); sz++; } while(0)
 #define PUTS(ph, s, len) do { memcpy(helper_push(ph, len), s, len); } while(0)
 
+#ifdef QGCJSON_STATS
+/* cycle counter where the cpu has one, otherwise clock ticks */
+unsigned long long stats_cycles(void) {
+#if defined(_MSC_VER) || defined(__x86_64__) || defined(__i386__)
+    return __rdtsc();
+#else
+    return (unsigned long long)clock();
+#endif
+}
+#endif
+
+void* default_malloc(void* ctx, size_t size) {
+    (void)ctx;
+    return malloc(size);
+}
+
+void* default_realloc(void* ctx, void* ptr, size_t size) {
+    (void)ctx;
+    return realloc(ptr, size);
+}
+
+void default_free(void* ctx, void* ptr) {
+    (void)ctx;
+    free(ptr);
+}
+
+void json_set_allocator(const json_allocator* a) {
+    allocator_record* r = &default_allocator;
+    if (a != NULL) {
+        assert(a->malloc_fn != NULL && a->realloc_fn != NULL && a->free_fn != NULL);
+        r = (allocator_record*)malloc(sizeof(allocator_record));
+        r->a = *a;
+        r->prev = (allocator_record*)RCU_SWAP_PTR(&allocator_records, r);
+    }
+    (void)RCU_SWAP_PTR(&process_allocator, r);  /* the old one is never freed, readers may hold it */
+}
+
+void json_set_thread_allocator(const json_allocator* a) {
+    assert(a == NULL || (a->malloc_fn != NULL && a->realloc_fn != NULL && a->free_fn != NULL));
+    thread_allocator = a;
+}
+
+const json_allocator* json_get_allocator(void) {
+    return current_allocator();
+}
+
+const json_allocator* current_allocator(void) {
+    if (thread_allocator != NULL) return thread_allocator;
+    return &((allocator_record*)RCU_LOAD_PTR(&process_allocator))->a;
+}
+
+void* allocator_malloc(size_t size) {
+    const json_allocator* a = current_allocator();
+    return a->malloc_fn(a->ctx, size);
+}
+
+void* allocator_realloc(void* ptr, size_t size) {
+    const json_allocator* a = current_allocator();
+    return a->realloc_fn(a->ctx, ptr, size);
+}
+
+void allocator_free(void* ptr) {
+    const json_allocator* a = current_allocator();
+    a->free_fn(a->ctx, ptr);
+}
+
+void json_free(void* ptr) {
+    JSON_FREE(ptr);
+}
+
 parse_result json_parse(json_value* val, const char* json) {
+    return json_parse_ex(val, json, NULL);
+}
+
+parse_result json_parse_ex(json_value* val, const char* json, const json_parse_options* opt) {
     parse_helper ph;
     parse_result ret;
+    unsigned long long t0;
     assert(val != NULL);
-    ph.json = json;
-    ph.stack = NULL;
-    ph.size = ph.top = 0;
-    value_init(val);
-
-    parse_whitespace(&ph);
-    if ((ret = parse_value(&ph, val)) == PARSE_OK) {
-        parse_whitespace(&ph);
-        if (*ph.json != '\0') {
-            ret = PARSE_ROOT_NOT_SINGULAR;
-            val->type = VALUE_NULL;
+    helper_init(&ph, json);
+    if (opt != NULL && opt->stats != NULL) memset(opt->stats, 0, sizeof(json_parse_stats));
+    if (opt != NULL) {
+        helper_limits(&ph, opt->limits);
+        /* strnlen looks no further than the bound, however long the input is */
+        if (ph.limits.max_bytes != SIZE_MAX && strnlen(json, ph.limits.max_bytes + 1) > ph.limits.max_bytes) {
+            value_init(val);
+            return PARSE_TOO_LARGE;
+        }
+        ph.lazy_numbers = opt->lazy_numbers;
+        if ((ph.raw = opt->raw) != NULL) {
+            ph.raw_ctx = opt->raw_ctx;
+            ph.end = json + strlen(json);
         }
     }
-    assert(ph.top == 0);
-    free(ph.stack);
+#ifdef QGCJSON_STATS
+    if (opt != NULL) {
+        ph.stats = opt->stats;
+        ph.timing = opt->timing;
+    }
+#endif
+    t0 = STAT_CLOCK(&ph);
+    ret = parse_document(&ph, val);
+    JSON_FREE(ph.stack);
+    STAT(&ph, bytes = (size_t)(ph.json - json));
+    STAT_TIME(&ph, cycles_total, t0);
     return ret;
 }
 
 parse_result jsonfile_parse(json_value *val, const char* path) {
-    FILE* json_file = fopen(path, "r");
-    parse_result ret = PARSE_OK;
-    if (json_file == NULL) {
+    parse_result ret;
+    size_t len;
+    char* json = read_file(path, &len);
+    if (json == NULL) {
         return CAN_NOT_OPEN_FILE;
     }
-    fseek(json_file, 0, SEEK_END);
-    long sz = ftell(json_file);
-    fseek(json_file, 0, SEEK_SET);
-    char* json = (char*)malloc(sz + 1);
-    fread(json, 1, sz, json_file);
-    fclose(json_file);
-
-    long p = 0;
-    for (long i = 0; i < sz; i++) 
-        if (json[i] == '\n') sz--;
-    json[sz] = '\0';
     ret = json_parse(val, json);
-    free(json);
+    JSON_FREE(json);
     return ret;
 }
 
@@ -94,10 +607,10 @@ generate_result json_generate(const json_value* val, char** json, size_t* len, i
     assert(val != NULL && json != NULL);
     parse_helper ph;
     generate_result ret = STRINGIFY_OK;
-    ph.stack = (char*)malloc(ph.size = HELPER_STACK_INITIAL_SIZE);
-    ph.top = 0;
+    helper_init(&ph, NULL);
+    ph.stack = (char*)JSON_MALLOC(ph.size = HELPER_STACK_INITIAL_SIZE);
     if ((ret = stringify_value(&ph, val, isFile)) != STRINGIFY_OK) {
-        free(ph.stack);
+        JSON_FREE(ph.stack);
         *json = NULL;
         return ret;
     }
@@ -112,14 +625,63 @@ generate_result jsonfile_generate(const json_value* val, const char* path) {
     char* json;
     size_t len;
     if ((ret = json_generate(val, &json, &len, 1)) != STRINGIFY_OK) return ret;
+    if (!write_file(path, json, len)) ret = CAN_NOT_OPEN_FILE_W;
+    JSON_FREE(json);
+    return ret;
+}
 
-    FILE* file = fopen(path, "w");
-    if (file == NULL) {
-        return CAN_NOT_OPEN_FILE_W;
-    }
+/* reads the whole file in binary mode, the buffer is '\0' terminated */
+char* read_file(const char* path, size_t* len) {
+    FILE* file = fopen(path, "rb");
+    char* buf;
+    long sz;
+    if (file == NULL) return NULL;
+    fseek(file, 0, SEEK_END);
+    sz = ftell(file);
     fseek(file, 0, SEEK_SET);
-    fwrite(json, 1, len, file);
-    return ret;
+    if (sz < 0 || (buf = (char*)JSON_MALLOC((size_t)sz + 1)) == NULL) {
+        fclose(file);
+        return NULL;
+    }
+    *len = fread(buf, 1, (size_t)sz, file);
+    buf[*len] = '\0';
+    fclose(file);
+    return buf;
+}
+
+int write_file(const char* path, const char* buf, size_t len) {
+    FILE* file = fopen(path, "wb");
+    int ok;
+    if (file == NULL) return 0;
+    ok = fwrite(buf, 1, len, file) == len;
+    return fclose(file) == 0 && ok;
+}
+
+void helper_init(parse_helper* ph, const char* json) {
+    ph->json = json;
+    ph->stack = NULL;
+    ph->size = ph->top = 0;
+    ph->lazy_numbers = 0;
+    ph->raw = NULL;
+    ph->raw_ctx = NULL;
+    ph->end = NULL;
+    ph->depth = ph->nodes = 0;
+    helper_limits(ph, NULL);
+    ph->shape = NULL;
+#ifdef QGCJSON_STATS
+    ph->stats = NULL;
+    ph->timing = 0;
+#endif
+}
+
+#define LIMIT(n) ((n) == 0 ? SIZE_MAX : (n))
+
+void helper_limits(parse_helper* ph, const json_parse_limits* limits) {
+    ph->limits.max_depth = limits == NULL ? SIZE_MAX : LIMIT(limits->max_depth);
+    ph->limits.max_bytes = limits == NULL ? SIZE_MAX : LIMIT(limits->max_bytes);
+    ph->limits.max_string_length = limits == NULL ? SIZE_MAX : LIMIT(limits->max_string_length);
+    ph->limits.max_elements = limits == NULL ? SIZE_MAX : LIMIT(limits->max_elements);
+    ph->limits.max_nodes = limits == NULL ? SIZE_MAX : LIMIT(limits->max_nodes);
 }
 
 void* helper_push(parse_helper* ph, size_t size) {
@@ -129,10 +691,15 @@ void* helper_push(parse_helper* ph, size_t size) {
         if (ph->size == 0) ph->size = HELPER_STACK_INITIAL_SIZE;
         while (ph->top + size >= ph->size) ph->size += ph->size >> 1;
 
-        ph->stack = (char*)realloc(ph->stack, ph->size);
+        if (ph->stack == NULL) STAT(ph, allocations++);
+        else STAT(ph, reallocs++);
+        ph->stack = (char*)JSON_REALLOC(ph->stack, ph->size);
     }
     ret = ph->stack + ph->top;
     ph->top += size;
+#ifdef QGCJSON_STATS
+    if (ph->stats != NULL && ph->top > ph->stats->stack_high_water) ph->stats->stack_high_water = ph->top;
+#endif
     return ret;
 }
 
@@ -147,17 +714,48 @@ void parse_whitespace(parse_helper* ph) {
     ph->json = p;
 }
 
+/* the whole of ph->json as one value, the scratch stack is left to the caller for reuse */
+parse_result parse_document(parse_helper* ph, json_value* val) {
+    parse_result ret;
+    value_init(val);
+    ph->nodes = 0;
+    parse_whitespace(ph);
+    if ((ret = parse_value(ph, val)) == PARSE_OK) {
+        parse_whitespace(ph);
+        if (*ph->json != '\0') {
+            ret = PARSE_ROOT_NOT_SINGULAR;
+            free_value(val);
+        }
+    }
+    assert(ph->top == 0);
+    return ret;
+}
+
 parse_result parse_value(parse_helper* ph, json_value* val) {
+    parse_result ret;
+    if (++ph->nodes > ph->limits.max_nodes) return PARSE_TOO_MANY_NODES;
     switch (*ph->json) {
-        case 't': return parse_value_true(ph, val);
-        case 'f': return parse_value_false(ph, val);
-        case 'n': return parse_value_null(ph, val);
-        default: return parse_value_number(ph, val);
-        case '"': return parse_value_string(ph, val);
-        case '[': return parse_value_array(ph, val);
-        case '{': return parse_value_object(ph, val);
+        case 't': ret = parse_value_true(ph, val); break;
+        case 'f': ret = parse_value_false(ph, val); break;
+        case 'n': ret = parse_value_null(ph, val); break;
+        default: ret = parse_value_number(ph, val); break;
+        case '"': ret = parse_value_string(ph, val); break;
+        case '[': 
+            if (ph->depth >= ph->limits.max_depth) return PARSE_TOO_DEEP;
+            STAT_DEPTH(ph, 1);
+            ret = parse_value_array(ph, val);
+            STAT_DEPTH(ph, -1);
+            break;
+        case '{': 
+            if (ph->depth >= ph->limits.max_depth) return PARSE_TOO_DEEP;
+            STAT_DEPTH(ph, 1);
+            ret = parse_value_object(ph, val);
+            STAT_DEPTH(ph, -1);
+            break;
         case '\0': return PARSE_EXPECT_VALUR;
     }
+    if (ret == PARSE_OK) STAT(ph, nodes[val->type]++);
+    return ret;
 }
 
 #define PARSE_STRING_ERROR(ret) do { ph->top = head; return ret; } while(0)
@@ -170,13 +768,16 @@ parse_result parse_string(parse_helper* ph, char** str, size_t* len) {
     p = ph->json;
     for(;;) {
         char ch = *p++;
+        if (ph->top - head > ph->limits.max_string_length) PARSE_STRING_ERROR(PARSE_STRING_TOO_LONG);
         switch (ch) {
             case '\"': 
                 *len = ph->top - head;
                 *str = helper_pop(ph, *len);
                 ph->json = p;
+                STAT(ph, string_bytes += *len);
                 return PARSE_OK;
             case '\\':
+                STAT(ph, escapes++);
                 switch (*p++) {
                     case '\"': PUTC(ph, '\"'); break;
                     case '\\': PUTC(ph, '\\'); break;
@@ -208,6 +809,14 @@ parse_result parse_string(parse_helper* ph, char** str, size_t* len) {
                 PARSE_STRING_ERROR(PARSE_MISS_QUOTATION_MARK);
             default:
                 if ((unsigned char)ch < 0x20) PARSE_STRING_ERROR(PARSE_INVALID_STRING_CHAR);
+                if ((unsigned char)ch >= 0x80) {
+                    /* a NUL stops the continuation checks, so claiming 4 bytes is safe */
+                    size_t n = utf8_sequence((const unsigned char*)p - 1, 4);
+                    if (n == 0) PARSE_STRING_ERROR(PARSE_INVALID_UTF8);
+                    PUTS(ph, p - 1, n);
+                    p += n - 1;
+                    break;
+                }
                 PUTC(ph, ch);
         }
     }
@@ -215,9 +824,10 @@ parse_result parse_string(parse_helper* ph, char** str, size_t* len) {
 
 void set_value_string(json_value* val, const char* s, size_t len) {
     assert(val != NULL && (s != NULL || len == 0));
+    ASSERT_THAWED(val);
     free_value(val);
-    val->str.s = (char*)malloc(len + 1);
-    memcpy(val->str.s, s, len);
+    val->str.s = (char*)JSON_MALLOC(len + 1);
+    if (len > 0) memcpy(val->str.s, s, len);
     val->str.s[len] = '\0';
     val->str.length = len;
     val->type = VALUE_STRING;
@@ -236,6 +846,30 @@ const char* parse_hex4(const char* p, unsigned* codepoint) {
     return p;
 }
 
+/* length of the well-formed utf-8 sequence at s, 0 for overlongs, surrogates, > U+10FFFF and truncation */
+size_t utf8_sequence(const unsigned char* s, size_t avail) {
+    unsigned char lo = 0x80, hi = 0xBF;
+    size_t n;
+    if (s[0] < 0x80) return 1;
+    if (s[0] < 0xC2) return 0;
+    if (s[0] < 0xE0) n = 2;
+    else if (s[0] < 0xF0) {
+        n = 3;
+        if (s[0] == 0xE0) lo = 0xA0;
+        else if (s[0] == 0xED) hi = 0x9F;
+    }
+    else if (s[0] < 0xF5) {
+        n = 4;
+        if (s[0] == 0xF0) lo = 0x90;
+        else if (s[0] == 0xF4) hi = 0x8F;
+    }
+    else return 0;
+    if (avail < 2 || s[1] < lo || s[1] > hi) return 0;
+    for (size_t i = 2; i < n; i++)
+        if (i >= avail || (s[i] & 0xC0) != 0x80) return 0;
+    return n;
+}
+
 void encode_utf8(parse_helper* ph, unsigned codepoint) {
     if (codepoint <= 0x7F) PUTC(ph, (codepoint & 0xFF));
     else if (codepoint <= 0x7FF) {
@@ -256,27 +890,223 @@ void encode_utf8(parse_helper* ph, unsigned codepoint) {
     }
 }
 
+/* of a frozen tree only the root may be freed, which frees all of it */
 void free_value(json_value* val) {
     assert(val != NULL);
+    ASSERT_ALWAYS((val->flags & (VALUE_FROZEN | VALUE_FROZEN_ROOT)) != VALUE_FROZEN);
+    release_value(val);
+}
+
+void release_value(json_value* val) {
     switch (val->type) {
+        case VALUE_NUMBER:
+            if (!(val->flags & VALUE_RAW_NUMBER)) break;
+            /* fall through */
         case VALUE_STRING:
-            free(val->str.s);
+        case VALUE_RAW:
+            if (value_release(val, val->str.s)) free_storage(val, val->str.s);
             break;
         case VALUE_ARRAY:
-            for (size_t i = 0; i < val->arr.size; ++i) free_value(get_value_array_element(val, i));
-            free(val->arr.values);
+            if (!value_release(val, val->arr.values)) break;
+            for (size_t i = 0; i < val->arr.size; ++i) release_value(&val->arr.values[i]);
+            free_storage(val, val->arr.values);
             break;
         case VALUE_OBJECT:
+            if (!value_release(val, val->obj.members)) break;
             for (size_t i = 0; i < val->obj.size; ++i) {
-                free(val->obj.members[i].key);
-                free_value(&val->obj.members[i].value);
+                if (!(val->flags & (VALUE_COMPACT | VALUE_SHAPED))) JSON_FREE(val->obj.members[i].key);
+                release_value(&val->obj.members[i].value);
             }
-            free(val->obj.members);
+            if (val->flags & VALUE_SHAPED) shape_release(SHAPE_OF(val->obj.members));
+            free_storage(val, val->obj.members);
             break;
         default:
             break;
     }
     val->type = VALUE_NULL;
+    val->flags = 0;
+}
+
+void free_storage(const json_value* val, void* p) {
+    if (val->flags & VALUE_COMPACT) compact_release(REFCOUNT(p));
+    else JSON_FREE(STORAGE(val, p));
+}
+
+/* an entry of a compacted block is done with, the block goes when its last entry does */
+void compact_release(json_refcount* rc) {
+    compact_block* block = ((compact_header*)((char*)rc - offsetof(compact_header, rc)))->block;
+    if (REF_DEC(&block->live) == 0) JSON_FREE(block);
+}
+
+/* drops one reference, returns whether the caller now owns the storage and has to free it */
+int value_release(const json_value* val, void* p) {
+    return !(val->flags & VALUE_SHARED) || REF_DEC(&REFCOUNT(p)->refs) == 0;
+}
+
+void value_retain(const json_value* val) {
+    switch (val->type) {
+        case VALUE_NUMBER:
+        case VALUE_STRING:
+        case VALUE_RAW: if (val->flags & VALUE_SHARED) REF_INC(&REFCOUNT(val->str.s)->refs); break;
+        case VALUE_ARRAY: if (val->flags & VALUE_SHARED) REF_INC(&REFCOUNT(val->arr.values)->refs); break;
+        case VALUE_OBJECT: if (val->flags & VALUE_SHARED) REF_INC(&REFCOUNT(val->obj.members)->refs); break;
+        default: break;
+    }
+}
+
+/* moves the storage of val and everything below it behind refcount headers */
+void make_shared(json_value* val) {
+    json_refcount* rc;
+    void* p;
+    size_t bytes;
+    if (val->flags & VALUE_SHARED) return;
+    switch (val->type) {
+        case VALUE_NUMBER:
+            if (!(val->flags & VALUE_RAW_NUMBER)) return;
+            p = val->str.s;
+            bytes = RAW_NUMBER_SIZE(val->str.length);
+            break;
+        case VALUE_STRING:
+        case VALUE_RAW:
+            p = val->str.s;
+            bytes = val->str.length + 1;
+            break;
+        case VALUE_ARRAY:
+            if ((p = val->arr.values) == NULL) return;
+            for (size_t i = 0; i < val->arr.size; i++) make_shared(&val->arr.values[i]);
+            bytes = val->arr.capacity * sizeof(json_value);
+            break;
+        case VALUE_OBJECT:
+            if ((p = val->obj.members) == NULL) return;
+            for (size_t i = 0; i < val->obj.size; i++) make_shared(&val->obj.members[i].value);
+            bytes = val->obj.capacity * sizeof(json_member);
+            break;
+        default:
+            return;
+    }
+    rc = (json_refcount*)JSON_MALLOC(sizeof(json_refcount) + bytes);
+    rc->refs = 1;
+    rc->hash = 0;
+    memcpy(rc + 1, p, bytes);
+    JSON_FREE(p);
+    switch (val->type) {
+        case VALUE_NUMBER:
+        case VALUE_STRING:
+        case VALUE_RAW: val->str.s = (char*)(rc + 1); break;
+        case VALUE_ARRAY: val->arr.values = (json_value*)(rc + 1); break;
+        default:
+            val->obj.members = (json_member*)(rc + 1);
+            break;
+    }
+    val->flags |= VALUE_SHARED;
+}
+
+void value_share(json_value* dst, json_value* src) {
+    assert(dst != NULL && src != NULL && dst != src);
+    ASSERT_THAWED(dst);
+    make_shared(src);
+    free_value(dst);
+    memcpy(dst, src, sizeof(json_value));
+    value_retain(dst);
+    dst->flags &= ~(VALUE_FROZEN | VALUE_FROZEN_ROOT);
+}
+
+int value_is_shared(const json_value* val) {
+    assert(val != NULL);
+    return (val->flags & VALUE_SHARED) != 0;
+}
+
+/* 
+ * gives val private top-level storage before it is mutated. children are left shared, so
+ * copying stops at this level; reaching further down goes through the *_mut accessors.
+ */
+void value_unshare(json_value* val) {
+    json_refcount* rc;
+    size_t i;
+    int sole, compact, shaped;
+    assert(val != NULL);
+    ASSERT_THAWED(val);
+    if ((val->flags & (VALUE_SHARED | VALUE_SHAPED)) == VALUE_SHAPED) shape_unshape(val);
+    if (!(val->flags & VALUE_SHARED)) return;
+    compact = (val->flags & VALUE_COMPACT) != 0;
+    shaped = (val->flags & VALUE_SHAPED) != 0;
+    val->flags &= ~(VALUE_SHARED | VALUE_COMPACT | VALUE_SHAPED);
+    switch (val->type) {
+        case VALUE_NUMBER:
+        case VALUE_STRING:
+        case VALUE_RAW: {
+            char* old = val->str.s;
+            size_t bytes = val->type == VALUE_NUMBER ? RAW_NUMBER_SIZE(val->str.length) : val->str.length + 1;
+            rc = REFCOUNT(old);
+            val->str.s = (char*)JSON_MALLOC(bytes);
+            memcpy(val->str.s, old, bytes);
+            if (REF_DEC(&rc->refs) == 0) {
+                if (compact) compact_release(rc);
+                else JSON_FREE(rc);
+            }
+            break;
+        }
+        case VALUE_ARRAY: {
+            json_value* old = val->arr.values;
+            rc = REFCOUNT(old);
+            sole = REF_LOAD(&rc->refs) == 1;
+            val->arr.values = (json_value*)JSON_MALLOC(val->arr.capacity * sizeof(json_value));
+            memcpy(val->arr.values, old, val->arr.size * sizeof(json_value));
+            for (i = 0; i < val->arr.size; i++) val->arr.values[i].flags &= ~(VALUE_FROZEN | VALUE_FROZEN_ROOT);
+            if (!sole) {
+                for (i = 0; i < val->arr.size; i++) value_retain(&val->arr.values[i]);
+                if (REF_DEC(&rc->refs) != 0) break;
+                for (i = 0; i < val->arr.size; i++) release_value(&old[i]);
+            }
+            if (compact) compact_release(rc);
+            else JSON_FREE(rc);
+            break;
+        }
+        case VALUE_OBJECT: {
+            json_member* old = val->obj.members;
+            rc = REFCOUNT(old);
+            sole = REF_LOAD(&rc->refs) == 1;
+            val->obj.members = (json_member*)JSON_MALLOC(val->obj.capacity * sizeof(json_member));
+            memcpy(val->obj.members, old, val->obj.size * sizeof(json_member));
+            /* keys in a compacted block or a shape stay there */
+            for (i = 0; (!sole || compact || shaped) && i < val->obj.size; i++) {
+                json_member* m = &val->obj.members[i];
+                char* key = (char*)JSON_MALLOC(m->key_length + 1);
+                memcpy(key, m->key, m->key_length + 1);
+                m->key = key;
+            }
+            for (i = 0; i < val->obj.size; i++) val->obj.members[i].value.flags &= ~(VALUE_FROZEN | VALUE_FROZEN_ROOT);
+            if (!sole) {
+                for (i = 0; i < val->obj.size; i++) value_retain(&val->obj.members[i].value);
+                if (REF_DEC(&rc->refs) != 0) break;
+                for (i = 0; i < val->obj.size; i++) {
+                    if (!compact && !shaped) JSON_FREE(old[i].key);
+                    release_value(&old[i].value);
+                }
+            }
+            if (shaped) shape_release(SHAPE_OF(old));
+            if (compact) compact_release(rc);
+            else JSON_FREE(rc);
+            break;
+        }
+        default:
+            break;
+    }
+}
+
+json_value* array_element_mut(json_value* val, size_t idx) {
+    assert(val != NULL && val->type == VALUE_ARRAY && idx < val->arr.size);
+    value_unshare(val);
+    return &val->arr.values[idx];
+}
+
+json_value* object_member_mut(json_value* val, const char* key, size_t len) {
+    json_member* m;
+    assert(val != NULL && val->type == VALUE_OBJECT);
+    if (val->obj.size == 0) return NULL;
+    value_unshare(val);
+    m = search_member(val->obj.members, key, len);
+    return m != NULL ? &m->value : NULL;
 }
 
 value_type get_value_type(const json_value* val) {
@@ -294,16 +1124,80 @@ size_t get_value_string_length(const json_value* val) {
     return val->str.length;
 }
 
+parse_result set_value_raw(json_value* val, const char* json, size_t len) {
+    parse_result ret;
+    assert(val != NULL && (json != NULL || len == 0));
+    ASSERT_THAWED(val);
+    if ((ret = json_validate(json, len)) != PARSE_OK) return ret;
+    while (*json == ' ' || *json == '\t' || *json == '\n' || *json == '\r') json++, len--;
+    while (json[len - 1] == ' ' || json[len - 1] == '\t' || json[len - 1] == '\n' || json[len - 1] == '\r') len--;
+    free_value(val);
+    set_raw(val, json, len);
+    return PARSE_OK;
+}
+
+void set_raw(json_value* val, const char* json, size_t len) {
+    set_value_string(val, json, len);
+    val->type = VALUE_RAW;
+}
+
+const char* get_value_raw(const json_value* val) {
+    assert(val != NULL && val->type == VALUE_RAW);
+    return val->str.s;
+}
+
+size_t get_value_raw_length(const json_value* val) {
+    assert(val != NULL && val->type == VALUE_RAW);
+    return val->str.length;
+}
+
+/* 
+ * parses raw text back into a tree for writers that can't embed it verbatim (cbor, msgpack,
+ * snapshot, canonical). the text was validated when it was stored, so this can't fail
+ */
+void raw_expand(const json_value* val, json_value* tmp) {
+    parse_result ret;
+    value_init(tmp);
+    ret = json_parse(tmp, val->str.s);
+    assert(ret == PARSE_OK);
+    (void)ret;
+}
+
 parse_result parse_value_string(parse_helper* ph, json_value* val) {
     parse_result ret;
     char* str;
     size_t str_len;
-    if ((ret = parse_string(ph, &str, &str_len)) == PARSE_OK) set_value_string(val, str, str_len);
+    unsigned long long t0 = STAT_CLOCK(ph);
+    if ((ret = parse_string(ph, &str, &str_len)) == PARSE_OK) {
+        set_value_string(val, str, str_len);
+        STAT(ph, allocations++);
+    }
+    STAT_TIME(ph, cycles_strings, t0);
     return ret;
 }
 
 parse_result parse_value_number(parse_helper* ph, json_value* val) {
+    parse_result ret;
+    unsigned long long t0 = STAT_CLOCK(ph);
+    ret = parse_number(ph, val);
+    STAT_TIME(ph, cycles_numbers, t0);
+    return ret;
+}
+
+parse_result parse_number(parse_helper* ph, json_value* val) {
     const char *p = ph->json;
+    if (ph->lazy_numbers) {
+        /* the validator's magnitude estimate reports overflow without decoding */
+        binary_helper vh;
+        parse_result ret;
+        vh.p = (const unsigned char*)p;
+        vh.end = vh.p + strspn(p, "+-.0123456789Ee");
+        vh.depth = 0;
+        if ((ret = validate_number(&vh)) != PARSE_OK) return ret;
+        ph->json = (const char*)vh.p;
+        set_raw_number(val, p, (size_t)(ph->json - p));
+        return PARSE_OK;
+    }
     if (*p == '-') p++;
     if (*p == '0') p++;
     else {
@@ -332,15 +1226,18 @@ parse_result parse_value_number(parse_helper* ph, json_value* val) {
 }
 
 parse_result parse_value_object(parse_helper* ph, json_value* val) {
+    shape_slot* slot = ph->shape;
+    json_shape* shape = slot != NULL ? slot->shape : NULL;
+    size_t sz = 0, shaped = 0, i;
+    int ret = PARSE_OK, plain = 1;
+    ph->shape = NULL;  /* members aren't siblings of anything */
     EXPECT(ph, '{');
-    size_t sz = 0;
-    int ret = PARSE_OK;
     parse_whitespace(ph);
     if (*ph->json == '}') {
         ph->json++;
         val->type = VALUE_OBJECT;
         val->obj.members = NULL;
-        val->obj.size = 0;
+        val->obj.size = val->obj.capacity = 0;
         return ret;
     }
     
@@ -348,15 +1245,35 @@ parse_result parse_value_object(parse_helper* ph, json_value* val) {
     member.key = NULL;
     for (;;) {
         value_init(&member.value);
+        if (sz == ph->limits.max_elements) {
+            ret = PARSE_TOO_MANY_ELEMENTS;
+            break;
+        }
         /* key */
         if (*ph->json != '"') {
             ret = PARSE_MISS_MEMBER_KEY;
             break;
         }
-        char* str;
-        if ((ret = parse_string(ph, &str, &member.key_length)) != PARSE_OK) break;
-        memcpy(member.key = (char*)malloc(member.key_length + 1), str, member.key_length);
-        member.key[member.key_length] = '\0';
+        if (shaped == sz && shape != NULL && sz < shape->size && shape_match(ph->json, &shape->members[sz])) {
+            /* the previous sibling's key again, borrowed from the shape */
+            member.key = shape->members[sz].key;
+            member.key_length = shape->members[sz].key_length;
+            ph->json += member.key_length + 2;
+            shaped++;
+        }
+        else {
+            const char* start = ph->json;
+            char* str;
+            unsigned long long t0 = STAT_CLOCK(ph);
+            ret = parse_string(ph, &str, &member.key_length);
+            STAT_TIME(ph, cycles_strings, t0);
+            if (ret != PARSE_OK) break;
+            plain &= (size_t)(ph->json - start) == member.key_length + 2;  /* no escapes */
+            member.key = (char*)JSON_MALLOC(member.key_length + 1);
+            if (member.key_length > 0) memcpy(member.key, str, member.key_length);
+            member.key[member.key_length] = '\0';
+            STAT(ph, allocations++);
+        }
         parse_whitespace(ph);
         if (*ph->json != ':') {
             ret = PARSE_MISS_MEMBER_COLON;
@@ -366,9 +1283,12 @@ parse_result parse_value_object(parse_helper* ph, json_value* val) {
 
         /* value */
         parse_whitespace(ph);
-        if ((ret = parse_value(ph, &member.value)) != PARSE_OK) break;
-        LS(&member) = RS(&member) = NULL;
+        if (ph->raw != NULL && ph->raw(ph->raw_ctx, member.key, member.key_length, ph->depth))
+            ret = parse_value_raw(ph, &member.value);
+        else ret = parse_value(ph, &member.value);
+        if (ret != PARSE_OK) break;
         PUTM(ph, member);
+        member.key = NULL;  /* owned by the stack now */
 
         parse_whitespace(ph);
         if (*ph->json == ',') {
@@ -376,13 +1296,32 @@ parse_result parse_value_object(parse_helper* ph, json_value* val) {
             parse_whitespace(ph);
         }
         else if (*ph->json == '}') {
+            json_member* members;
             ph->json++;
             val->type = VALUE_OBJECT;
-            val->obj.size = sz;
-            sz *= sizeof(json_member);
-            memcpy(val->obj.members = (json_member*)malloc(sz), helper_pop(ph, sz), sz);
-            json_member* root = &val->obj.members[0];
-            for (size_t i = 1; i < val->obj.size; i++) down_member(root, &val->obj.members[i]);
+            val->obj.size = val->obj.capacity = sz;
+            memcpy(members = val->obj.members = (json_member*)JSON_MALLOC(sz * sizeof(json_member)), helper_pop(ph, sz * sizeof(json_member)), sz * sizeof(json_member));
+            STAT(ph, allocations++);
+            if (shape != NULL && shaped == shape->size && sz == shaped) {
+                /* same keys in the same order: the index comes with the shape */
+                for (i = 0; i < sz; i++) {
+                    LS(&members[i]) = LS(&shape->members[i]);
+                    RS(&members[i]) = RS(&shape->members[i]);
+                    members[i].key_prefix = shape->members[i].key_prefix;
+                }
+                REF_INC(&shape->refs);
+                val->flags |= VALUE_SHAPED;
+                return ret;
+            }
+            for (i = 0; i < shaped; i++) {
+                char* key = (char*)JSON_MALLOC(members[i].key_length + 1);
+                members[i].key = (char*)memcpy(key, members[i].key, members[i].key_length + 1);
+                STAT(ph, allocations++);
+            }
+            for (i = 0; i < sz; i++) down_member(members, &members[i]);
+            /* learned from the second object on, an array holding a single object never pays for it */
+            if (slot != NULL && slot->objects++ > 0 && plain && (shape == NULL || (slot->relearned < SHAPE_RELEARN && ++slot->relearned)))
+                shape_learn(slot, val);
             return ret;
         }
         else {
@@ -390,32 +1329,90 @@ parse_result parse_value_object(parse_helper* ph, json_value* val) {
             break;
         }
     }
-    free(member.key);
-    for (int i = 0; i < sz; ++i) {
+    if (shaped <= sz) JSON_FREE(member.key);
+    for (i = sz; i-- > 0;) {
         json_member* m = (json_member*)helper_pop(ph, sizeof(json_member));
-        free(m->key);
+        if (i >= shaped) JSON_FREE(m->key);
         free_value(&m->value);
     }
     val->type = VALUE_NULL;
     return ret;
 }
 
+/* the json at a '"' spells the template's key, which has no escapes, up to the closing quote */
+int shape_match(const char* json, const json_member* t) {
+    return strncmp(json + 1, t->key, t->key_length) == 0 && json[t->key_length + 1] == '"';
+}
+
+/* makes val's keys the slot's shape, val then refers to them like its siblings will */
+void shape_learn(shape_slot* slot, json_value* val) {
+    json_member* members = val->obj.members;
+    json_shape* shape;
+    size_t i, keys = 0, head;
+    char* p;
+    for (i = 0; i < val->obj.size; i++) keys += members[i].key_length + 1;
+    head = COMPACT_ALIGN(sizeof(json_shape) + keys);
+    shape = (json_shape*)JSON_MALLOC(head + val->obj.size * sizeof(json_member));
+    shape->refs = 2;  /* the slot's and val's */
+    shape->size = val->obj.size;
+    shape->members = (json_member*)((char*)shape + head);
+    p = (char*)(shape + 1);
+    for (i = 0; i < val->obj.size; i++) {
+        memcpy(p, members[i].key, members[i].key_length + 1);
+        JSON_FREE(members[i].key);
+        members[i].key = p;
+        shape->members[i] = members[i];
+        value_init(&shape->members[i].value);
+        p += members[i].key_length + 1;
+    }
+    val->flags |= VALUE_SHAPED;
+    if (slot->shape != NULL) shape_release(slot->shape);
+    slot->shape = shape;
+}
+
+void shape_release(json_shape* shape) {
+    if (REF_DEC(&shape->refs) == 0) JSON_FREE(shape);
+}
+
+/* gives a shaped object keys of its own, the members stay where they are */
+void shape_unshape(json_value* val) {
+    json_shape* shape = SHAPE_OF(val->obj.members);
+    for (size_t i = 0; i < val->obj.size; i++) {
+        json_member* m = &val->obj.members[i];
+        char* key = (char*)JSON_MALLOC(m->key_length + 1);
+        m->key = (char*)memcpy(key, m->key, m->key_length + 1);
+    }
+    val->flags &= ~VALUE_SHAPED;
+    shape_release(shape);
+}
+
 parse_result parse_value_array(parse_helper* ph, json_value* val) {
     EXPECT(ph, '[');
     size_t sz = 0;
     int ret = PARSE_OK;
+    shape_slot slot = { NULL, 0, 0 };
     parse_whitespace(ph);
     if (*ph->json == ']') {
         ph->json++;
         val->type = VALUE_ARRAY;
         val->arr.values = NULL;
-        val->arr.size = 0;
+        val->arr.size = val->arr.capacity = 0;
         return PARSE_OK;
     }
     for (;;) {
         json_value sub_v;
+        if (sz == ph->limits.max_elements) {
+            ret = PARSE_TOO_MANY_ELEMENTS;
+            break;
+        }
         value_init(&sub_v);
-        if ((ret = parse_value(ph, &sub_v)) != PARSE_OK) break;
+        if (ph->raw != NULL && ph->raw(ph->raw_ctx, NULL, 0, ph->depth)) ret = parse_value_raw(ph, &sub_v);
+        else {
+            ph->shape = &slot;
+            ret = parse_value(ph, &sub_v);
+            ph->shape = NULL;
+        }
+        if (ret != PARSE_OK) break;
         PUTV(ph, sub_v);
 
         parse_whitespace(ph);
@@ -426,9 +1423,11 @@ parse_result parse_value_array(parse_helper* ph, json_value* val) {
         else if (*ph->json == ']') {
             *ph->json++;
             val->type = VALUE_ARRAY;
-            val->arr.size = sz;
+            val->arr.size = val->arr.capacity = sz;
             sz *= sizeof(json_value);
-            memcpy(val->arr.values = (json_value*)malloc(sz), helper_pop(ph, sz), sz);
+            memcpy(val->arr.values = (json_value*)JSON_MALLOC(sz), helper_pop(ph, sz), sz);
+            STAT(ph, allocations++);
+            if (slot.shape != NULL) shape_release(slot.shape);
             return PARSE_OK;
         }
         else {
@@ -437,9 +1436,25 @@ parse_result parse_value_array(parse_helper* ph, json_value* val) {
         } 
     }
     for (size_t i = 0; i < sz; i++) free_value((json_value*)helper_pop(ph, sizeof(json_value)));
+    if (slot.shape != NULL) shape_release(slot.shape);
     return ret;
 }
 
+/* the value's text is checked by the validator and kept as is */
+parse_result parse_value_raw(parse_helper* ph, json_value* val) {
+    binary_helper vh;
+    parse_result ret;
+    vh.p = (const unsigned char*)ph->json;
+    vh.end = (const unsigned char*)ph->end;
+    /* the captured text counts against max_depth as if it had been parsed */
+    vh.depth = ph->limits.max_depth == SIZE_MAX ? QGCJSON_MAX_DEPTH : ph->limits.max_depth - ph->depth;
+    if ((ret = validate_value(&vh)) != PARSE_OK) return ret;
+    set_raw(val, ph->json, (size_t)((const char*)vh.p - ph->json));
+    ph->json = (const char*)vh.p;
+    STAT(ph, allocations++);
+    return PARSE_OK;
+}
+
 parse_result parse_value_true(parse_helper* ph, json_value* val) {
     EXPECT(ph, 't');
     if (ph->json[0] == 'r' && ph->json[1] == 'u' && ph->json[2] == 'e') {
@@ -482,146 +1497,211 @@ size_t get_value_array_capacity(const json_value* val) {
 
 void set_value_array(json_value* val, size_t capacity) {
     assert(val != NULL);
+    ASSERT_THAWED(val);
     free_value(val);
-    val->type = VALUE_OBJECT;
+    val->type = VALUE_ARRAY;
     val->arr.capacity = capacity;
     val->arr.size = 0;
-    val->arr.values = capacity > 0 ? (json_value*)malloc(capacity * sizeof(json_value)) : NULL;
+    val->arr.values = capacity > 0 ? (json_value*)JSON_MALLOC(capacity * sizeof(json_value)) : NULL;
 }
 
 void set_value_object(json_value* val, size_t capacity) {
     assert(val != NULL);
+    ASSERT_THAWED(val);
     free_value(val);
     val->type = VALUE_OBJECT;
     val->obj.capacity = capacity;
     val->obj.size = 0;
-    val->obj.members = capacity > 0 ? (json_member*)malloc(capacity * sizeof(json_member)) : NULL;
+    val->obj.members = capacity > 0 ? (json_member*)JSON_MALLOC(capacity * sizeof(json_member)) : NULL;
 }
 
 void reverse_value_object(json_value* val, size_t capacity) {
-    assert(val != NULL && val->type == VALUE_OBJECT && capacity >= val->arr.size);
-    val->obj.members = (json_member*)realloc(val->obj.members, capacity * sizeof(json_member));
+    assert(val != NULL && val->type == VALUE_OBJECT && capacity >= val->obj.size);
+    assert(capacity < UINT32_MAX);  /* the member index links are 32-bit positions */
+    value_unshare(val);
+    val->obj.members = (json_member*)JSON_REALLOC(val->obj.members, capacity * sizeof(json_member));
     val->obj.capacity = capacity;
 }
 
 void shrink_value_object(json_value* val) {
     assert(val != NULL && val->type == VALUE_OBJECT);
-    val->obj.members = (json_member*)realloc(val->obj.members, val->obj.size * sizeof(json_member));
-    val->obj.capacity = val->obj.size;
+    value_unshare(val);
+    if (val->obj.capacity > val->obj.size) reverse_value_object(val, val->obj.size);
+}
+
+size_t grow_capacity(size_t capacity) {
+    return capacity < 4 ? 4 : capacity + (capacity >> 1);
 }
 
 int object_find_member(const json_value* val, const char* key, size_t len) {
-    int ret = 1;
-    if (search_member(val->obj.members, key, len) == NULL) ret = 0;
-    return ret;
+    assert(val != NULL && val->type == VALUE_OBJECT);
+    if (val->obj.size == 0) return 0;
+    return search_member(val->obj.members, key, len) != NULL;
+}
+
+/* appends an uninitialized member, the caller sets key and value and then links it */
+json_member* object_append(json_value* v) {
+    json_member* m;
+    value_unshare(v);
+    if (v->obj.size >= v->obj.capacity) reverse_value_object(v, grow_capacity(v->obj.capacity));
+    m = &v->obj.members[v->obj.size++];
+    value_init(&m->value);
+    return m;
+}
+
+json_value* object_emplace(json_value* v, const char* key, size_t len) {
+    json_member* m;
+    assert(v != NULL && v->type == VALUE_OBJECT && (key != NULL || len == 0));
+    m = object_append(v);
+    m->key = (char*)JSON_MALLOC(len + 1);
+    if (len > 0) memcpy(m->key, key, len);
+    m->key[len] = '\0';
+    m->key_length = len;
+    down_member(v->obj.members, m);
+    return &m->value;
 }
 
 void insert_member(json_value* v, json_member* m) {
     assert(v != NULL && v->type == VALUE_OBJECT && m != NULL);
-    if (v->obj.size >= v->obj.capacity) {
-        v->obj.capacity += v->obj.capacity >> 1;
-        v->obj.members = (json_member*)realloc(v->obj.members, v->obj.capacity * sizeof(json_member));
-    }
-    member_copy(&v->obj.members[v->obj.size++], m, v);
-    down_member(v->obj.members, &v->obj.members[v->obj.size - 1]);
+    value_copy(object_emplace(v, m->key, m->key_length), &m->value);
+}
+
+void object_insert_move(json_value* v, json_member* m) {
+    json_member* d;
+    assert(v != NULL && v->type == VALUE_OBJECT && m != NULL && m->key != NULL);
+    d = object_append(v);
+    d->key = m->key;
+    d->key_length = m->key_length;
+    m->key = NULL;
+    m->key_length = 0;
+    value_move(&d->value, &m->value);
+    down_member(v->obj.members, d);
 }
 
 void remove_member(json_value* v, const char* key, size_t len) {
-    assert(v != NULL && v->type == VALUE_OBJECT && key != NULL && len > 0);
-    json_member* m = search_member(v->obj.members, key, len);
-    if (m == NULL) return;
-    if (v->obj.size == 1 || member_is_equal(&v->obj.members[v->obj.size - 1], m)) {
-        free(m->key);
-        free_value(&m->value);
-        v->obj.size--;
-    }
-    else {
-        size_t idx = (m - v->obj.members) / sizeof(json_member);
-        memmove(&v->obj.members[idx], &v->obj.members[idx + 1], v->obj.size - idx - 1);
-    }
+    json_member* m;
+    size_t idx;
+    assert(v != NULL && v->type == VALUE_OBJECT && (key != NULL || len == 0));
+    value_unshare(v);
+    if (v->obj.size == 0 || (m = search_member(v->obj.members, key, len)) == NULL) return;
+    idx = (size_t)(m - v->obj.members);
+    JSON_FREE(m->key);
+    free_value(&m->value);
+    memmove(m, m + 1, (v->obj.size - idx - 1) * sizeof(json_member));
+    v->obj.size--;
+    rebuild_member_tree(v);
 }
 
 void reverse_value_array(json_value* val, size_t capacity) {
     assert(val != NULL && val->type == VALUE_ARRAY && capacity >= val->arr.size);
-    val->arr.values = (json_value*)realloc(val->arr.values, capacity * sizeof(json_value));
+    value_unshare(val);
+    val->arr.values = (json_value*)JSON_REALLOC(val->arr.values, capacity * sizeof(json_value));
     val->arr.capacity = capacity;
 }
 
 void shrink_value_array(json_value* val) {
     assert(val != NULL && val->type == VALUE_ARRAY);
-    val->arr.values = (json_value*)realloc(val->arr.values, val->arr.size * sizeof(json_value));
+    value_unshare(val);
+    val->arr.values = (json_value*)JSON_REALLOC(val->arr.values, val->arr.size * sizeof(json_value));
     val->arr.capacity = val->arr.size;
 }
 
 void clear_value_array(json_value* val) {
     assert(val != NULL && val->type == VALUE_ARRAY);
+    value_unshare(val);
     for (size_t i = 0; i < val->arr.size; i++) free_value(&val->arr.values[i]);
     val->arr.size = 0;
 }
 
 #define UP_ARRAY_CAPACITY(val)\
     do {\
-        if (val->arr.size >= val->arr.capacity) {\
-            val->arr.capacity += val->arr.capacity >> 1;\
-            val->arr.values = (json_value*)realloc(val->arr.values, val->arr.capacity * sizeof(json_value));\
-        }\
+        if (val->arr.size >= val->arr.capacity) reverse_value_array(val, grow_capacity(val->arr.capacity));\
     } while(0)
 
+json_value* array_emplace_back(json_value* val) {
+    json_value* e;
+    assert(val != NULL && val->type == VALUE_ARRAY);
+    value_unshare(val);
+    UP_ARRAY_CAPACITY(val);
+    e = &val->arr.values[val->arr.size++];
+    value_init(e);
+    return e;
+}
+
+json_value* array_emplace_front(json_value* val) {
+    assert(val != NULL && val->type == VALUE_ARRAY);
+    value_unshare(val);
+    UP_ARRAY_CAPACITY(val);
+    memmove(&val->arr.values[1], &val->arr.values[0], val->arr.size++ * sizeof(json_value));
+    value_init(&val->arr.values[0]);
+    return &val->arr.values[0];
+}
+
 void array_push_back(json_value* val, const json_value* e) {
     assert(val != NULL && e != NULL && val->type == VALUE_ARRAY);
-    if (val->arr.size >= val->arr.capacity) {
-        val->arr.capacity += val->arr.capacity >> 1;
-        val->arr.values = (json_value*)realloc(val->arr.values, val->arr.capacity * sizeof(json_value));
-    }
-    value_copy(&val->arr.values[val->arr.size++], e);
+    value_copy(array_emplace_back(val), e);
 }
 
 void array_push_front(json_value* val, const json_value* e) {
     assert(val != NULL && e != NULL && val->type == VALUE_ARRAY);
-    if (val->arr.size >- val->arr.capacity) {
-        val->arr.capacity += val->arr.capacity >> 1;
-        val->arr.values = (json_value*)realloc(val->arr.values, val->arr.capacity * sizeof(json_value));
-    }
-    memmove(&val->arr.values[1], &val->arr.values[0], val->arr.size++ * sizeof(json_value));
-    value_copy(&val->arr.values[0], e);
+    value_copy(array_emplace_front(val), e);
+}
+
+void array_push_back_move(json_value* val, json_value* e) {
+    assert(val != NULL && e != NULL && val->type == VALUE_ARRAY);
+    value_move(array_emplace_back(val), e);
+}
+
+void array_push_front_move(json_value* val, json_value* e) {
+    assert(val != NULL && e != NULL && val->type == VALUE_ARRAY);
+    value_move(array_emplace_front(val), e);
 }
 
 json_value* array_pop_back(json_value* val) {
     assert(val != NULL && val->type == VALUE_ARRAY && val->arr.size > 0);
+    value_unshare(val);
     return &val->arr.values[--(val->arr.size)];
 }
 
+/* like array_pop_back, the popped value is parked just past the end */
 json_value* array_pop_front(json_value* val) {
+    json_value v;
     assert(val != NULL && val->type == VALUE_ARRAY && val->arr.size > 0);
-    json_value* v = val->arr.values;
-    val->arr.values = &val->arr.values[1]; 
-    val->arr.size--;
-    return v;
+    value_unshare(val);
+    memcpy(&v, &val->arr.values[0], sizeof(json_value));
+    memmove(&val->arr.values[0], &val->arr.values[1], --val->arr.size * sizeof(json_value));
+    memcpy(&val->arr.values[val->arr.size], &v, sizeof(json_value));
+    return &val->arr.values[val->arr.size];
 }
 
 void array_insert_element(json_value* val, size_t idx) {
     assert(val != NULL && val->type == VALUE_ARRAY);
     assert(idx >= 0 && idx <= val->arr.size);
+    value_unshare(val);
     UP_ARRAY_CAPACITY(val);
-    memmove(&val->arr.values[idx + 1], &val->arr.values[idx], val->arr.size - idx);
-    value_copy(&val->arr.values[idx], val);
+    memmove(&val->arr.values[idx + 1], &val->arr.values[idx], (val->arr.size - idx) * sizeof(json_value));
+    value_init(&val->arr.values[idx]);
     val->arr.size++;
 }
 
 void array_delete_element(json_value* val, size_t idx) {
     assert(val != NULL && val->type == VALUE_ARRAY);
     assert(idx >= 0 && idx < val->arr.size);
-    memmove(&val->arr.values[idx], &val->arr.values[idx + 1], val->arr.size - idx - 1);
+    value_unshare(val);
+    memmove(&val->arr.values[idx], &val->arr.values[idx + 1], (val->arr.size - idx - 1) * sizeof(json_value));
     val->arr.size--;
 }
 
 void array_erase_element(json_value* val, size_t idx) {
     assert(val != NULL && val->type == VALUE_ARRAY);
     assert(idx >= 0 && idx < val->arr.size);
+    value_unshare(val);
     for (;val->arr.size > idx;) free_value(&val->arr.values[--val->arr.size]);
 }
 
 void array_clear_element(json_value* val) {
+    assert(val != NULL && val->type == VALUE_ARRAY);
+    value_unshare(val);
     for (;val->arr.size > 0;) free_value(&val->arr.values[--val->arr.size]); 
 }
 
@@ -652,11 +1732,15 @@ generate_result stringify_value(parse_helper* ph, const json_value* val, int isF
         case VALUE_TRUE: PUTS(ph, "true", 4); break;
         case VALUE_FALSE: PUTS(ph, "false", 5); break;
         case VALUE_NUMBER: 
-            ph->top -= 32 - sprintf(helper_push(ph, 32), "%.17g", val->num);
+            if (val->flags & VALUE_RAW_NUMBER) PUTS(ph, RAW_NUMBER(val)->text, val->str.length);
+            else ph->top -= 32 - sprintf(helper_push(ph, 32), "%.17g", val->num);
             break;
         case VALUE_STRING:
             ret = stringify_value_string(ph, val->str.s, val->str.length);
             break;
+        case VALUE_RAW:
+            PUTS(ph, val->str.s, val->str.length);
+            break;
         case VALUE_ARRAY:
             ret = stringify_value_array(ph, val, isFile);
             break;
@@ -670,36 +1754,70 @@ generate_result stringify_value(parse_helper* ph, const json_value* val, int isF
     return ret;
 }
 
+/* length of the leading run of str that can be emitted without escaping */
+size_t string_clean_prefix(const char* str, size_t len) {
+    size_t i = 0;
+#ifdef QGCJSON_SSE2
+    const __m128i quote = _mm_set1_epi8('"');
+    const __m128i backslash = _mm_set1_epi8('\\');
+    const __m128i ctrl = _mm_set1_epi8(0x1F);
+    for (; i + 16 <= len; i += 16) {
+        __m128i x = _mm_loadu_si128((const __m128i*)(str + i));
+        __m128i hit = _mm_or_si128(_mm_cmpeq_epi8(x, quote), _mm_cmpeq_epi8(x, backslash));
+        /* x <= 0x1F  <=>  max(x, 0x1F) == 0x1F (unsigned) */
+        hit = _mm_or_si128(hit, _mm_cmpeq_epi8(_mm_max_epu8(x, ctrl), ctrl));
+        unsigned mask = (unsigned)_mm_movemask_epi8(hit);
+        if (mask != 0) {
+#if defined(_MSC_VER)
+            unsigned long bit;
+            _BitScanForward(&bit, mask);
+            return i + bit;
+#else
+            return i + (size_t)__builtin_ctz(mask);
+#endif
+        }
+    }
+#endif
+    for (; i < len; i++) {
+        unsigned char ch = (unsigned char)str[i];
+        if (ch < 0x20 || ch == '"' || ch == '\\') break;
+    }
+    return i;
+}
+
 generate_result stringify_value_string(parse_helper* ph, const char* str, size_t len) {
-    static const char hex_digits[] = {'0', '1', '2', '3', '4', '5', '6', '7', '8', '9', 'A', 'B', 'C', 'D', 'E', 'F'};
+    return stringify_escaped(ph, str, len, "0123456789ABCDEF");
+}
+
+generate_result stringify_escaped(parse_helper* ph, const char* str, size_t len, const char* hex_digits) {
     int ret = STRINGIFY_OK;
-    size_t sz = len * 6 + 2;
+    size_t i = 0, run;
     char* p;
-    char* head;
-    p = head = helper_push(ph, sz);
-    *p++ = '"';
-    for (size_t i = 0; i < len; ++i) {
-        unsigned char ch = (unsigned char)str[i];
+    PUTC(ph, '"');
+    while (i < len) {
+        /* copy clean runs in bulk, only escape bytes that need it */
+        if ((run = string_clean_prefix(str + i, len - i)) > 0) {
+            PUTS(ph, str + i, run);
+            if ((i += run) == len) break;
+        }
+        unsigned char ch = (unsigned char)str[i++];
         switch (ch) {
-            case '\\': *p++ = '\\'; *p++ = '\\'; break;
-            case '\"': *p++ = '\\'; *p++ = '\"'; break;
-            case '\b': *p++ = '\\'; *p++ = 'b'; break;
-            case '\n': *p++ = '\\'; *p++ = 'n'; break;
-            case '\t': *p++ = '\\'; *p++ = 't'; break;
-            case '\r': *p++ = '\\'; *p++ = 'r'; break;
-            case '\f': *p++ = '\\'; *p++ = 'f'; break;
-            default:
-                if (ch < 0x20) {  // json not include 0x00-0x20
-                    *p++ = '\\'; *p++ = 'u'; *p++ = '0'; *p++ = '0';
-                    *p++ = hex_digits[ch >> 4];
-                    *p++ = hex_digits[ch & 15];
-                }
-                else *p++ = ch;
+            case '\\': PUTS(ph, "\\\\", 2); break;
+            case '\"': PUTS(ph, "\\\"", 2); break;
+            case '\b': PUTS(ph, "\\b", 2); break;
+            case '\n': PUTS(ph, "\\n", 2); break;
+            case '\t': PUTS(ph, "\\t", 2); break;
+            case '\r': PUTS(ph, "\\r", 2); break;
+            case '\f': PUTS(ph, "\\f", 2); break;
+            default:  // json not include 0x00-0x20
+                p = helper_push(ph, 6);
+                *p++ = '\\'; *p++ = 'u'; *p++ = '0'; *p++ = '0';
+                *p++ = hex_digits[ch >> 4];
+                *p++ = hex_digits[ch & 15];
                 break;
         }
     }
-    *p++ = '"';
-    ph->top -= (sz - (p - head));
+    PUTC(ph, '"');
     return ret;
 }
 
@@ -736,6 +1854,148 @@ generate_result stringify_value_object(parse_helper* ph, const json_value* val,
     return ret;
 }
 
+#define BUILDER_FRAME(b) ((builder_frame*)((b)->ph.stack + (b)->frame))
+
+json_builder* builder_create(void) {
+    json_builder* b = (json_builder*)JSON_MALLOC(sizeof(json_builder));
+    helper_init(&b->ph, NULL);
+    b->frame = 0;
+    b->key = NULL;
+    b->key_length = 0;
+    builder_open(b, 0);  /* the root frame holds the finished document */
+    return b;
+}
+
+void builder_free(json_builder* b) {
+    if (b == NULL) return;
+    JSON_FREE(b->key);
+    for (;;) {
+        builder_frame* f = BUILDER_FRAME(b);
+        char* p = (char*)(f + 1);
+        for (size_t i = 0; i < f->count; i++) {
+            if (f->is_object) {
+                json_member* m = (json_member*)p + i;
+                JSON_FREE(m->key);
+                free_value(&m->value);
+            }
+            else free_value((json_value*)p + i);
+        }
+        JSON_FREE(f->key);
+        if (b->frame == 0) break;
+        b->frame = f->parent;
+    }
+    JSON_FREE(b->ph.stack);
+    JSON_FREE(b);
+}
+
+void builder_reserve(json_builder* b, size_t values) {
+    size_t need;
+    assert(b != NULL);
+    if (values > (SIZE_MAX - b->ph.top - 1) / sizeof(json_member)) return;  /* only a hint, the stack still grows */
+    need = b->ph.top + values * sizeof(json_member) + 1;
+    if (need > b->ph.size) {
+        b->ph.stack = (char*)JSON_REALLOC(b->ph.stack, need);
+        b->ph.size = need;
+    }
+}
+
+void builder_key(json_builder* b, const char* key, size_t len) {
+    assert(b != NULL && BUILDER_FRAME(b)->is_object && b->key == NULL && (key != NULL || len == 0));
+    b->key = (char*)JSON_MALLOC(len + 1);
+    if (len > 0) memcpy(b->key, key, len);
+    b->key[len] = '\0';
+    b->key_length = len;
+}
+
+json_value* builder_value(json_builder* b) {
+    builder_frame* f;
+    json_value* v;
+    assert(b != NULL);
+    f = BUILDER_FRAME(b);
+    if (f->is_object) {
+        json_member* m;
+        assert(b->key != NULL);
+        m = (json_member*)helper_push(&b->ph, sizeof(json_member));
+        m->key = b->key;
+        m->key_length = b->key_length;
+        b->key = NULL;
+        v = &m->value;
+    }
+    else {
+        assert(b->frame != 0 || f->count == 0);  /* a single root */
+        v = (json_value*)helper_push(&b->ph, sizeof(json_value));
+    }
+    BUILDER_FRAME(b)->count++;
+    value_init(v);
+    return v;
+}
+
+json_value* builder_member(json_builder* b, const char* key, size_t len) {
+    builder_key(b, key, len);
+    return builder_value(b);
+}
+
+void builder_open(json_builder* b, int is_object) {
+    size_t off = b->ph.top;
+    builder_frame* f = (builder_frame*)helper_push(&b->ph, sizeof(builder_frame));
+    f->parent = b->frame;
+    f->count = 0;
+    f->key = b->key;
+    f->key_length = b->key_length;
+    f->is_object = is_object;
+    b->key = NULL;
+    b->key_length = 0;
+    b->frame = off;
+}
+
+void builder_begin_array(json_builder* b) {
+    assert(b != NULL && (!BUILDER_FRAME(b)->is_object || b->key != NULL));
+    builder_open(b, 0);
+}
+
+void builder_begin_object(json_builder* b) {
+    assert(b != NULL && (!BUILDER_FRAME(b)->is_object || b->key != NULL));
+    builder_open(b, 1);
+}
+
+void builder_end(json_builder* b) {
+    builder_frame f;
+    json_value v;
+    size_t sz;
+    assert(b != NULL && b->frame != 0 && b->key == NULL);
+    f = *BUILDER_FRAME(b);
+    sz = f.count * (f.is_object ? sizeof(json_member) : sizeof(json_value));
+    v.flags = 0;
+    if (f.is_object) {
+        v.type = VALUE_OBJECT;
+        v.obj.size = v.obj.capacity = f.count;
+        v.obj.members = f.count > 0 ? (json_member*)JSON_MALLOC(sz) : NULL;
+        if (sz > 0) memcpy(v.obj.members, BUILDER_FRAME(b) + 1, sz);
+        rebuild_member_tree(&v);
+    }
+    else {
+        v.type = VALUE_ARRAY;
+        v.arr.size = v.arr.capacity = f.count;
+        v.arr.values = f.count > 0 ? (json_value*)JSON_MALLOC(sz) : NULL;
+        if (sz > 0) memcpy(v.arr.values, BUILDER_FRAME(b) + 1, sz);
+    }
+    b->ph.top = b->frame;
+    b->frame = f.parent;
+    b->key = f.key;
+    b->key_length = f.key_length;
+    memcpy(builder_value(b), &v, sizeof(json_value));
+}
+
+void builder_finish(json_builder* b, json_value* val) {
+    builder_frame* f;
+    assert(b != NULL && val != NULL && b->frame == 0);
+    f = BUILDER_FRAME(b);
+    assert(f->count == 1);
+    memcpy(val, f + 1, sizeof(json_value));
+    f->count = 0;
+    b->ph.top = sizeof(builder_frame);
+}
+
 const char* get_member_key(const json_member* m, size_t* len) {
     assert(m != NULL);
     *len = m->key_length;
@@ -747,48 +2007,169 @@ json_value* get_member_value(json_member* m) {
     return &m->value;
 }
 
-void down_member(json_member* r, json_member* m) {
-    if (strcmp(r->key, m->key) < 0) {
-        if (RS(r) == NULL) {
-            RS(r) = m;
-            return;
-        }
-        down_member(RS(r), m);
+/* keys are ordered bytewise, a shorter key sorts before any key it is a prefix of */
+int key_compare(const char* lhs, size_t lhs_len, const char* rhs, size_t rhs_len) {
+    int ret = memcmp(lhs, rhs, lhs_len < rhs_len ? lhs_len : rhs_len);
+    if (ret == 0) ret = lhs_len < rhs_len ? -1 : (lhs_len > rhs_len);
+    return ret;
+}
+
+/* first 8 bytes big-endian, zero padded: ordered like key_compare wherever two prefixes differ */
+uint64_t key_prefix(const char* key, size_t len) {
+    uint64_t p = 0;
+    size_t n = len < 8 ? len : 8;
+    for (size_t i = 0; i < n; i++) p |= (uint64_t)(unsigned char)key[i] << (56 - 8 * i);
+    return p;
+}
+
+/* key_compare against a member, the key itself is only read when the prefixes tie past 8 bytes */
+int member_compare(const json_member* m, const char* key, size_t len, uint64_t prefix) {
+    if (m->key_prefix != prefix) return m->key_prefix < prefix ? -1 : 1;
+    if (m->key_length <= 8 || len <= 8) return m->key_length < len ? -1 : m->key_length > len;
+    return key_compare(m->key + 8, m->key_length - 8, key + 8, len - 8);
+}
+
+size_t member_tree_size(const json_member* members, uint32_t son) {
+    size_t n = 0;
+    for (; son != 0; son = RS(&members[son - 1])) n += 1 + member_tree_size(members, LS(&members[son - 1]));
+    return n;
+}
+
+uint32_t* member_tree_flatten(const json_member* members, uint32_t son, uint32_t* out) {
+    for (; son != 0; son = RS(&members[son - 1])) {
+        out = member_tree_flatten(members, LS(&members[son - 1]), out);
+        *out++ = son;
     }
-    else {
-        if (LS(r) == NULL) {
-            LS(r) = m;
-            return;
-        }
-        down_member(LS(r), m);
+    return out;
+}
+
+uint32_t member_tree_build(json_member* members, const uint32_t* order, size_t n) {
+    json_member* m;
+    if (n == 0) return 0;
+    m = &members[order[n / 2] - 1];
+    LS(m) = member_tree_build(members, order, n / 2);
+    RS(m) = member_tree_build(members, order + n / 2 + 1, n - n / 2 - 1);
+    return order[n / 2];
+}
+
+/* 
+ * links m into the index rooted at members[0], taking its prefix; the root is only reset. the
+ * index is a scapegoat tree below the root: a member landing deeper than 2 log2 n has an ancestor
+ * with more than 1/sqrt(2) of its subtree on one side, and that subtree is rebuilt balanced, so
+ * keys arriving in order cost O(log n) amortized instead of growing a chain. equal keys go right
+ */
+void down_member(json_member* members, json_member* m) {
+    uint32_t path[MEMBER_TREE_DEPTH];
+    uint32_t idx = (uint32_t)(m - members) + 1, child = idx, *son, *order;
+    json_member *r = members, *parent;
+    size_t depth = 0, limit, size, below;
+    m->key_prefix = key_prefix(m->key, m->key_length);
+    LS(m) = RS(m) = 0;
+    if (m == members) return;
+    for (;;) {
+        son = &r->sons[member_compare(r, m->key, m->key_length, m->key_prefix) <= 0];
+        if (*son == 0) break;
+        assert(depth < MEMBER_TREE_DEPTH);
+        r = members + (path[depth++] = *son) - 1;
     }
+    *son = idx;
+    for (limit = 0; ((uint64_t)1 << limit) < idx; limit++);
+    if (depth <= 2 * limit) return;
+    /* the lowest lopsided ancestor, or the top one below the root */
+    for (size = 1; depth > 0; child = path[depth]) {
+        r = &members[path[--depth] - 1];
+        below = size;
+        size = 1 + below + member_tree_size(members, r->sons[LS(r) == child]);
+        if ((uint64_t)below * below > (uint64_t)size * size / 2) break;
+    }
+    parent = depth > 0 ? &members[path[depth - 1] - 1] : members;
+    son = &parent->sons[RS(parent) == path[depth]];
+    order = (uint32_t*)JSON_MALLOC(size * sizeof(uint32_t));
+    member_tree_flatten(members, *son, order);
+    *son = member_tree_build(members, order, size);
+    JSON_FREE(order);
 }
 
-json_member* search_member(json_member* f, const char* key, size_t len) {
-    if (f->key_length == len && memcmp(f->key, key, len) == 0) return f;
-    if (strcmp(f->key, key) < 0) {
-        if (RS(f) == NULL) return NULL;
-        return search_member(RS(f), key, len);
-    } 
-    else {
-        if (LS(f) == NULL) return NULL;
-        return search_member(LS(f), key, len);
+json_member* search_member(json_member* members, const char* key, size_t len) {
+    return search_prefixed(members, key, len, key_prefix(key, len));
+}
+
+/* the first of equal keys is the leftmost, the search goes on past a match to find it */
+json_member* search_prefixed(json_member* members, const char* key, size_t len, uint64_t prefix) {
+    json_member *r = members, *found = NULL;
+    uint32_t son;
+    int cmp;
+    if (r == NULL) return NULL;
+    for (;;) {
+        if ((cmp = member_compare(r, key, len, prefix)) == 0) found = r;
+        if ((son = r->sons[cmp < 0]) == 0) return found;
+        r = members + son - 1;
     }
-    return NULL;
+}
+
+void json_key_init(json_key* k, const char* key, size_t len) {
+    assert(k != NULL && (key != NULL || len == 0));
+    k->key = key;
+    k->length = len;
+    k->prefix = key_prefix(key, len);
+    k->slot = 0;
+}
+
+int object_find_key(const json_value* val, json_key* k) {
+    return object_member_key(val, k) != NULL;
+}
+
+json_value* object_member_key(const json_value* val, json_key* k) {
+    json_member* m;
+    assert(val != NULL && val->type == VALUE_OBJECT && k != NULL);
+    if (k->slot < val->obj.size) {
+        m = &val->obj.members[k->slot];
+        if (member_compare(m, k->key, k->length, k->prefix) == 0) return &m->value;
+    }
+    if (val->obj.size == 0 || (m = search_prefixed(val->obj.members, k->key, k->length, k->prefix)) == NULL) return NULL;
+    k->slot = (size_t)(m - val->obj.members);
+    return &m->value;
 }
 
 void rebuild_member_tree(json_value* val) {
-    json_member* root = &val->obj.members[0];
-    for (size_t i = 1; i < val->obj.size; i++) down_member(root, &val->obj.members[i]);
+    value_unshare(val);
+    for (size_t i = 0; i < val->obj.size; i++) down_member(val->obj.members, &val->obj.members[i]);
 }
 
 double get_value_number(const json_value* val) {
     assert(val != NULL && val->type == VALUE_NUMBER);
-    return val->num;
+    return val->flags & VALUE_RAW_NUMBER ? raw_number_value(val) : val->num;
+}
+
+void set_raw_number(json_value* val, const char* text, size_t len) {
+    raw_number* r = (raw_number*)JSON_MALLOC(RAW_NUMBER_SIZE(len));
+    r->bits = RAW_PENDING;
+    memcpy(r->text, text, len);
+    r->text[len] = '\0';
+    val->str.s = (char*)r;
+    val->str.length = len;
+    val->type = VALUE_NUMBER;
+    val->flags = VALUE_RAW_NUMBER;
+}
+
+/* decodes on first use, the bits go through the same relaxed atomics as memoized hashes */
+double raw_number_value(const json_value* val) {
+    raw_number* r = RAW_NUMBER(val);
+    uint64_t bits = HASH_LOAD(&r->bits);
+    double d;
+    if (bits != RAW_PENDING) {
+        memcpy(&d, &bits, sizeof(d));
+        return d;
+    }
+    d = strtod(r->text, NULL);
+    memcpy(&bits, &d, sizeof(d));
+    HASH_STORE(&r->bits, bits);
+    return d;
 }
 
 void set_value_number(json_value* val, double num) {
     assert(val != NULL);
+    ASSERT_THAWED(val);
     free_value(val);
     val->type = VALUE_NUMBER;
     val->num = num;
@@ -796,28 +2177,39 @@ void set_value_number(json_value* val, double num) {
 
 void set_value_null(json_value* val) {
     assert(val != NULL);
+    ASSERT_THAWED(val);
     free_value(val);
     val->type = VALUE_NULL;
 }
 
 void set_value_true(json_value* val) {
     assert(val != NULL);
+    ASSERT_THAWED(val);
     free_value(val);
     val->type = VALUE_TRUE;
 }
 
 void set_value_false(json_value* val) {
     assert(val != NULL);
+    ASSERT_THAWED(val);
     free_value(val);
     val->type = VALUE_FALSE;
 }
 
 void value_copy(json_value* dst, const json_value* src) {
     assert(dst != NULL && src != NULL && dst != src);
+    ASSERT_THAWED(dst);
     free_value(dst);
+    if (src->flags & VALUE_SHARED) {
+        memcpy(dst, src, sizeof(json_value));
+        value_retain(dst);
+        dst->flags &= ~(VALUE_FROZEN | VALUE_FROZEN_ROOT);
+        return;
+    }
     switch (src->type) {
         case VALUE_NUMBER:
-            set_value_number(dst, src->num);
+            if (src->flags & VALUE_RAW_NUMBER) set_raw_number(dst, RAW_NUMBER(src)->text, src->str.length);
+            else set_value_number(dst, src->num);
             break;
         case VALUE_NULL:
             set_value_null(dst);
@@ -831,6 +2223,9 @@ void value_copy(json_value* dst, const json_value* src) {
         case VALUE_STRING:
             set_value_string(dst, src->str.s, src->str.length);
             break;
+        case VALUE_RAW:
+            set_raw(dst, src->str.s, src->str.length);
+            break;
         case VALUE_ARRAY:
             set_value_array(dst, src->arr.capacity);
             for (size_t i = 0; i < src->arr.size; i++) {
@@ -844,15 +2239,14 @@ void value_copy(json_value* dst, const json_value* src) {
             set_value_object(dst, src->obj.capacity);
             for (size_t i = 0; i < src->obj.size; i++) {
                 json_member m;
-                m.key = (char*)malloc(src->obj.members[i].key_length + 1);
+                m.key = (char*)JSON_MALLOC(src->obj.members[i].key_length + 1);
                 m.key_length = src->obj.members[i].key_length;
-                memcpy(m.key, src->obj.members[0].key, m.key_length + 1);
+                memcpy(m.key, src->obj.members[i].key, m.key_length + 1);
                 m.key[m.key_length] = '\0';
                 json_value v;
                 value_init(&v);
                 value_copy(&v, &src->obj.members[i].value);
                 m.value = v;
-                m.sons[0] = m.sons[1] = NULL;
                 memcpy(&dst->obj.members[dst->obj.size++], &m, sizeof(json_member));
             }
             dst->obj.size = src->obj.size;
@@ -866,49 +2260,211 @@ void value_copy(json_value* dst, const json_value* src) {
 
 void value_move(json_value* dst, json_value* src) {
     assert(dst != NULL && src != NULL);
+    ASSERT_THAWED(dst);
+    ASSERT_ALWAYS((src->flags & (VALUE_FROZEN | VALUE_FROZEN_ROOT)) != VALUE_FROZEN);  /* a frozen root moves whole */
     free_value(dst);
     memcpy(dst, src, sizeof(json_value));
     value_init(src);
 }
 
+/* where the hash of a shared payload is memoized, NULL for private storage and scalars */
+uint64_t* cached_hash(const json_value* val) {
+    if (!(val->flags & VALUE_SHARED)) return NULL;
+    switch (val->type) {
+        case VALUE_NUMBER:
+        case VALUE_STRING:
+        case VALUE_RAW: return &REFCOUNT(val->str.s)->hash;
+        case VALUE_ARRAY: return &REFCOUNT(val->arr.values)->hash;
+        case VALUE_OBJECT: return &REFCOUNT(val->obj.members)->hash;
+        default: return NULL;
+    }
+}
+
+uint64_t hash_mix(uint64_t h) {
+    h ^= h >> 33;
+    h *= 0xFF51AFD7ED558CCDULL;
+    h ^= h >> 33;
+    h *= 0xC4CEB9FE1A85EC53ULL;
+    return h ^ (h >> 33);
+}
+
+uint64_t hash_bytes(const char* p, size_t len, uint64_t seed) {
+    uint64_t h = seed ^ (len * 0x9E3779B97F4A7C15ULL), w;
+    for (; len >= 8; p += 8, len -= 8) {
+        memcpy(&w, p, 8);
+        h = (h ^ hash_mix(w)) * 0x9E3779B97F4A7C15ULL;
+    }
+    w = 0;
+    if (len > 0) memcpy(&w, p, len);
+    return hash_mix(h ^ w);
+}
+
+uint64_t value_hash(const json_value* val) {
+    uint64_t* cache = cached_hash(val);
+    uint64_t h;
+    if (cache != NULL && (h = HASH_LOAD(cache)) != 0) return h;
+    switch (val->type) {
+        case VALUE_NUMBER: {
+            double d = get_value_number(val);
+            if (d == 0) d = 0;  /* -0 == 0 */
+            memcpy(&h, &d, sizeof(h));
+            h = hash_mix(h ^ VALUE_NUMBER);
+            break;
+        }
+        case VALUE_STRING:
+        case VALUE_RAW:
+            h = hash_bytes(val->str.s, val->str.length, val->type);
+            break;
+        case VALUE_ARRAY:
+            h = hash_mix(val->arr.size ^ ((uint64_t)VALUE_ARRAY << 56));
+            for (size_t i = 0; i < val->arr.size; i++) 
+                h = hash_mix(h * 31 + value_hash(&val->arr.values[i]));
+            break;
+        case VALUE_OBJECT:
+            /* members are summed so that their order doesn't matter */
+            h = hash_mix(val->obj.size ^ ((uint64_t)VALUE_OBJECT << 56));
+            for (size_t i = 0; i < val->obj.size; i++) {
+                const json_member* m = &val->obj.members[i];
+                h += hash_mix(hash_bytes(m->key, m->key_length, VALUE_OBJECT) + value_hash(&m->value) * 31);
+            }
+            h = hash_mix(h);
+            break;
+        default:
+            h = hash_mix(val->type + 1);
+            break;
+    }
+    if (h == 0) h = 1;
+    if (cache != NULL) HASH_STORE(cache, h);
+    return h;
+}
+
+unsigned long long json_value_hash(json_value* val, int cache) {
+    assert(val != NULL);
+    if (cache) make_shared(val);
+    return value_hash(val);
+}
+
 int value_is_equal(const json_value* lhs, const json_value* rhs) {
+    const uint64_t *lh, *rh;
     assert(lhs != NULL && rhs != NULL);
     if (lhs->type != rhs->type) return 0;
+    /* memoized hashes are free to check, computing them here would cost as much as comparing */
+    if ((lh = cached_hash(lhs)) != NULL && (rh = cached_hash(rhs)) != NULL) {
+        uint64_t l = HASH_LOAD(lh), r = HASH_LOAD(rh);
+        if (l != 0 && r != 0 && l != r) return 0;
+    }
     switch (lhs->type) {
         case VALUE_NUMBER:
-            return lhs->num == rhs->type;
+            return get_value_number(lhs) == get_value_number(rhs);
         case VALUE_STRING:
+        case VALUE_RAW:  /* by text */
             return (lhs->str.length == rhs->str.length && memcmp(lhs->str.s, rhs->str.s, rhs->str.length + 1) == 0);
         case VALUE_ARRAY:
             if (lhs->arr.size != rhs->arr.size) return 0;
+            if (lhs->arr.values == rhs->arr.values) return 1;  /* shared storage */
             for (size_t i = 0; i < rhs->arr.size; i++) 
                 if (!value_is_equal(&lhs->arr.values[i], &rhs->arr.values[i])) return 0;
             return 1;
         case VALUE_OBJECT:
             if (lhs->obj.size != rhs->obj.size) return 0;
-            for (size_t i = 0; i < lhs->obj.size; i++) {
-                if (lhs->obj.members[i].key_length != rhs->obj.members[i].key_length) return 0;
-                if (memcmp(lhs->obj.members[i].key, rhs->obj.members[i].key, rhs->obj.members[i].key_length) != 0) return 0;
-                if (!value_is_equal(&lhs->obj.members[i].value, &rhs->obj.members[i].value)) return 0;
-            }
-            return 1;
+            if (lhs->obj.members == rhs->obj.members) return 1;
+            return object_is_equal(lhs, rhs);
         default:
             return 1;
     }
 }
 
+/* 
+ * objects are equal when their members pair up one to one with equal keys and values, in any
+ * order. members in the same place are paired first and the rest are looked up in the index.
+ * that pairing can only miss a match or use an rhs member twice where a key repeats, and then
+ * the members are matched by sorting instead
+ */
+int object_is_equal(const json_value* lhs, const json_value* rhs) {
+    json_member* members = rhs->obj.members;
+    for (size_t i = 0; i < lhs->obj.size; i++) {
+        const json_member* l = &lhs->obj.members[i];
+        const json_member* r = &members[i];
+        if (l->key_prefix != r->key_prefix || l->key_length != r->key_length
+            || (l->key_length > 8 && memcmp(l->key + 8, r->key + 8, l->key_length - 8) != 0)) {
+            if ((r = search_member(members, l->key, l->key_length)) == NULL) return 0;
+            if (member_repeats(lhs->obj.members, l)) return object_match_members(lhs, rhs);
+        }
+        if (!value_is_equal(&l->value, &r->value))
+            return member_repeats(lhs->obj.members, l) || member_repeats(members, l) ? object_match_members(lhs, rhs) : 0;
+    }
+    return 1;
+}
+
+/* whether another member has m's key: the first one found is the leftmost, the next is its successor */
+int member_repeats(json_member* members, const json_member* m) {
+    json_member *r = members, *found = NULL;
+    uint32_t son;
+    int cmp, seen = 0;
+    for (;;) {
+        if ((cmp = member_compare(r, m->key, m->key_length, m->key_prefix)) == 0) found = r, seen++;
+        if ((son = r->sons[cmp < 0]) == 0) break;
+        r = members + son - 1;
+    }
+    if (seen != 1 || RS(found) == 0) return seen > 1;
+    for (r = members + RS(found) - 1; LS(r) != 0; r = members + LS(r) - 1);
+    return member_compare(r, m->key, m->key_length, m->key_prefix) == 0;
+}
+
+int member_ref_compare(const void* lhs, const void* rhs) {
+    const member_ref* l = (const member_ref*)lhs;
+    const member_ref* r = (const member_ref*)rhs;
+    int cmp = key_compare(l->m->key, l->m->key_length, r->m->key, r->m->key_length);
+    if (cmp != 0) return cmp;
+    return l->hash < r->hash ? -1 : l->hash > r->hash;
+}
+
+/* both sides sorted by key and value hash line up, runs of the same are paired by comparing */
+int object_match_members(const json_value* lhs, const json_value* rhs) {
+    size_t n = lhs->obj.size, i, j, k, run;
+    member_ref* l = (member_ref*)JSON_MALLOC(2 * n * sizeof(member_ref));
+    member_ref* r = l + n;
+    member_ref tmp;
+    int equal = 1;
+    for (i = 0; i < n; i++) {
+        l[i].m = &lhs->obj.members[i];
+        l[i].hash = value_hash(&l[i].m->value);
+        r[i].m = &rhs->obj.members[i];
+        r[i].hash = value_hash(&r[i].m->value);
+    }
+    qsort(l, n, sizeof(member_ref), member_ref_compare);
+    qsort(r, n, sizeof(member_ref), member_ref_compare);
+    for (i = 0; equal && i < n; i++) equal = member_ref_compare(&l[i], &r[i]) == 0;
+    for (i = 0; equal && i < n; i = run) {
+        for (run = i + 1; run < n && member_ref_compare(&l[i], &l[run]) == 0; run++);
+        /* equality is transitive, so any equal partner left in the run will do */
+        for (j = i; equal && j < run; j++) {
+            for (k = j; k < run && !value_is_equal(&l[j].m->value, &r[k].m->value); k++);
+            if (k == run) equal = 0;
+            else tmp = r[j], r[j] = r[k], r[k] = tmp;
+        }
+    }
+    JSON_FREE(l);
+    return equal;
+}
+
 void member_copy(json_member* dst, const json_member* src, json_value* dstr) {
-    free(dst->key);
-    dst->sons[0] = dst->sons[1] = NULL;
+    size_t idx = (size_t)(dst - dstr->obj.members);
+    value_unshare(dstr);
+    dst = dstr->obj.members + idx;
+    JSON_FREE(dst->key);
     dst->key_length = src->key_length;
-    memcpy(dst->key = (char*)malloc(dst->key_length), src->key, dst->key_length);
+    memcpy(dst->key = (char*)JSON_MALLOC(dst->key_length + 1), src->key, dst->key_length);
+    dst->key[dst->key_length] = '\0';
     value_copy(&dst->value, &src->value);
     rebuild_member_tree(dstr);
 }
 
 void member_move(json_member* dst, json_member* src, json_value* dstr) {
-    free(dst->key);
-    dst->sons[0] = dst->sons[1] = NULL;
+    size_t idx = (size_t)(dst - dstr->obj.members);
+    value_unshare(dstr);
+    dst = dstr->obj.members + idx;
+    JSON_FREE(dst->key);
     dst->key_length = src->key_length;
     dst->key = src->key;
     src->key = NULL;
@@ -921,4 +2477,2393 @@ int member_is_equal(const json_member* lhs, const json_member* rhs) {
     assert(lhs != NULL && rhs != NULL);
     if (lhs->key_length != rhs->key_length || memcmp(lhs->key, rhs->key, lhs->key_length)) return 0;
     return value_is_equal(&lhs->value, &rhs->value);
-}
\ No newline at end of file
+}
+parse_result cbor_parse(json_value* val, const char* buf, size_t len) {
+    return binary_parse(val, buf, len, cbor_parse_value);
+}
+
+parse_result cborfile_parse(json_value* val, const char* path) {
+    return binaryfile_parse(val, path, cbor_parse_value);
+}
+
+generate_result cbor_generate(const json_value* val, char** buf, size_t* len) {
+    return binary_generate(val, buf, len, cbor_stringify_value);
+}
+
+generate_result cborfile_generate(const json_value* val, const char* path) {
+    return binaryfile_generate(val, path, cbor_stringify_value);
+}
+
+parse_result msgpack_parse(json_value* val, const char* buf, size_t len) {
+    return binary_parse(val, buf, len, msgpack_parse_value);
+}
+
+parse_result msgpackfile_parse(json_value* val, const char* path) {
+    return binaryfile_parse(val, path, msgpack_parse_value);
+}
+
+generate_result msgpack_generate(const json_value* val, char** buf, size_t* len) {
+    return binary_generate(val, buf, len, msgpack_stringify_value);
+}
+
+generate_result msgpackfile_generate(const json_value* val, const char* path) {
+    return binaryfile_generate(val, path, msgpack_stringify_value);
+}
+
+parse_result binary_parse(json_value* val, const char* buf, size_t len, binary_parse_func f) {
+    binary_helper bh;
+    parse_result ret;
+    assert(val != NULL && (buf != NULL || len == 0));
+    bh.p = (const unsigned char*)buf;
+    bh.end = bh.p + len;
+    bh.depth = QGCJSON_MAX_DEPTH;
+    value_init(val);
+    if (bh.p == bh.end) return PARSE_EXPECT_VALUR;
+    if ((ret = f(&bh, val)) == PARSE_OK && bh.p != bh.end) {
+        free_value(val);
+        ret = PARSE_ROOT_NOT_SINGULAR;
+    }
+    return ret;
+}
+
+parse_result binaryfile_parse(json_value* val, const char* path, binary_parse_func f) {
+    parse_result ret;
+    size_t len;
+    char* buf = read_file(path, &len);
+    if (buf == NULL) return CAN_NOT_OPEN_FILE;
+    ret = binary_parse(val, buf, len, f);
+    JSON_FREE(buf);
+    return ret;
+}
+
+generate_result binary_generate(const json_value* val, char** buf, size_t* len, binary_stringify_func f) {
+    parse_helper ph;
+    generate_result ret;
+    assert(val != NULL && buf != NULL && len != NULL);
+    helper_init(&ph, NULL);
+    ph.stack = (char*)JSON_MALLOC(ph.size = HELPER_STACK_INITIAL_SIZE);
+    if ((ret = f(&ph, val)) != STRINGIFY_OK) {
+        JSON_FREE(ph.stack);
+        *buf = NULL;
+        return ret;
+    }
+    *len = ph.top;
+    *buf = ph.stack;
+    return ret;
+}
+
+generate_result binaryfile_generate(const json_value* val, const char* path, binary_stringify_func f) {
+    generate_result ret;
+    char* buf;
+    size_t len;
+    if ((ret = binary_generate(val, &buf, &len, f)) != STRINGIFY_OK) return ret;
+    if (!write_file(path, buf, len)) ret = CAN_NOT_OPEN_FILE_W;
+    JSON_FREE(buf);
+    return ret;
+}
+
+int binary_get_be(binary_helper* bh, size_t bytes, uint64_t* n) {
+    if ((size_t)(bh->end - bh->p) < bytes) return 0;
+    for (*n = 0; bytes > 0; bytes--) *n = (*n << 8) | *bh->p++;
+    return 1;
+}
+
+void binary_put_be(parse_helper* ph, uint64_t n, size_t bytes) {
+    unsigned char* p = (unsigned char*)helper_push(ph, bytes);
+    while (bytes-- > 0) {
+        p[bytes] = (unsigned char)(n & 0xFF);
+        n >>= 8;
+    }
+}
+
+/* reads a big-endian IEEE float of the given width */
+parse_result binary_parse_number(binary_helper* bh, json_value* val, size_t bytes) {
+    uint64_t n;
+    double d;
+    if (!binary_get_be(bh, bytes, &n)) return PARSE_INVALID_BINARY;
+    if (bytes == 8) memcpy(&d, &n, sizeof(d));
+    else if (bytes == 4) {
+        uint32_t u = (uint32_t)n;
+        float f;
+        memcpy(&f, &u, sizeof(f));
+        d = f;
+    }
+    else {
+        unsigned exp = (unsigned)(n >> 10) & 0x1F, mant = (unsigned)n & 0x3FF;
+        if (exp == 31) return PARSE_INVALID_BINARY;
+        d = exp == 0 ? ldexp(mant, -24) : ldexp(mant + 1024, (int)exp - 25);
+        if (n & 0x8000) d = -d;
+    }
+    if (!isfinite(d)) return PARSE_INVALID_BINARY;
+    val->num = d;
+    val->type = VALUE_NUMBER;
+    return PARSE_OK;
+}
+
+/* text strings must be utf-8 in both formats, the same check parse_string makes */
+parse_result binary_parse_string(binary_helper* bh, json_value* val, uint64_t len) {
+    size_t i, n;
+    if (len > (uint64_t)(bh->end - bh->p)) return PARSE_INVALID_BINARY;
+    for (i = 0; i < (size_t)len; i += n)
+        if ((n = utf8_sequence(bh->p + i, (size_t)len - i)) == 0) return PARSE_INVALID_UTF8;
+    set_value_string(val, (const char*)bh->p, (size_t)len);
+    bh->p += len;
+    return PARSE_OK;
+}
+
+parse_result binary_parse_array(binary_helper* bh, json_value* val, uint64_t size, binary_parse_func f) {
+    parse_result ret = PARSE_OK;
+    /* every element takes at least one byte, so a bogus size can't make us over-allocate */
+    if (size > (uint64_t)(bh->end - bh->p) || bh->depth == 0) return PARSE_INVALID_BINARY;
+    bh->depth--;
+    set_value_array(val, (size_t)size);
+    while (val->arr.size < size) {
+        json_value* e = &val->arr.values[val->arr.size];
+        value_init(e);
+        if ((ret = f(bh, e)) != PARSE_OK) break;
+        val->arr.size++;
+    }
+    bh->depth++;
+    if (ret != PARSE_OK) free_value(val);
+    return ret;
+}
+
+parse_result binary_parse_object(binary_helper* bh, json_value* val, uint64_t size, binary_parse_func f) {
+    parse_result ret = PARSE_OK;
+    if (size > (uint64_t)(bh->end - bh->p) / 2 || bh->depth == 0) return PARSE_INVALID_BINARY;
+    bh->depth--;
+    set_value_object(val, (size_t)size);
+    while (val->obj.size < size) {
+        json_member* m = &val->obj.members[val->obj.size];
+        json_value key;
+        value_init(&key);
+        if ((ret = f(bh, &key)) != PARSE_OK) break;
+        if (key.type != VALUE_STRING) {
+            free_value(&key);
+            ret = PARSE_MISS_MEMBER_KEY;
+            break;
+        }
+        m->key = key.str.s;
+        m->key_length = key.str.length;
+        value_init(&m->value);
+        val->obj.size++;
+        if ((ret = f(bh, &m->value)) != PARSE_OK) break;
+    }
+    bh->depth++;
+    if (ret != PARSE_OK) free_value(val);
+    else rebuild_member_tree(val);
+    return ret;
+}
+
+parse_result cbor_parse_value(binary_helper* bh, json_value* val) {
+    unsigned major, info;
+    uint64_t n;
+    do {  /* tags carry no meaning for json, a chain of them is skipped */
+        if (bh->p == bh->end) return PARSE_INVALID_BINARY;
+        major = *bh->p >> 5;
+        info = *bh->p++ & 0x1F;
+        if (major == 7) {
+            switch (info) {
+                case 20: val->type = VALUE_FALSE; return PARSE_OK;
+                case 21: val->type = VALUE_TRUE; return PARSE_OK;
+                case 22: 
+                case 23: val->type = VALUE_NULL; return PARSE_OK;
+                case 25: return binary_parse_number(bh, val, 2);
+                case 26: return binary_parse_number(bh, val, 4);
+                case 27: return binary_parse_number(bh, val, 8);
+                default: return PARSE_INVALID_BINARY;
+            }
+        }
+        if (info < 24) n = info;
+        else if (info <= 27) {
+            if (!binary_get_be(bh, (size_t)1 << (info - 24), &n)) return PARSE_INVALID_BINARY;
+        }
+        else return PARSE_INVALID_BINARY;  /* indefinite lengths are not supported */
+    } while (major == 6);
+    switch (major) {
+        case 0: 
+            val->num = (double)n;
+            val->type = VALUE_NUMBER;
+            return PARSE_OK;
+        case 1:
+            val->num = -1.0 - (double)n;
+            val->type = VALUE_NUMBER;
+            return PARSE_OK;
+        case 3: return binary_parse_string(bh, val, n);
+        case 4: return binary_parse_array(bh, val, n, cbor_parse_value);
+        case 5: return binary_parse_object(bh, val, n, cbor_parse_value);
+        default: return PARSE_INVALID_BINARY;
+    }
+}
+
+void cbor_put_head(parse_helper* ph, unsigned major, uint64_t n) {
+    major <<= 5;
+    if (n < 24) PUTC(ph, (char)(major | n));
+    else if (n <= 0xFF) { PUTC(ph, (char)(major | 24)); binary_put_be(ph, n, 1); }
+    else if (n <= 0xFFFF) { PUTC(ph, (char)(major | 25)); binary_put_be(ph, n, 2); }
+    else if (n <= 0xFFFFFFFF) { PUTC(ph, (char)(major | 26)); binary_put_be(ph, n, 4); }
+    else { PUTC(ph, (char)(major | 27)); binary_put_be(ph, n, 8); }
+}
+
+generate_result cbor_stringify_value(parse_helper* ph, const json_value* val) {
+    generate_result ret = STRINGIFY_OK;
+    uint64_t bits;
+    double d;
+    switch (val->type) {
+        case VALUE_NULL: PUTC(ph, (char)0xF6); break;
+        case VALUE_TRUE: PUTC(ph, (char)0xF5); break;
+        case VALUE_FALSE: PUTC(ph, (char)0xF4); break;
+        case VALUE_NUMBER:
+            d = get_value_number(val);
+            memcpy(&bits, &d, sizeof(bits));
+            PUTC(ph, (char)0xFB);
+            binary_put_be(ph, bits, 8);
+            break;
+        case VALUE_RAW: {
+            json_value tmp;
+            raw_expand(val, &tmp);
+            ret = cbor_stringify_value(ph, &tmp);
+            free_value(&tmp);
+            break;
+        }
+        case VALUE_STRING:
+            cbor_put_head(ph, 3, val->str.length);
+            if (val->str.length > 0) PUTS(ph, val->str.s, val->str.length);
+            break;
+        case VALUE_ARRAY:
+            cbor_put_head(ph, 4, val->arr.size);
+            for (size_t i = 0; i < val->arr.size && ret == STRINGIFY_OK; i++) 
+                ret = cbor_stringify_value(ph, &val->arr.values[i]);
+            break;
+        case VALUE_OBJECT:
+            cbor_put_head(ph, 5, val->obj.size);
+            for (size_t i = 0; i < val->obj.size && ret == STRINGIFY_OK; i++) {
+                cbor_put_head(ph, 3, val->obj.members[i].key_length);
+                if (val->obj.members[i].key_length > 0) 
+                    PUTS(ph, val->obj.members[i].key, val->obj.members[i].key_length);
+                ret = cbor_stringify_value(ph, &val->obj.members[i].value);
+            }
+            break;
+        default:
+            ret = STRINGIFY_INVALID_VALUE;
+            break;
+    }
+    return ret;
+}
+
+parse_result msgpack_parse_value(binary_helper* bh, json_value* val) {
+    unsigned char tag;
+    uint64_t n;
+    size_t bytes;
+    if (bh->p == bh->end) return PARSE_INVALID_BINARY;
+    tag = *bh->p++;
+    if (tag <= 0x7F || tag >= 0xE0) {  /* positive / negative fixint */
+        val->num = tag <= 0x7F ? (int)tag : (int)tag - 0x100;
+        val->type = VALUE_NUMBER;
+        return PARSE_OK;
+    }
+    if ((tag & 0xF0) == 0x80) return binary_parse_object(bh, val, tag & 0x0F, msgpack_parse_value);
+    if ((tag & 0xF0) == 0x90) return binary_parse_array(bh, val, tag & 0x0F, msgpack_parse_value);
+    if ((tag & 0xE0) == 0xA0) return binary_parse_string(bh, val, tag & 0x1F);
+    switch (tag) {
+        case 0xC0: val->type = VALUE_NULL; return PARSE_OK;
+        case 0xC2: val->type = VALUE_FALSE; return PARSE_OK;
+        case 0xC3: val->type = VALUE_TRUE; return PARSE_OK;
+        case 0xCA: return binary_parse_number(bh, val, 4);
+        case 0xCB: return binary_parse_number(bh, val, 8);
+        case 0xCC: case 0xCD: case 0xCE: case 0xCF:
+            if (!binary_get_be(bh, (size_t)1 << (tag - 0xCC), &n)) return PARSE_INVALID_BINARY;
+            val->num = (double)n;
+            val->type = VALUE_NUMBER;
+            return PARSE_OK;
+        case 0xD0: case 0xD1: case 0xD2: case 0xD3:
+            bytes = (size_t)1 << (tag - 0xD0);
+            if (!binary_get_be(bh, bytes, &n)) return PARSE_INVALID_BINARY;
+            if (bytes < 8 && (n >> (bytes * 8 - 1))) n |= ~(uint64_t)0 << (bytes * 8);  /* sign extend */
+            val->num = (double)(int64_t)n;
+            val->type = VALUE_NUMBER;
+            return PARSE_OK;
+        case 0xD9: case 0xDA: case 0xDB:
+            if (!binary_get_be(bh, (size_t)1 << (tag - 0xD9), &n)) return PARSE_INVALID_BINARY;
+            return binary_parse_string(bh, val, n);
+        case 0xDC: case 0xDD:
+            if (!binary_get_be(bh, (size_t)2 << (tag - 0xDC), &n)) return PARSE_INVALID_BINARY;
+            return binary_parse_array(bh, val, n, msgpack_parse_value);
+        case 0xDE: case 0xDF:
+            if (!binary_get_be(bh, (size_t)2 << (tag - 0xDE), &n)) return PARSE_INVALID_BINARY;
+            return binary_parse_object(bh, val, n, msgpack_parse_value);
+        default:
+            return PARSE_INVALID_BINARY;  /* bin and ext have no json counterpart */
+    }
+}
+
+/* base is the first sized tag: str8 for strings, array16/map16 for containers */
+void msgpack_put_head(parse_helper* ph, unsigned char fix, unsigned char base, uint64_t n, size_t fix_max) {
+    if (n < fix_max) PUTC(ph, (char)(fix | n));
+    else if (base == 0xD9 && n <= 0xFF) { PUTC(ph, (char)base); binary_put_be(ph, n, 1); }
+    else if (n <= 0xFFFF) { PUTC(ph, (char)(base + (base == 0xD9))); binary_put_be(ph, n, 2); }
+    else { PUTC(ph, (char)(base + 1 + (base == 0xD9))); binary_put_be(ph, n, 4); }
+}
+
+generate_result msgpack_stringify_value(parse_helper* ph, const json_value* val) {
+    generate_result ret = STRINGIFY_OK;
+    uint64_t bits;
+    double d;
+    switch (val->type) {
+        case VALUE_NULL: PUTC(ph, (char)0xC0); break;
+        case VALUE_TRUE: PUTC(ph, (char)0xC3); break;
+        case VALUE_FALSE: PUTC(ph, (char)0xC2); break;
+        case VALUE_NUMBER:
+            d = get_value_number(val);
+            memcpy(&bits, &d, sizeof(bits));
+            PUTC(ph, (char)0xCB);
+            binary_put_be(ph, bits, 8);
+            break;
+        case VALUE_RAW: {
+            json_value tmp;
+            raw_expand(val, &tmp);
+            ret = msgpack_stringify_value(ph, &tmp);
+            free_value(&tmp);
+            break;
+        }
+        case VALUE_STRING:
+            if ((uint64_t)val->str.length > 0xFFFFFFFF) return STRINGIFY_INVALID_VALUE;
+            msgpack_put_head(ph, 0xA0, 0xD9, val->str.length, 32);
+            if (val->str.length > 0) PUTS(ph, val->str.s, val->str.length);
+            break;
+        case VALUE_ARRAY:
+            if ((uint64_t)val->arr.size > 0xFFFFFFFF) return STRINGIFY_INVALID_VALUE;
+            msgpack_put_head(ph, 0x90, 0xDC, val->arr.size, 16);
+            for (size_t i = 0; i < val->arr.size && ret == STRINGIFY_OK; i++) 
+                ret = msgpack_stringify_value(ph, &val->arr.values[i]);
+            break;
+        case VALUE_OBJECT:
+            if ((uint64_t)val->obj.size > 0xFFFFFFFF) return STRINGIFY_INVALID_VALUE;
+            msgpack_put_head(ph, 0x80, 0xDE, val->obj.size, 16);
+            for (size_t i = 0; i < val->obj.size && ret == STRINGIFY_OK; i++) {
+                if ((uint64_t)val->obj.members[i].key_length > 0xFFFFFFFF) return STRINGIFY_INVALID_VALUE;
+                msgpack_put_head(ph, 0xA0, 0xD9, val->obj.members[i].key_length, 32);
+                if (val->obj.members[i].key_length > 0) 
+                    PUTS(ph, val->obj.members[i].key, val->obj.members[i].key_length);
+                ret = msgpack_stringify_value(ph, &val->obj.members[i].value);
+            }
+            break;
+        default:
+            ret = STRINGIFY_INVALID_VALUE;
+            break;
+    }
+    return ret;
+}
+
+#define SNAPSHOT_MAGIC "QGCJSNAP"
+#define SNAPSHOT_VERSION 1
+#define SNAPSHOT_ENDIAN 0x01020304
+#define SNAPSHOT_ALIGN 8
+#define SNAPSHOT_AT(ph, off, type) ((type*)((ph)->stack + (off)))
+#define SNAPSHOT_NODE(v) ((const snapshot_node*)(v)->node)
+
+generate_result snapshot_generate(const json_value* val, char** buf, size_t* len) {
+    parse_helper ph;
+    snapshot_header* header;
+    assert(val != NULL && buf != NULL && len != NULL);
+    helper_init(&ph, NULL);
+    snapshot_reserve(&ph, sizeof(snapshot_header));
+    snapshot_stringify_value(&ph, offsetof(snapshot_header, root), val);
+    header = SNAPSHOT_AT(&ph, 0, snapshot_header);
+    memcpy(header->magic, SNAPSHOT_MAGIC, sizeof(header->magic));
+    header->version = SNAPSHOT_VERSION;
+    header->endian = SNAPSHOT_ENDIAN;
+    header->size = *len = ph.top;
+    *buf = ph.stack;
+    return STRINGIFY_OK;
+}
+
+generate_result snapshotfile_generate(const json_value* val, const char* path) {
+    generate_result ret;
+    char* buf;
+    size_t len;
+    if ((ret = snapshot_generate(val, &buf, &len)) != STRINGIFY_OK) return ret;
+    if (!write_file(path, buf, len)) ret = CAN_NOT_OPEN_FILE_W;
+    JSON_FREE(buf);
+    return ret;
+}
+
+/* pushes zeroed, aligned space and returns its offset; the stack may move */
+size_t snapshot_reserve(parse_helper* ph, size_t size) {
+    size_t pad = (SNAPSHOT_ALIGN - ph->top % SNAPSHOT_ALIGN) % SNAPSHOT_ALIGN, off;
+    if (pad + size == 0) return ph->top;
+    memset(helper_push(ph, pad + size), 0, pad + size);
+    off = ph->top - size;
+    return off;
+}
+
+int snapshot_member_compare(const void* lhs, const void* rhs) {
+    const json_member* l = *(const json_member* const*)lhs;
+    const json_member* r = *(const json_member* const*)rhs;
+    int cmp = key_compare(l->key, l->key_length, r->key, r->key_length);
+    return cmp != 0 ? cmp : (l > r) - (l < r);  /* repeated keys stay in member order */
+}
+
+/* fills in the node reserved at offset node, children are laid out depth-first after it */
+void snapshot_stringify_value(parse_helper* ph, size_t node, const json_value* val) {
+    size_t off, i;
+    SNAPSHOT_AT(ph, node, snapshot_node)->type = val->type;
+    switch (val->type) {
+        case VALUE_NUMBER: {
+            double d = get_value_number(val);
+            memcpy(&SNAPSHOT_AT(ph, node, snapshot_node)->a, &d, sizeof(double));
+            break;
+        }
+        case VALUE_RAW: {
+            json_value tmp;
+            raw_expand(val, &tmp);
+            snapshot_stringify_value(ph, node, &tmp);
+            free_value(&tmp);
+            break;
+        }
+        case VALUE_STRING:
+            off = snapshot_reserve(ph, val->str.length + 1);
+            memcpy(ph->stack + off, val->str.s, val->str.length);
+            SNAPSHOT_AT(ph, node, snapshot_node)->a = off;
+            SNAPSHOT_AT(ph, node, snapshot_node)->b = val->str.length;
+            break;
+        case VALUE_ARRAY:
+            off = snapshot_reserve(ph, val->arr.size * sizeof(snapshot_node));
+            SNAPSHOT_AT(ph, node, snapshot_node)->a = off;
+            SNAPSHOT_AT(ph, node, snapshot_node)->b = val->arr.size;
+            for (i = 0; i < val->arr.size; i++) 
+                snapshot_stringify_value(ph, off + i * sizeof(snapshot_node), &val->arr.values[i]);
+            break;
+        case VALUE_OBJECT: {
+            size_t n = val->obj.size, key;
+            const json_member** sorted;
+            uint32_t* index;
+            off = snapshot_reserve(ph, n * sizeof(snapshot_member) + n * sizeof(uint32_t));
+            SNAPSHOT_AT(ph, node, snapshot_node)->a = off;
+            SNAPSHOT_AT(ph, node, snapshot_node)->b = n;
+            if (n == 0) break;
+            sorted = (const json_member**)JSON_MALLOC(n * sizeof(json_member*));
+            for (i = 0; i < n; i++) sorted[i] = &val->obj.members[i];
+            qsort(sorted, n, sizeof(json_member*), snapshot_member_compare);
+            index = SNAPSHOT_AT(ph, off + n * sizeof(snapshot_member), uint32_t);
+            for (i = 0; i < n; i++) index[i] = (uint32_t)(sorted[i] - val->obj.members);
+            JSON_FREE(sorted);
+            for (i = 0; i < n; i++) {
+                const json_member* m = &val->obj.members[i];
+                key = snapshot_reserve(ph, m->key_length + 1);
+                memcpy(ph->stack + key, m->key, m->key_length);
+                SNAPSHOT_AT(ph, off + i * sizeof(snapshot_member), snapshot_member)->key = key;
+                SNAPSHOT_AT(ph, off + i * sizeof(snapshot_member), snapshot_member)->key_length = m->key_length;
+                snapshot_stringify_value(ph, off + i * sizeof(snapshot_member) + offsetof(snapshot_member, value), &m->value);
+            }
+            break;
+        }
+        default:
+            break;
+    }
+}
+
+/* only the header is checked, snapshot_verify walks the rest */
+parse_result snapshot_open(json_snapshot* snap, const char* buf, size_t len) {
+    const snapshot_header* header = (const snapshot_header*)buf;
+    assert(snap != NULL);
+    snap->data = NULL;
+    snap->size = 0;
+    snap->mapped = snap->owned = 0;
+    if (buf == NULL || len < sizeof(snapshot_header) || (uintptr_t)buf % SNAPSHOT_ALIGN != 0) return PARSE_INVALID_BINARY;
+    if (memcmp(header->magic, SNAPSHOT_MAGIC, sizeof(header->magic)) != 0 || header->version != SNAPSHOT_VERSION
+        || header->endian != SNAPSHOT_ENDIAN || header->size != len) 
+        return PARSE_INVALID_BINARY;
+    snap->data = buf;
+    snap->size = len;
+    return PARSE_OK;
+}
+
+/* the payload must sit exactly where snapshot_generate would have reserved it */
+int snapshot_check_payload(snapshot_checker* sc, uint64_t off, uint64_t size) {
+    size_t pad = (SNAPSHOT_ALIGN - sc->next % SNAPSHOT_ALIGN) % SNAPSHOT_ALIGN;
+    if (pad + size == 0) return off == sc->next;
+    if (off != sc->next + pad || size > sc->size - sc->next - pad) return 0;
+    sc->next += pad + (size_t)size;
+    return 1;
+}
+
+/* 
+ * payloads are checked in the order they were reserved, so every offset is pinned to a single
+ * place and no two nodes can share or overlap storage
+ */
+int snapshot_check_value(snapshot_checker* sc, const snapshot_node* node) {
+    uint64_t i, n = node->b;
+    if (node->reserved != 0) return 0;
+    switch (node->type) {
+        case VALUE_NULL:
+        case VALUE_FALSE:
+        case VALUE_TRUE:
+            return node->a == 0 && n == 0;
+        case VALUE_NUMBER:
+            return n == 0;
+        case VALUE_STRING:
+            return n < sc->size && snapshot_check_payload(sc, node->a, n + 1) && sc->base[node->a + n] == '\0';
+        case VALUE_ARRAY: {
+            const snapshot_node* values;
+            if (sc->depth == 0) return !(sc->too_deep = 1);
+            if (n > sc->size / sizeof(snapshot_node)) return 0;
+            if (!snapshot_check_payload(sc, node->a, n * sizeof(snapshot_node))) return 0;
+            values = (const snapshot_node*)(sc->base + node->a);
+            sc->depth--;
+            for (i = 0; i < n; i++)
+                if (!snapshot_check_value(sc, &values[i])) return 0;
+            sc->depth++;
+            return 1;
+        }
+        case VALUE_OBJECT: {
+            const snapshot_member* members;
+            const uint32_t* index;
+            if (sc->depth == 0) return !(sc->too_deep = 1);
+            if (n > sc->size / (sizeof(snapshot_member) + sizeof(uint32_t))) return 0;
+            if (!snapshot_check_payload(sc, node->a, n * (sizeof(snapshot_member) + sizeof(uint32_t)))) return 0;
+            members = (const snapshot_member*)(sc->base + node->a);
+            index = (const uint32_t*)(members + n);
+            sc->depth--;
+            for (i = 0; i < n; i++) {
+                const snapshot_member* m = &members[i];
+                if (index[i] >= n || m->key_length >= sc->size || !snapshot_check_payload(sc, m->key, m->key_length + 1)
+                    || sc->base[m->key + m->key_length] != '\0' || !snapshot_check_value(sc, &m->value))
+                    return 0;
+            }
+            sc->depth++;
+            /* strictly ascending by key, then by position, so the index is a sorted permutation */
+            for (i = 1; i < n; i++) {
+                const snapshot_member* l = &members[index[i - 1]];
+                const snapshot_member* r = &members[index[i]];
+                int cmp = key_compare(sc->base + l->key, (size_t)l->key_length, sc->base + r->key, (size_t)r->key_length);
+                if (cmp > 0 || (cmp == 0 && index[i - 1] >= index[i])) return 0;
+            }
+            return 1;
+        }
+        default:
+            return 0;
+    }
+}
+
+parse_result snapshot_verify(const json_snapshot* snap) {
+    snapshot_checker sc;
+    assert(snap != NULL && snap->data != NULL);
+    sc.base = snap->data;
+    sc.size = snap->size;
+    sc.next = sizeof(snapshot_header);
+    sc.depth = QGCJSON_MAX_DEPTH;
+    sc.too_deep = 0;
+    if (!snapshot_check_value(&sc, &((const snapshot_header*)snap->data)->root))
+        return sc.too_deep ? PARSE_TOO_DEEP : PARSE_INVALID_BINARY;
+    return sc.next == sc.size ? PARSE_OK : PARSE_INVALID_BINARY;
+}
+
+parse_result snapshotfile_open(json_snapshot* snap, const char* path) {
+    parse_result ret;
+    char* buf;
+    size_t len;
+#ifdef QGCJSON_MMAP
+    struct stat st;
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) return CAN_NOT_OPEN_FILE;
+    if (fstat(fd, &st) != 0 || st.st_size <= 0) {
+        close(fd);
+        return CAN_NOT_OPEN_FILE;
+    }
+    len = (size_t)st.st_size;
+    buf = (char*)mmap(NULL, len, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (buf == (char*)MAP_FAILED) return CAN_NOT_OPEN_FILE;
+    if ((ret = snapshot_open(snap, buf, len)) != PARSE_OK) munmap(buf, len);
+    else snap->mapped = 1;
+#else
+    if ((buf = read_file(path, &len)) == NULL) return CAN_NOT_OPEN_FILE;
+    if ((ret = snapshot_open(snap, buf, len)) != PARSE_OK) JSON_FREE(buf);
+    else snap->owned = 1;
+#endif
+    return ret;
+}
+
+void snapshot_close(json_snapshot* snap) {
+    assert(snap != NULL);
+#ifdef QGCJSON_MMAP
+    if (snap->mapped) munmap((void*)snap->data, snap->size);
+#endif
+    if (snap->owned) JSON_FREE((void*)snap->data);
+    snap->data = NULL;
+    snap->size = 0;
+    snap->mapped = snap->owned = 0;
+}
+
+snapshot_value get_snapshot_root(const json_snapshot* snap) {
+    snapshot_value v;
+    assert(snap != NULL && snap->data != NULL);
+    v.base = snap->data;
+    v.node = &((const snapshot_header*)snap->data)->root;
+    return v;
+}
+
+value_type get_snapshot_type(const snapshot_value* v) {
+    assert(v != NULL);
+    return (value_type)SNAPSHOT_NODE(v)->type;
+}
+
+double get_snapshot_number(const snapshot_value* v) {
+    double d;
+    assert(v != NULL && SNAPSHOT_NODE(v)->type == VALUE_NUMBER);
+    memcpy(&d, &SNAPSHOT_NODE(v)->a, sizeof(d));
+    return d;
+}
+
+const char* get_snapshot_string(const snapshot_value* v) {
+    assert(v != NULL && SNAPSHOT_NODE(v)->type == VALUE_STRING);
+    return v->base + SNAPSHOT_NODE(v)->a;
+}
+
+size_t get_snapshot_string_length(const snapshot_value* v) {
+    assert(v != NULL && SNAPSHOT_NODE(v)->type == VALUE_STRING);
+    return (size_t)SNAPSHOT_NODE(v)->b;
+}
+
+size_t get_snapshot_array_size(const snapshot_value* v) {
+    assert(v != NULL && SNAPSHOT_NODE(v)->type == VALUE_ARRAY);
+    return (size_t)SNAPSHOT_NODE(v)->b;
+}
+
+snapshot_value get_snapshot_array_element(const snapshot_value* v, size_t idx) {
+    snapshot_value e;
+    assert(v != NULL && SNAPSHOT_NODE(v)->type == VALUE_ARRAY && idx < SNAPSHOT_NODE(v)->b);
+    e.base = v->base;
+    e.node = v->base + SNAPSHOT_NODE(v)->a + idx * sizeof(snapshot_node);
+    return e;
+}
+
+size_t get_snapshot_object_size(const snapshot_value* v) {
+    assert(v != NULL && SNAPSHOT_NODE(v)->type == VALUE_OBJECT);
+    return (size_t)SNAPSHOT_NODE(v)->b;
+}
+
+const char* get_snapshot_member_key(const snapshot_value* v, size_t idx, size_t* len) {
+    const snapshot_member* m;
+    assert(v != NULL && SNAPSHOT_NODE(v)->type == VALUE_OBJECT && idx < SNAPSHOT_NODE(v)->b);
+    m = (const snapshot_member*)(v->base + SNAPSHOT_NODE(v)->a) + idx;
+    if (len != NULL) *len = (size_t)m->key_length;
+    return v->base + m->key;
+}
+
+snapshot_value get_snapshot_member_value(const snapshot_value* v, size_t idx) {
+    snapshot_value e;
+    assert(v != NULL && SNAPSHOT_NODE(v)->type == VALUE_OBJECT && idx < SNAPSHOT_NODE(v)->b);
+    e.base = v->base;
+    e.node = &((const snapshot_member*)(v->base + SNAPSHOT_NODE(v)->a) + idx)->value;
+    return e;
+}
+
+/* binary search over the sorted member index */
+int snapshot_find_member(const snapshot_value* v, const char* key, size_t len, snapshot_value* out) {
+    const snapshot_member* members;
+    const uint32_t* index;
+    size_t lo = 0, hi;
+    assert(v != NULL && SNAPSHOT_NODE(v)->type == VALUE_OBJECT && (key != NULL || len == 0));
+    hi = (size_t)SNAPSHOT_NODE(v)->b;
+    members = (const snapshot_member*)(v->base + SNAPSHOT_NODE(v)->a);
+    index = (const uint32_t*)(members + hi);
+    while (lo < hi) {
+        size_t mid = lo + (hi - lo) / 2;
+        const snapshot_member* m = &members[index[mid]];
+        int cmp = key_compare(v->base + m->key, (size_t)m->key_length, key, len);
+        if (cmp == 0) {
+            if (out != NULL) {
+                out->base = v->base;
+                out->node = &m->value;
+            }
+            return 1;
+        }
+        if (cmp < 0) lo = mid + 1;
+        else hi = mid;
+    }
+    return 0;
+}
+
+/* 
+ * subtrees that share storage are taken as unchanged without looking inside. hashes aren't
+ * keyed, so a match is only a hint and is confirmed by comparing, a mismatch settles it
+ */
+int diff_same(const json_value* a, const json_value* b) {
+    if (a->type != b->type) return 0;
+    switch (a->type) {
+        case VALUE_STRING:
+        case VALUE_RAW:
+            if (a->str.s == b->str.s) return 1;
+            break;
+        case VALUE_ARRAY:
+            if (a->arr.values == b->arr.values && a->arr.size == b->arr.size) return 1;
+            break;
+        case VALUE_OBJECT:
+            if (a->obj.members == b->obj.members && a->obj.size == b->obj.size) return 1;
+            break;
+        default:
+            return value_is_equal(a, b);
+    }
+    return value_hash(a) == value_hash(b) && value_is_equal(a, b);
+}
+
+void diff_push_token(parse_helper* ph, const char* key, size_t len) {
+    PUTC(ph, '/');
+    for (size_t i = 0; i < len; i++) {
+        if (key[i] == '~') PUTS(ph, "~0", 2);
+        else if (key[i] == '/') PUTS(ph, "~1", 2);
+        else PUTC(ph, key[i]);
+    }
+}
+
+void diff_push_index(parse_helper* ph, size_t idx) {
+    char buf[24];
+    char* p = buf + sizeof(buf);
+    do *--p = (char)('0' + idx % 10); while ((idx /= 10) != 0);
+    *--p = '/';
+    PUTS(ph, p, (size_t)(buf + sizeof(buf) - p));
+}
+
+/* appends {"op", "path"[, "value"]} with the path being what is on the stack */
+json_value* diff_op(json_value* patch, parse_helper* ph, const char* op, const json_value* val) {
+    json_value* o = array_emplace_back(patch);
+    set_value_object(o, val != NULL ? 3 : 2);
+    set_value_string(object_emplace(o, "op", 2), op, strlen(op));
+    set_value_string(object_emplace(o, "path", 4), ph->stack, ph->top);
+    if (val != NULL) value_copy(object_emplace(o, "value", 5), val);
+    return o;
+}
+
+void diff_value(json_value* patch, parse_helper* ph, const json_value* a, const json_value* b) {
+    size_t top = ph->top, i, pre, suf, na, nb;
+    if (diff_same(a, b)) return;
+    if (a->type != b->type || (a->type != VALUE_ARRAY && a->type != VALUE_OBJECT)) {
+        diff_op(patch, ph, "replace", b);
+        return;
+    }
+    if (a->type == VALUE_OBJECT) {
+        for (i = 0; i < a->obj.size; i++) {
+            const json_member* m = &a->obj.members[i];
+            const json_member* r = b->obj.size > 0 ? search_member(b->obj.members, m->key, m->key_length) : NULL;
+            diff_push_token(ph, m->key, m->key_length);
+            if (r == NULL) diff_op(patch, ph, "remove", NULL);
+            else diff_value(patch, ph, &m->value, &r->value);
+            ph->top = top;
+        }
+        for (i = 0; i < b->obj.size; i++) {
+            const json_member* m = &b->obj.members[i];
+            if (a->obj.size > 0 && search_member(a->obj.members, m->key, m->key_length) != NULL) continue;
+            diff_push_token(ph, m->key, m->key_length);
+            diff_op(patch, ph, "add", &m->value);
+            ph->top = top;
+        }
+        return;
+    }
+    /* 
+     * unchanged runs at both ends are skipped, the rest is diffed position by position and
+     * the difference in length becomes removes (from the back) or adds
+     */
+    na = a->arr.size, nb = b->arr.size;
+    for (pre = 0; pre < na && pre < nb && diff_same(&a->arr.values[pre], &b->arr.values[pre]); pre++);
+    for (suf = 0; suf < na - pre && suf < nb - pre && diff_same(&a->arr.values[na - suf - 1], &b->arr.values[nb - suf - 1]); suf++);
+    na -= pre + suf, nb -= pre + suf;
+    for (i = 0; i < na && i < nb; i++) {
+        diff_push_index(ph, pre + i);
+        diff_value(patch, ph, &a->arr.values[pre + i], &b->arr.values[pre + i]);
+        ph->top = top;
+    }
+    for (i = na; i > nb; i--) {
+        diff_push_index(ph, pre + i - 1);
+        diff_op(patch, ph, "remove", NULL);
+        ph->top = top;
+    }
+    for (i = na; i < nb; i++) {
+        diff_push_index(ph, pre + i);
+        diff_op(patch, ph, "add", &b->arr.values[pre + i]);
+        ph->top = top;
+    }
+}
+
+void json_diff(json_value* patch, json_value* a, json_value* b) {
+    parse_helper ph;
+    assert(patch != NULL && a != NULL && b != NULL && patch != a && patch != b);
+    /* memoized hashes tell a changed subtree in O(1), an unchanged one is compared once */
+    json_value_hash(a, 1);
+    json_value_hash(b, 1);
+    set_value_array(patch, 0);
+    helper_init(&ph, NULL);
+    diff_value(patch, &ph, a, b);
+    JSON_FREE(ph.stack);
+}
+
+/* unescapes the reference token at *p onto the (emptied) stack */
+int pointer_token(parse_helper* ph, const char** p, const char* end) {
+    const char* q = *p + 1;
+    ph->top = 0;
+    for (; q != end && *q != '/'; q++) {
+        if (*q != '~') PUTC(ph, *q);
+        else if (++q != end && (*q == '0' || *q == '1')) PUTC(ph, *q == '0' ? '~' : '/');
+        else return 0;
+    }
+    PUTC(ph, '\0');
+    ph->top--;
+    *p = q;
+    return 1;
+}
+
+int pointer_index(const parse_helper* ph, size_t size, int append, size_t* idx) {
+    const char* t = ph->stack;
+    size_t n = 0;
+    if (ph->top == 1 && t[0] == '-') {
+        *idx = size;
+        return append;
+    }
+    if (ph->top == 0 || (t[0] == '0' && ph->top > 1)) return 0;
+    for (size_t i = 0; i < ph->top; i++) {
+        size_t digit = (size_t)(t[i] - '0');
+        if (!ISDIGIT(t[i]) || n > (size - digit) / 10) return 0;  /* past size, and never wraps */
+        n = n * 10 + digit;
+    }
+    *idx = n;
+    return append ? n <= size : n < size;
+}
+
+json_value* pointer_child(json_value* v, parse_helper* ph, int mut) {
+    size_t idx;
+    if (v->type == VALUE_OBJECT) {
+        json_member* m;
+        if (mut) return object_member_mut(v, ph->stack, ph->top);
+        m = v->obj.size > 0 ? search_member(v->obj.members, ph->stack, ph->top) : NULL;
+        return m != NULL ? &m->value : NULL;
+    }
+    if (v->type != VALUE_ARRAY || !pointer_index(ph, v->arr.size, 0, &idx)) return NULL;
+    return mut ? array_element_mut(v, idx) : &v->arr.values[idx];
+}
+
+/* 
+ * walks a json pointer, with parent set it stops at the container of the last token and leaves
+ * that token on the stack. mut goes through the *_mut accessors so shared storage is copied.
+ */
+json_value* pointer_resolve(json_value* v, const json_value* path, parse_helper* ph, int parent, int mut) {
+    const char* p = path->str.s;
+    const char* end = p + path->str.length;
+    if (p != end && *p != '/') return NULL;
+    while (p != end) {
+        if (!pointer_token(ph, &p, end)) return NULL;
+        if (parent && p == end) return v;
+        if ((v = pointer_child(v, ph, mut)) == NULL) return NULL;
+    }
+    return parent ? NULL : v;
+}
+
+patch_result patch_add(json_value* doc, const json_value* path, json_value* val, parse_helper* ph) {
+    json_value* parent;
+    size_t idx;
+    if (path->str.length == 0) {
+        value_move(doc, val);
+        return PATCH_OK;
+    }
+    if ((parent = pointer_resolve(doc, path, ph, 1, 1)) == NULL) return PATCH_PATH_NOT_FOUND;
+    if (parent->type == VALUE_OBJECT) {
+        json_value* v = object_member_mut(parent, ph->stack, ph->top);
+        value_move(v != NULL ? v : object_emplace(parent, ph->stack, ph->top), val);
+        return PATCH_OK;
+    }
+    if (parent->type != VALUE_ARRAY || !pointer_index(ph, parent->arr.size, 1, &idx)) return PATCH_PATH_NOT_FOUND;
+    array_insert_element(parent, idx);
+    value_move(&parent->arr.values[idx], val);
+    return PATCH_OK;
+}
+
+/* the removed value is moved to out when there is one, freed otherwise */
+patch_result patch_remove(json_value* doc, const json_value* path, json_value* out, parse_helper* ph) {
+    json_value* parent;
+    json_value* v;
+    if ((parent = pointer_resolve(doc, path, ph, 1, 1)) == NULL) return PATCH_PATH_NOT_FOUND;
+    if ((v = pointer_child(parent, ph, 1)) == NULL) return PATCH_PATH_NOT_FOUND;
+    if (out != NULL) value_move(out, v);
+    if (parent->type == VALUE_OBJECT) {
+        remove_member(parent, ph->stack, ph->top);
+    } else {
+        free_value(v);
+        array_delete_element(parent, (size_t)(v - parent->arr.values));
+    }
+    return PATCH_OK;
+}
+
+#define PATCH_FIELD(op, key) object_member_mut(op, key, sizeof(key) - 1)
+#define PATCH_IS(name, key) ((name)->str.length == sizeof(key) - 1 && memcmp((name)->str.s, key, sizeof(key) - 1) == 0)
+
+patch_result patch_operation(json_value* doc, json_value* op, parse_helper* ph) {
+    json_value *name, *path, *from, *val, *target, tmp;
+    patch_result ret;
+    if (op->type != VALUE_OBJECT) return PATCH_INVALID_OPERATION;
+    name = PATCH_FIELD(op, "op");
+    path = PATCH_FIELD(op, "path");
+    from = PATCH_FIELD(op, "from");
+    val = PATCH_FIELD(op, "value");
+    if (name == NULL || name->type != VALUE_STRING || path == NULL || path->type != VALUE_STRING) return PATCH_INVALID_OPERATION;
+    if (PATCH_IS(name, "move") || PATCH_IS(name, "copy")) {
+        if (from == NULL || from->type != VALUE_STRING) return PATCH_INVALID_OPERATION;
+    } else if (!PATCH_IS(name, "remove") && val == NULL) {
+        return PATCH_INVALID_OPERATION;
+    }
+    if (PATCH_IS(name, "add")) return patch_add(doc, path, val, ph);
+    if (PATCH_IS(name, "remove")) {
+        if (path->str.length == 0) return PATCH_INVALID_OPERATION;
+        return patch_remove(doc, path, NULL, ph);
+    }
+    if (PATCH_IS(name, "replace")) {
+        if ((target = pointer_resolve(doc, path, ph, 0, 1)) == NULL) return PATCH_PATH_NOT_FOUND;
+        value_move(target, val);
+        return PATCH_OK;
+    }
+    if (PATCH_IS(name, "test")) {
+        if ((target = pointer_resolve(doc, path, ph, 0, 0)) == NULL) return PATCH_PATH_NOT_FOUND;
+        return value_is_equal(target, val) ? PATCH_OK : PATCH_TEST_FAILED;
+    }
+    value_init(&tmp);
+    if (PATCH_IS(name, "move")) {
+        if (from->str.length == path->str.length && memcmp(from->str.s, path->str.s, path->str.length) == 0) return PATCH_OK;
+        /* a value can't be moved into itself */
+        if (from->str.length < path->str.length && path->str.s[from->str.length] == '/' &&
+            memcmp(from->str.s, path->str.s, from->str.length) == 0) return PATCH_INVALID_OPERATION;
+        if (from->str.length == 0) return PATCH_INVALID_OPERATION;
+        if ((ret = patch_remove(doc, from, &tmp, ph)) != PATCH_OK) return ret;
+    } else if (PATCH_IS(name, "copy")) {
+        if ((target = pointer_resolve(doc, from, ph, 0, 0)) == NULL) return PATCH_PATH_NOT_FOUND;
+        value_copy(&tmp, target);
+    } else {
+        return PATCH_INVALID_OPERATION;
+    }
+    ret = patch_add(doc, path, &tmp, ph);
+    /* a move that can't land goes back where it came from, the parent of from is still there */
+    if (ret != PATCH_OK && PATCH_IS(name, "move")) patch_add(doc, from, &tmp, ph);
+    free_value(&tmp);
+    return ret;
+}
+
+patch_result json_patch_apply(json_value* doc, json_value* patch) {
+    parse_helper ph;
+    patch_result ret = PATCH_OK;
+    assert(doc != NULL && patch != NULL && doc != patch);
+    if (patch->type != VALUE_ARRAY) return PATCH_INVALID_OPERATION;
+    helper_init(&ph, NULL);
+    for (size_t i = 0; i < patch->arr.size && ret == PATCH_OK; i++)
+        ret = patch_operation(doc, array_element_mut(patch, i), &ph);
+    JSON_FREE(ph.stack);
+    return ret;
+}
+
+int schema_init(json_schema* s, const json_field* fields, size_t count) {
+    size_t i, j, size;
+    assert(s != NULL && (fields != NULL || count == 0) && count < UCHAR_MAX);
+    s->fields = fields;
+    s->count = count;
+    s->slots = NULL;
+    for (i = 0; i < count; i++) {
+        const json_field* f = &fields[i];
+        switch (f->type) {
+            case FIELD_NUMBER: if (f->size != sizeof(double)) return 0; break;
+            case FIELD_INT: case FIELD_BOOL: if (f->size != sizeof(int)) return 0; break;
+            case FIELD_STRING: if (f->size != sizeof(char*)) return 0; break;
+            case FIELD_CHARS: if (f->size == 0) return 0; break;
+            case FIELD_OBJECT: if (f->schema == NULL) return 0; break;
+            default: return 0;
+        }
+        for (j = 0; j < i; j++)
+            if (key_compare(f->name, f->name_length, fields[j].name, fields[j].name_length) == 0) return 0;
+    }
+    /* try seeds until no two names share a slot, growing the table when that gets unlikely */
+    for (size = 4; size < count * 4; size <<= 1);
+    s->slots = (unsigned char*)JSON_MALLOC(size);
+    for (s->seed = 1;; s->seed++) {
+        if (s->seed % 64 == 0) {
+            size <<= 1;
+            s->slots = (unsigned char*)JSON_REALLOC(s->slots, size);
+        }
+        s->mask = size - 1;
+        memset(s->slots, 0, size);
+        for (i = 0; i < count; i++) {
+            unsigned char* slot = &s->slots[hash_bytes(fields[i].name, fields[i].name_length, s->seed) & s->mask];
+            if (*slot != 0) break;
+            *slot = (unsigned char)(i + 1);
+        }
+        if (i == count) return 1;
+    }
+}
+
+void schema_free(json_schema* s) {
+    assert(s != NULL);
+    JSON_FREE(s->slots);
+    s->slots = NULL;
+}
+
+const json_field* schema_find(const json_schema* s, const char* key, size_t len) {
+    unsigned char i = s->slots[hash_bytes(key, len, s->seed) & s->mask];
+    const json_field* f;
+    if (i == 0) return NULL;
+    f = &s->fields[i - 1];
+    return f->name_length == len && memcmp(f->name, key, len) == 0 ? f : NULL;
+}
+
+parse_result struct_skip_value(parse_helper* ph) {
+    json_value tmp;
+    parse_result ret;
+    char* str;
+    size_t len;
+    char close;
+    switch (*ph->json) {
+        case 't': return parse_value_true(ph, &tmp);
+        case 'f': return parse_value_false(ph, &tmp);
+        case 'n': return parse_value_null(ph, &tmp);
+        case '"': return parse_string(ph, &str, &len);
+        case '[': case '{': break;
+        case '\0': return PARSE_EXPECT_VALUR;
+        default: return parse_number(ph, &tmp);
+    }
+    close = *ph->json == '[' ? ']' : '}';
+    ph->json++;
+    parse_whitespace(ph);
+    if (*ph->json == close) {
+        ph->json++;
+        return PARSE_OK;
+    }
+    for (;;) {
+        if (close == '}') {
+            if (*ph->json != '"') return PARSE_MISS_MEMBER_KEY;
+            if ((ret = parse_string(ph, &str, &len)) != PARSE_OK) return ret;
+            parse_whitespace(ph);
+            if (*ph->json++ != ':') return PARSE_MISS_MEMBER_COLON;
+            parse_whitespace(ph);
+        }
+        if ((ret = struct_skip_value(ph)) != PARSE_OK) return ret;
+        parse_whitespace(ph);
+        if (*ph->json == ',') {
+            ph->json++;
+            parse_whitespace(ph);
+        } else if (*ph->json == close) {
+            ph->json++;
+            return PARSE_OK;
+        } else {
+            return close == ']' ? PARSE_MISS_COMMA_OR_SQUARE_BRACKET : PARSE_MISS_COMMA_OR_CURLY_BRACKET;
+        }
+    }
+}
+
+parse_result struct_parse_field(parse_helper* ph, char* out, const json_field* f) {
+    json_value tmp;
+    parse_result ret;
+    char* str;
+    size_t len;
+    out += f->offset;
+    if (*ph->json == 'n') return parse_value_null(ph, &tmp);
+    switch (f->type) {
+        case FIELD_NUMBER:
+        case FIELD_INT:
+            if (*ph->json != '-' && !ISDIGIT(*ph->json)) return PARSE_SCHEMA_MISMATCH;
+            if ((ret = parse_number(ph, &tmp)) != PARSE_OK) return ret;
+            if (f->type == FIELD_NUMBER) {
+                memcpy(out, &tmp.num, sizeof(double));
+            } else {
+                int i;
+                if (tmp.num < INT_MIN || tmp.num > INT_MAX || (double)(i = (int)tmp.num) != tmp.num) return PARSE_SCHEMA_MISMATCH;
+                memcpy(out, &i, sizeof(int));
+            }
+            return PARSE_OK;
+        case FIELD_BOOL: {
+            int b = *ph->json == 't';
+            if (*ph->json != 't' && *ph->json != 'f') return PARSE_SCHEMA_MISMATCH;
+            if ((ret = b ? parse_value_true(ph, &tmp) : parse_value_false(ph, &tmp)) != PARSE_OK) return ret;
+            memcpy(out, &b, sizeof(int));
+            return PARSE_OK;
+        }
+        case FIELD_STRING:
+        case FIELD_CHARS:
+            if (*ph->json != '"') return PARSE_SCHEMA_MISMATCH;
+            if ((ret = parse_string(ph, &str, &len)) != PARSE_OK) return ret;
+            if (f->type == FIELD_STRING) {
+                char* s;
+                memcpy(&s, out, sizeof(char*));
+                JSON_FREE(s);
+                s = (char*)JSON_MALLOC(len + 1);
+                memcpy(out, &s, sizeof(char*));
+                out = s;
+            } else if (len >= f->size) {
+                return PARSE_SCHEMA_MISMATCH;
+            }
+            if (len > 0) memcpy(out, str, len);
+            out[len] = '\0';
+            return PARSE_OK;
+        default:
+            return struct_parse_object(ph, out, f->schema);
+    }
+}
+
+parse_result struct_parse_object(parse_helper* ph, char* out, const json_schema* s) {
+    parse_result ret;
+    char* key;
+    size_t len;
+    if (*ph->json != '{') return *ph->json == '\0' ? PARSE_EXPECT_VALUR : PARSE_SCHEMA_MISMATCH;
+    ph->json++;
+    parse_whitespace(ph);
+    if (*ph->json == '}') {
+        ph->json++;
+        return PARSE_OK;
+    }
+    for (;;) {
+        const json_field* f;
+        if (*ph->json != '"') return PARSE_MISS_MEMBER_KEY;
+        /* the key stays valid on the popped stack until the next push */
+        if ((ret = parse_string(ph, &key, &len)) != PARSE_OK) return ret;
+        f = schema_find(s, key, len);
+        parse_whitespace(ph);
+        if (*ph->json != ':') return PARSE_MISS_MEMBER_COLON;
+        ph->json++;
+        parse_whitespace(ph);
+        if ((ret = f != NULL ? struct_parse_field(ph, out, f) : struct_skip_value(ph)) != PARSE_OK) return ret;
+        parse_whitespace(ph);
+        if (*ph->json == ',') {
+            ph->json++;
+            parse_whitespace(ph);
+        } else if (*ph->json == '}') {
+            ph->json++;
+            return PARSE_OK;
+        } else {
+            return PARSE_MISS_COMMA_OR_CURLY_BRACKET;
+        }
+    }
+}
+
+parse_result json_parse_struct(void* out, const json_schema* s, const char* json) {
+    parse_helper ph;
+    parse_result ret;
+    assert(out != NULL && s != NULL && s->slots != NULL && json != NULL);
+    helper_init(&ph, json);
+    parse_whitespace(&ph);
+    if ((ret = struct_parse_object(&ph, (char*)out, s)) == PARSE_OK) {
+        parse_whitespace(&ph);
+        if (*ph.json != '\0') ret = PARSE_ROOT_NOT_SINGULAR;
+    }
+    JSON_FREE(ph.stack);
+    return ret;
+}
+
+void struct_stringify_object(parse_helper* ph, const char* in, const json_schema* s) {
+    PUTC(ph, '{');
+    for (size_t i = 0; i < s->count; i++) {
+        const json_field* f = &s->fields[i];
+        const char* p = in + f->offset;
+        double d;
+        int n;
+        char* str;
+        if (i > 0) PUTC(ph, ',');
+        stringify_value_string(ph, f->name, f->name_length);
+        PUTC(ph, ':');
+        switch (f->type) {
+            case FIELD_NUMBER:
+                memcpy(&d, p, sizeof(double));
+                ph->top -= 32 - sprintf(helper_push(ph, 32), "%.17g", d);
+                break;
+            case FIELD_INT:
+                memcpy(&n, p, sizeof(int));
+                ph->top -= 32 - sprintf(helper_push(ph, 32), "%d", n);
+                break;
+            case FIELD_BOOL:
+                memcpy(&n, p, sizeof(int));
+                if (n) PUTS(ph, "true", 4);
+                else PUTS(ph, "false", 5);
+                break;
+            case FIELD_STRING:
+                memcpy(&str, p, sizeof(char*));
+                if (str == NULL) PUTS(ph, "null", 4);
+                else stringify_value_string(ph, str, strlen(str));
+                break;
+            case FIELD_CHARS: {
+                const char* end = (const char*)memchr(p, '\0', f->size);
+                stringify_value_string(ph, p, end != NULL ? (size_t)(end - p) : f->size);
+                break;
+            }
+            default:
+                struct_stringify_object(ph, p, f->schema);
+                break;
+        }
+    }
+    PUTC(ph, '}');
+}
+
+generate_result json_generate_struct(const void* in, const json_schema* s, char** json, size_t* len) {
+    parse_helper ph;
+    assert(in != NULL && s != NULL && json != NULL && len != NULL);
+    helper_init(&ph, NULL);
+    ph.stack = (char*)JSON_MALLOC(ph.size = HELPER_STACK_INITIAL_SIZE);
+    struct_stringify_object(&ph, (const char*)in, s);
+    *len = ph.top;
+    PUTC(&ph, '\0');
+    *json = ph.stack;
+    return STRINGIFY_OK;
+}
+
+/* number of leading bytes that are printable ascii other than '"' and '\\' */
+size_t string_plain_prefix(const unsigned char* str, size_t len) {
+    size_t i = 0;
+#ifdef QGCJSON_SSE2
+    const __m128i quote = _mm_set1_epi8('"');
+    const __m128i backslash = _mm_set1_epi8('\\');
+    const __m128i space = _mm_set1_epi8(0x20);
+    for (; i + 16 <= len; i += 16) {
+        __m128i x = _mm_loadu_si128((const __m128i*)(str + i));
+        __m128i hit = _mm_or_si128(_mm_cmpeq_epi8(x, quote), _mm_cmpeq_epi8(x, backslash));
+        /* signed compare: control bytes and every byte >= 0x80 are below ' ' */
+        hit = _mm_or_si128(hit, _mm_cmplt_epi8(x, space));
+        unsigned mask = (unsigned)_mm_movemask_epi8(hit);
+        if (mask != 0) {
+#if defined(_MSC_VER)
+            unsigned long bit;
+            _BitScanForward(&bit, mask);
+            return i + bit;
+#else
+            return i + (size_t)__builtin_ctz(mask);
+#endif
+        }
+    }
+#endif
+    for (; i < len; i++) {
+        unsigned char ch = str[i];
+        if (ch < 0x20 || ch >= 0x80 || ch == '"' || ch == '\\') break;
+    }
+    return i;
+}
+
+void validate_whitespace(binary_helper* vh) {
+    while (vh->p < vh->end && (*vh->p == ' ' || *vh->p == '\t' || *vh->p == '\n' || *vh->p == '\r')) vh->p++;
+}
+
+parse_result validate_literal(binary_helper* vh, const char* literal, size_t len) {
+    if ((size_t)(vh->end - vh->p) < len || memcmp(vh->p, literal, len) != 0) return PARSE_INVALID_VALUE;
+    vh->p += len;
+    return PARSE_OK;
+}
+
+/* same grammar as parse_number, overflow is decided on the digits so strtod is never needed */
+parse_result validate_number(binary_helper* vh) {
+    /* 2^1024 - 2^970 in full, the smallest value that rounds to infinity */
+    static const char max[] =
+        "179769313486231580793728971405303415079934132710037826936173778980444968292764750946649017977587"
+        "207096330286416692887910946555547851940402630657488671505820681908902000708383676273854845817711"
+        "531764475730270069855571366959622842914819860834936475292719074168444365510704342711559699508093"
+        "042880177904174497792";
+    const unsigned char* p = vh->p;
+    const unsigned char* digits;
+    const unsigned char* dot = NULL;
+    long exp10 = 0, e = 0;
+    int esign = 1;
+    if (VPEEK(vh) == '-') vh->p++;
+    digits = vh->p;
+    if (VPEEK(vh) == '0') vh->p++;
+    else {
+        if (!ISDIGIT1TO9(VPEEK(vh))) return PARSE_INVALID_VALUE;
+        for (vh->p++; ISDIGIT(VPEEK(vh)); vh->p++);
+    }
+    if (VPEEK(vh) == '.') {
+        dot = vh->p++;
+        if (!ISDIGIT(VPEEK(vh))) return PARSE_INVALID_VALUE;
+        for (vh->p++; ISDIGIT(VPEEK(vh)); vh->p++);
+    }
+    p = vh->p;
+    if (VPEEK(vh) == 'e' || VPEEK(vh) == 'E') {
+        vh->p++;
+        if (VPEEK(vh) == '+' || VPEEK(vh) == '-') esign = *vh->p++ == '-' ? -1 : 1;
+        if (!ISDIGIT(VPEEK(vh))) return PARSE_INVALID_VALUE;
+        for (; ISDIGIT(VPEEK(vh)); vh->p++) if (e < 100000) e = e * 10 + (*vh->p - '0');
+    }
+    /* decimal exponent of the leading significant digit */
+    if (dot == NULL) dot = p;
+    while (digits < p && (*digits == '0' || *digits == '.')) digits++;
+    if (digits == p) return PARSE_OK;  /* zero */
+    exp10 = (digits < dot ? (long)(dot - digits) - 1 : -(long)(digits - dot)) + esign * e;
+    if (exp10 < 308) return PARSE_OK;
+    if (exp10 > 308) return PARSE_NUMBER_TOO_BIG;
+    for (size_t i = 0; i < sizeof(max) - 1; i++, digits++) {
+        if (digits < p && *digits == '.') digits++;
+        if (digits >= p || *digits < max[i]) return PARSE_OK;
+        if (*digits > max[i]) return PARSE_NUMBER_TOO_BIG;
+    }
+    return PARSE_NUMBER_TOO_BIG;
+}
+
+parse_result validate_string(binary_helper* vh) {
+    const unsigned char* p = vh->p + 1;
+    const unsigned char* end = vh->end;
+    unsigned codepoint;
+    char hex[5] = { 0 };
+    for (;;) {
+        p += string_plain_prefix(p, (size_t)(end - p));
+        if (p == end) return PARSE_MISS_QUOTATION_MARK;
+        switch (*p) {
+            case '"':
+                vh->p = p + 1;
+                return PARSE_OK;
+            case '\\':
+                if (++p == end) return PARSE_INVALID_STRING_ESCAPE;
+                switch (*p++) {
+                    case '"': case '\\': case '/': case 'b': case 'f': case 'n': case 'r': case 't':
+                        break;
+                    case 'u':
+                        /* parse_hex4 relies on a terminator, so the digits go through a small copy */
+                        memcpy(hex, p, end - p < 4 ? (size_t)(end - p) : 4);
+                        if (end - p < 4 || parse_hex4(hex, &codepoint) == NULL) return PARSE_INVALID_UNICODE_HEX;
+                        p += 4;
+                        if (codepoint >= 0xD800 && codepoint <= 0xDBFF) {
+                            if (p == end || *p++ != '\\') return PARSE_INVALID_UNICODE_SURROGATE;
+                            if (p == end || *p++ != 'u') return PARSE_INVALID_UNICODE_SURROGATE;
+                            memset(hex, 0, sizeof(hex));
+                            memcpy(hex, p, end - p < 4 ? (size_t)(end - p) : 4);
+                            if (end - p < 4 || parse_hex4(hex, &codepoint) == NULL) return PARSE_INVALID_UNICODE_HEX;
+                            if (codepoint < 0xDC00 || codepoint > 0xDFFF) return PARSE_INVALID_UNICODE_SURROGATE;
+                            p += 4;
+                        }
+                        break;
+                    default:
+                        return PARSE_INVALID_STRING_ESCAPE;
+                }
+                break;
+            default:
+                if (*p < 0x20) return PARSE_INVALID_STRING_CHAR;
+                if ((codepoint = (unsigned)utf8_sequence(p, (size_t)(end - p))) == 0) return PARSE_INVALID_UTF8;
+                p += codepoint;
+                break;
+        }
+    }
+}
+
+parse_result validate_container(binary_helper* vh) {
+    parse_result ret;
+    unsigned char close = *vh->p++ == '[' ? ']' : '}';
+    validate_whitespace(vh);
+    if (VPEEK(vh) == close) {
+        vh->p++;
+        return PARSE_OK;
+    }
+    for (;;) {
+        if (close == '}') {
+            if (VPEEK(vh) != '"') return PARSE_MISS_MEMBER_KEY;
+            if ((ret = validate_string(vh)) != PARSE_OK) return ret;
+            validate_whitespace(vh);
+            if (VPEEK(vh) != ':') return PARSE_MISS_MEMBER_COLON;
+            vh->p++;
+            validate_whitespace(vh);
+        }
+        if ((ret = validate_value(vh)) != PARSE_OK) return ret;
+        validate_whitespace(vh);
+        if (VPEEK(vh) == ',') {
+            vh->p++;
+            validate_whitespace(vh);
+        } else if (VPEEK(vh) == close) {
+            vh->p++;
+            return PARSE_OK;
+        } else {
+            return close == ']' ? PARSE_MISS_COMMA_OR_SQUARE_BRACKET : PARSE_MISS_COMMA_OR_CURLY_BRACKET;
+        }
+    }
+}
+
+parse_result validate_value(binary_helper* vh) {
+    parse_result ret;
+    switch (VPEEK(vh)) {
+        case 't': return validate_literal(vh, "true", 4);
+        case 'f': return validate_literal(vh, "false", 5);
+        case 'n': return validate_literal(vh, "null", 4);
+        case '"': return validate_string(vh);
+        case '[': case '{':
+            if (vh->depth == 0) return PARSE_TOO_DEEP;
+            vh->depth--;
+            ret = validate_container(vh);
+            vh->depth++;
+            return ret;
+        case '\0': return PARSE_EXPECT_VALUR;
+        default: return validate_number(vh);
+    }
+}
+
+parse_result json_validate(const char* buf, size_t len) {
+    binary_helper vh;
+    parse_result ret;
+    assert(buf != NULL || len == 0);
+    vh.p = (const unsigned char*)buf;
+    vh.end = vh.p + len;
+    vh.depth = QGCJSON_MAX_DEPTH;
+    validate_whitespace(&vh);
+    if ((ret = validate_value(&vh)) == PARSE_OK) {
+        validate_whitespace(&vh);
+        if (vh.p != vh.end) ret = PARSE_ROOT_NOT_SINGULAR;
+    }
+    return ret;
+}
+
+/* ecmascript Number.prototype.toString: the shortest digits that round-trip, exponent outside [1e-6, 1e21) */
+void canonical_number(parse_helper* ph, double d) {
+    char buf[32], digits[20];
+    int k = 0, n, prec;
+    char* p;
+    if (d == 0) {
+        PUTC(ph, '0');
+        return;
+    }
+    if (d < 0) {
+        PUTC(ph, '-');
+        d = -d;
+    }
+    for (prec = 1; prec < 17; prec++) {
+        sprintf(buf, "%.*e", prec - 1, d);
+        if (strtod(buf, NULL) == d) break;
+    }
+    sprintf(buf, "%.*e", prec - 1, d);
+    for (p = buf; *p != 'e'; p++) if (ISDIGIT(*p)) digits[k++] = *p;
+    while (k > 1 && digits[k - 1] == '0') k--;
+    n = atoi(p + 1) + 1;  /* position of the decimal point relative to the digits */
+    if (k <= n && n <= 21) {
+        PUTS(ph, digits, (size_t)k);
+        for (; n > k; n--) PUTC(ph, '0');
+    } else if (0 < n && n <= 21) {
+        PUTS(ph, digits, (size_t)n);
+        PUTC(ph, '.');
+        PUTS(ph, digits + n, (size_t)(k - n));
+    } else if (-6 < n && n <= 0) {
+        PUTS(ph, "0.", 2);
+        for (; n < 0; n++) PUTC(ph, '0');
+        PUTS(ph, digits, (size_t)k);
+    } else {
+        PUTC(ph, digits[0]);
+        if (k > 1) {
+            PUTC(ph, '.');
+            PUTS(ph, digits + 1, (size_t)(k - 1));
+        }
+        ph->top -= 8 - sprintf(helper_push(ph, 8), "e%+d", n - 1);
+    }
+}
+
+generate_result canonical_value(canonical_helper* ch, const json_value* val) {
+    parse_helper* ph = &ch->ph;
+    generate_result ret = STRINGIFY_OK;
+    size_t i, bottom;
+    json_member* m;
+    if (ch->sink != NULL && ph->top >= CANONICAL_FLUSH_SIZE) {
+        ch->sink->write(ch->sink->ctx, ph->stack, ph->top);
+        ph->top = 0;
+    }
+    switch (val->type) {
+        case VALUE_NULL: PUTS(ph, "null", 4); break;
+        case VALUE_TRUE: PUTS(ph, "true", 4); break;
+        case VALUE_FALSE: PUTS(ph, "false", 5); break;
+        case VALUE_NUMBER: {
+            double d = get_value_number(val);
+            if (d != d || d - d != 0) return STRINGIFY_INVALID_VALUE;  /* nan, inf */
+            canonical_number(ph, d);
+            break;
+        }
+        case VALUE_RAW: {  /* normalized like everything else */
+            json_value tmp;
+            raw_expand(val, &tmp);
+            ret = canonical_value(ch, &tmp);
+            free_value(&tmp);
+            break;
+        }
+        case VALUE_STRING:
+            stringify_escaped(ph, val->str.s, val->str.length, "0123456789abcdef");
+            break;
+        case VALUE_ARRAY:
+            PUTC(ph, '[');
+            for (i = 0; i < val->arr.size && ret == STRINGIFY_OK; i++) {
+                if (i > 0) PUTC(ph, ',');
+                ret = canonical_value(ch, &val->arr.values[i]);
+            }
+            PUTC(ph, ']');
+            break;
+        case VALUE_OBJECT:
+            /* the member index is a search tree by key, walking it in order gives the sorted members */
+            PUTC(ph, '{');
+            bottom = ch->trail.top;
+            m = val->obj.size > 0 ? &val->obj.members[0] : NULL;
+            for (i = 0; ret == STRINGIFY_OK && (m != NULL || ch->trail.top > bottom); i++) {
+                for (; m != NULL; m = MEMBER_SON(val->obj.members, m, 0)) memcpy(helper_push(&ch->trail, sizeof(m)), &m, sizeof(m));
+                memcpy(&m, helper_pop(&ch->trail, sizeof(m)), sizeof(m));
+                if (i > 0) PUTC(ph, ',');
+                stringify_escaped(ph, m->key, m->key_length, "0123456789abcdef");
+                PUTC(ph, ':');
+                ret = canonical_value(ch, &m->value);
+                m = MEMBER_SON(val->obj.members, m, 1);
+            }
+            ch->trail.top = bottom;
+            PUTC(ph, '}');
+            break;
+        default:
+            return STRINGIFY_INVALID_VALUE;
+    }
+    return ret;
+}
+
+generate_result json_canonical_write(const json_value* val, const json_sink* sink) {
+    canonical_helper ch;
+    generate_result ret;
+    assert(val != NULL && sink != NULL && sink->write != NULL);
+    helper_init(&ch.ph, NULL);
+    helper_init(&ch.trail, NULL);
+    ch.sink = sink;
+    if ((ret = canonical_value(&ch, val)) == STRINGIFY_OK && ch.ph.top > 0) sink->write(sink->ctx, ch.ph.stack, ch.ph.top);
+    JSON_FREE(ch.ph.stack);
+    JSON_FREE(ch.trail.stack);
+    return ret;
+}
+
+generate_result json_canonical_generate(const json_value* val, char** json, size_t* len) {
+    canonical_helper ch;
+    generate_result ret;
+    assert(val != NULL && json != NULL && len != NULL);
+    helper_init(&ch.ph, NULL);
+    helper_init(&ch.trail, NULL);
+    ch.sink = NULL;
+    ret = canonical_value(&ch, val);
+    JSON_FREE(ch.trail.stack);
+    if (ret != STRINGIFY_OK) {
+        JSON_FREE(ch.ph.stack);
+        *json = NULL;
+        return ret;
+    }
+    *len = ch.ph.top;
+    PUTC(&ch.ph, '\0');
+    *json = ch.ph.stack;
+    return ret;
+}
+
+void fnv1a_write(void* ctx, const char* data, size_t len) {
+    uint64_t h = *(uint64_t*)ctx;
+    for (size_t i = 0; i < len; i++) h = (h ^ (unsigned char)data[i]) * 0x100000001B3ULL;
+    *(uint64_t*)ctx = h;
+}
+
+unsigned long long json_canonical_hash(const json_value* val) {
+    uint64_t h = 0xCBF29CE484222325ULL;
+    json_sink sink;
+    sink.write = fnv1a_write;
+    sink.ctx = &h;
+    if (json_canonical_write(val, &sink) != STRINGIFY_OK) return 0;
+    return h != 0 ? h : 1;  /* 0 is reserved for failure */
+}
+
+int file_cache_stat(const char* path, file_cache_key* key) {
+#if defined(_WIN32)
+    struct _stat64 st;
+    if (_stat64(path, &st) != 0) return 0;
+    key->mtime_nsec = 0;
+#else
+    struct stat st;
+    if (stat(path, &st) != 0) return 0;
+#if defined(__APPLE__)
+    key->mtime_nsec = (long)st.st_mtimespec.tv_nsec;
+#else
+    key->mtime_nsec = (long)st.st_mtim.tv_nsec;
+#endif
+#endif
+    key->dev = (unsigned long long)st.st_dev;
+    key->ino = (unsigned long long)st.st_ino;
+    key->size = (unsigned long long)st.st_size;
+    key->mtime_sec = (long long)st.st_mtime;
+    return 1;
+}
+
+/* field by field, the struct has padding where long is narrower than long long */
+int file_cache_key_equal(const file_cache_key* lhs, const file_cache_key* rhs) {
+    return lhs->dev == rhs->dev && lhs->ino == rhs->ino && lhs->size == rhs->size
+        && lhs->mtime_sec == rhs->mtime_sec && lhs->mtime_nsec == rhs->mtime_nsec;
+}
+
+/* bytes held by the payloads under val, the root itself lives with its owner */
+size_t value_footprint(const json_value* val) {
+    size_t bytes = 0, i;
+    switch (val->type) {
+        case VALUE_STRING:
+        case VALUE_RAW:
+            return val->str.length + 1;
+        case VALUE_ARRAY:
+            bytes = val->arr.capacity * sizeof(json_value);
+            for (i = 0; i < val->arr.size; i++) bytes += value_footprint(&val->arr.values[i]);
+            return bytes;
+        case VALUE_OBJECT:
+            bytes = val->obj.capacity * sizeof(json_member);
+            for (i = 0; i < val->obj.size; i++)
+                bytes += val->obj.members[i].key_length + 1 + value_footprint(&val->obj.members[i].value);
+            return bytes;
+        default:
+            return 0;
+    }
+}
+
+json_file_cache* file_cache_create(size_t budget, int verify) {
+    json_file_cache* c = (json_file_cache*)JSON_MALLOC(sizeof(json_file_cache));
+    CACHE_LOCK_INIT(&c->lock);
+    c->mask = FILE_CACHE_INITIAL_BUCKETS - 1;
+    c->buckets = (file_cache_entry**)JSON_MALLOC(FILE_CACHE_INITIAL_BUCKETS * sizeof(file_cache_entry*));
+    memset(c->buckets, 0, FILE_CACHE_INITIAL_BUCKETS * sizeof(file_cache_entry*));
+    c->head = c->tail = NULL;
+    c->budget = budget;
+    c->verify = verify;
+    c->allocator = json_get_allocator();
+    memset(&c->stats, 0, sizeof(c->stats));
+    return c;
+}
+
+void file_cache_free(json_file_cache* c) {
+    const json_allocator* prev = thread_allocator;
+    if (c == NULL) return;
+    json_set_thread_allocator(c->allocator);
+    while (c->head != NULL) {
+        file_cache_entry* e = c->head;
+        c->head = e->next;
+        file_cache_release(e);
+    }
+    JSON_FREE(c->buckets);
+    CACHE_LOCK_DESTROY(&c->lock);
+    JSON_FREE(c);
+    json_set_thread_allocator(prev);
+}
+
+void file_cache_get_stats(json_file_cache* c, json_file_cache_stats* stats) {
+    assert(c != NULL && stats != NULL);
+    CACHE_LOCK(&c->lock);
+    *stats = c->stats;
+    CACHE_UNLOCK(&c->lock);
+}
+
+file_cache_entry* file_cache_find(json_file_cache* c, const char* path, size_t len, uint64_t hash) {
+    file_cache_entry* e = c->buckets[hash & c->mask];
+    for (; e != NULL; e = e->chain)
+        if (e->path_hash == hash && e->path_length == len && memcmp(e->path, path, len) == 0) return e;
+    return NULL;
+}
+
+void file_cache_touch(json_file_cache* c, file_cache_entry* e) {
+    if (c->head == e) return;
+    e->prev->next = e->next;
+    if (e->next != NULL) e->next->prev = e->prev;
+    else c->tail = e->prev;
+    e->prev = NULL;
+    e->next = c->head;
+    c->head->prev = e;
+    c->head = e;
+}
+
+void file_cache_unlink(json_file_cache* c, file_cache_entry* e) {
+    file_cache_entry** p = &c->buckets[e->path_hash & c->mask];
+    while (*p != e) p = &(*p)->chain;
+    *p = e->chain;
+    if (e->prev != NULL) e->prev->next = e->next;
+    else c->head = e->next;
+    if (e->next != NULL) e->next->prev = e->prev;
+    else c->tail = e->prev;
+    c->stats.entries--;
+    c->stats.bytes -= e->bytes;
+}
+
+void file_cache_release(file_cache_entry* e) {
+    JSON_FREE(e->path);
+    free_value(&e->doc);
+    JSON_FREE(e);
+}
+
+/* e replaces any entry for the same path, then the least recently used go until the budget holds */
+void file_cache_insert(json_file_cache* c, file_cache_entry* e) {
+    file_cache_entry* old = file_cache_find(c, e->path, e->path_length, e->path_hash);
+    if (old != NULL) {
+        file_cache_unlink(c, old);
+        file_cache_release(old);
+    }
+    if (c->stats.entries + 1 > (c->mask + 1) * 2) {
+        size_t size = (c->mask + 1) * 2;
+        file_cache_entry** buckets = (file_cache_entry**)JSON_MALLOC(size * sizeof(file_cache_entry*));
+        memset(buckets, 0, size * sizeof(file_cache_entry*));
+        for (file_cache_entry* p = c->head; p != NULL; p = p->next) {
+            p->chain = buckets[p->path_hash & (size - 1)];
+            buckets[p->path_hash & (size - 1)] = p;
+        }
+        JSON_FREE(c->buckets);
+        c->buckets = buckets;
+        c->mask = size - 1;
+    }
+    e->chain = c->buckets[e->path_hash & c->mask];
+    c->buckets[e->path_hash & c->mask] = e;
+    e->prev = NULL;
+    e->next = c->head;
+    if (c->head != NULL) c->head->prev = e;
+    else c->tail = e;
+    c->head = e;
+    c->stats.entries++;
+    c->stats.bytes += e->bytes;
+    while (c->stats.bytes > c->budget) {
+        file_cache_entry* victim = c->tail;
+        file_cache_unlink(c, victim);
+        file_cache_release(victim);
+        c->stats.evictions++;
+    }
+}
+
+parse_result file_cache_parse(json_file_cache* c, json_value* val, const char* path) {
+    const json_allocator* prev = thread_allocator;
+    parse_result ret;
+    assert(c != NULL && val != NULL && path != NULL);
+    json_set_thread_allocator(c->allocator);
+    ret = file_cache_load(c, val, path);
+    json_set_thread_allocator(prev);
+    return ret;
+}
+
+parse_result file_cache_load(json_file_cache* c, json_value* val, const char* path) {
+    file_cache_key key;
+    file_cache_entry* e;
+    size_t plen, len;
+    uint64_t phash, content = 0;
+    parse_result ret;
+    char* json;
+    value_init(val);
+    if (!file_cache_stat(path, &key)) return CAN_NOT_OPEN_FILE;
+    plen = strlen(path);
+    phash = hash_bytes(path, plen, 0);
+
+    CACHE_LOCK(&c->lock);
+    e = file_cache_find(c, path, plen, phash);
+    if (e != NULL && !c->verify && file_cache_key_equal(&e->key, &key)) {
+        file_cache_touch(c, e);
+        c->stats.hits++;
+        value_copy(val, &e->doc);
+        CACHE_UNLOCK(&c->lock);
+        return PARSE_OK;
+    }
+    CACHE_UNLOCK(&c->lock);
+
+    if ((json = read_file(path, &len)) == NULL) return CAN_NOT_OPEN_FILE;
+    if (c->verify) {
+        /* unchanged content is a hit even when the file was touched or rewritten */
+        content = hash_bytes(json, len, 0);
+        CACHE_LOCK(&c->lock);
+        e = file_cache_find(c, path, plen, phash);
+        if (e != NULL && e->content_hash == content) {
+            e->key = key;
+            file_cache_touch(c, e);
+            c->stats.hits++;
+            value_copy(val, &e->doc);
+            CACHE_UNLOCK(&c->lock);
+            JSON_FREE(json);
+            return PARSE_OK;
+        }
+        CACHE_UNLOCK(&c->lock);
+    }
+
+    /* parsing happens outside the lock, a concurrent miss on the same path just replaces ours */
+    ret = json_parse(val, json);
+    JSON_FREE(json);
+    if (ret == PARSE_OK) {
+        make_shared(val);
+        e = (file_cache_entry*)JSON_MALLOC(sizeof(file_cache_entry));
+        e->path = (char*)JSON_MALLOC(plen + 1);
+        memcpy(e->path, path, plen + 1);
+        e->path_length = plen;
+        e->path_hash = phash;
+        e->content_hash = content;
+        e->key = key;
+        e->bytes = sizeof(file_cache_entry) + plen + 1 + value_footprint(val);
+        value_init(&e->doc);
+        value_copy(&e->doc, val);
+    }
+    CACHE_LOCK(&c->lock);
+    c->stats.misses++;
+    if (ret == PARSE_OK && e->bytes <= c->budget) {
+        file_cache_insert(c, e);
+        e = NULL;
+    }
+    CACHE_UNLOCK(&c->lock);
+    if (ret == PARSE_OK && e != NULL) file_cache_release(e);  /* larger than the whole budget */
+    return ret;
+}
+
+/* unbuffered, the whole file is read at once, and the kernel is asked to start reading it now */
+FILE* load_open(const char* path) {
+    FILE* file = fopen(path, "rb");
+    if (file == NULL) return NULL;
+    setvbuf(file, NULL, _IONBF, 0);
+#if defined(POSIX_FADV_WILLNEED)
+    posix_fadvise(fileno(file), 0, 0, POSIX_FADV_WILLNEED);
+#endif
+    return file;
+}
+
+parse_result load_parse(parse_helper* ph, json_value* val, FILE* file, char** buf, size_t* cap) {
+    size_t len = 0, got;
+    value_init(val);
+    if (file == NULL) return CAN_NOT_OPEN_FILE;
+    for (;;) {
+        if (len + 1 >= *cap) {
+            *cap = *cap == 0 ? 4096 : *cap * 2;
+            *buf = (char*)JSON_REALLOC(*buf, *cap);
+        }
+        if ((got = fread(*buf + len, 1, *cap - len - 1, file)) == 0) break;
+        len += got;
+    }
+    if (ferror(file)) {
+        fclose(file);
+        return CAN_NOT_OPEN_FILE;
+    }
+    fclose(file);
+    (*buf)[len] = '\0';
+    ph->json = *buf;
+    return parse_document(ph, val);
+}
+
+/* each worker keeps one file open ahead so its read-ahead overlaps the current parse */
+void load_files(load_job* job) {
+    const json_allocator* prev = thread_allocator;
+    parse_helper ph;
+    char* buf = NULL;
+    size_t cap = 0, i, j;
+    FILE* file;
+    FILE* next;
+    json_set_thread_allocator(job->allocator);
+    helper_init(&ph, NULL);
+    i = FETCH_ADD(&job->next, 1);
+    file = i < job->n ? load_open(job->paths[i]) : NULL;
+    while (i < job->n) {
+        j = FETCH_ADD(&job->next, 1);
+        next = j < job->n ? load_open(job->paths[j]) : NULL;
+        job->results[i] = load_parse(&ph, &job->vals[i], file, &buf, &cap);
+        i = j;
+        file = next;
+    }
+    JSON_FREE(buf);
+    JSON_FREE(ph.stack);
+    json_set_thread_allocator(prev);
+}
+
+#if defined(_WIN32)
+DWORD WINAPI load_thread(LPVOID job) {
+    load_files((load_job*)job);
+    return 0;
+}
+#else
+void* load_thread(void* job) {
+    load_files((load_job*)job);
+    return NULL;
+}
+#endif
+
+size_t jsonfile_parse_many(const char* const* paths, size_t n, json_value* vals, parse_result* results, unsigned threads) {
+    load_job job;
+    size_t ok = 0, i;
+    unsigned t, started = 0;
+    assert((paths != NULL && vals != NULL && results != NULL) || n == 0);
+    job.paths = paths;
+    job.vals = vals;
+    job.results = results;
+    job.n = n;
+    job.next = 0;
+    job.allocator = json_get_allocator();
+    if (threads == 0) {
+#if defined(_WIN32)
+        SYSTEM_INFO info;
+        GetSystemInfo(&info);
+        threads = (unsigned)info.dwNumberOfProcessors;
+#elif defined(_SC_NPROCESSORS_ONLN)
+        long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+        threads = cpus > 0 ? (unsigned)cpus : 1;
+#else
+        threads = 1;
+#endif
+    }
+    if (threads > n) threads = n > 0 ? (unsigned)n : 1;
+    {
+        /* the calling thread is one of the workers */
+#if defined(_WIN32)
+        HANDLE* handles = (HANDLE*)JSON_MALLOC(threads * sizeof(HANDLE));
+        for (t = 1; t < threads; t++)
+            if ((handles[started] = CreateThread(NULL, 0, load_thread, &job, 0, NULL)) != NULL) started++;
+        load_files(&job);
+        for (t = 0; t < started; t++) {
+            WaitForSingleObject(handles[t], INFINITE);
+            CloseHandle(handles[t]);
+        }
+#else
+        pthread_t* handles = (pthread_t*)JSON_MALLOC(threads * sizeof(pthread_t));
+        for (t = 1; t < threads; t++)
+            if (pthread_create(&handles[started], NULL, load_thread, &job) == 0) started++;
+        load_files(&job);
+        for (t = 0; t < started; t++) pthread_join(handles[t], NULL);
+#endif
+        JSON_FREE(handles);
+    }
+    for (i = 0; i < n; i++) ok += results[i] == PARSE_OK;
+    return ok;
+}
+
+/* bytes val's payloads take in a compacted block, in the order compact_place lays them out */
+size_t compact_size(const json_value* val) {
+    size_t bytes = 0, i;
+    switch (val->type) {
+        case VALUE_NUMBER:
+            if (!(val->flags & VALUE_RAW_NUMBER)) return 0;
+            return sizeof(compact_header) + COMPACT_ALIGN(RAW_NUMBER_SIZE(val->str.length));
+        case VALUE_STRING:
+        case VALUE_RAW:
+            return sizeof(compact_header) + COMPACT_ALIGN(val->str.length + 1);
+        case VALUE_ARRAY:
+            if (val->arr.size == 0) return 0;
+            bytes = sizeof(compact_header) + val->arr.size * sizeof(json_value);
+            for (i = 0; i < val->arr.size; i++) bytes += compact_size(&val->arr.values[i]);
+            return bytes;
+        case VALUE_OBJECT:
+            if (val->obj.size == 0) return 0;
+            bytes = sizeof(compact_header) + val->obj.size * sizeof(json_member);
+            for (i = 0; i < val->obj.size; i++) bytes += val->obj.members[i].key_length + 1;
+            bytes = COMPACT_ALIGN(bytes);
+            for (i = 0; i < val->obj.size; i++) bytes += compact_size(&val->obj.members[i].value);
+            return bytes;
+        default:
+            return 0;
+    }
+}
+
+/* 
+ * depth first: a container's payload, its keys, then each child's subtree. val is unshared
+ * first, so what other values share is left alone and only val's own copy moves.
+ */
+void compact_place(json_value* val, compact_block* block, char** cursor) {
+    compact_header* h;
+    void* old;
+    size_t bytes, i;
+    switch (val->type) {
+        case VALUE_NUMBER:
+            if (!(val->flags & VALUE_RAW_NUMBER)) return;
+            bytes = RAW_NUMBER_SIZE(val->str.length);
+            break;
+        case VALUE_STRING:
+        case VALUE_RAW:
+            bytes = val->str.length + 1;
+            break;
+        case VALUE_ARRAY:
+            if (val->arr.size == 0) return;
+            bytes = val->arr.size * sizeof(json_value);
+            break;
+        case VALUE_OBJECT:
+            if (val->obj.size == 0) return;
+            bytes = val->obj.size * sizeof(json_member);
+            break;
+        default:
+            return;
+    }
+    value_unshare(val);
+    h = (compact_header*)*cursor;
+    h->block = block;
+    h->rc.refs = 1;
+    h->rc.hash = 0;
+    *cursor += sizeof(compact_header) + COMPACT_ALIGN(bytes);
+    block->live++;
+    switch (val->type) {
+        case VALUE_ARRAY:
+            old = val->arr.values;
+            val->arr.values = (json_value*)memcpy(h + 1, old, bytes);
+            val->arr.capacity = val->arr.size;
+            JSON_FREE(old);
+            for (i = 0; i < val->arr.size; i++) compact_place(&val->arr.values[i], block, cursor);
+            break;
+        case VALUE_OBJECT:
+            old = val->obj.members;
+            val->obj.members = (json_member*)memcpy(h + 1, old, bytes);
+            val->obj.capacity = val->obj.size;
+            JSON_FREE(old);
+            for (i = 0; i < val->obj.size; i++) {
+                json_member* m = &val->obj.members[i];
+                memcpy(*cursor, m->key, m->key_length + 1);
+                JSON_FREE(m->key);
+                m->key = *cursor;
+                *cursor += m->key_length + 1;
+            }
+            *cursor = (char*)block + COMPACT_ALIGN((size_t)(*cursor - (char*)block));
+            for (i = 0; i < val->obj.size; i++) compact_place(&val->obj.members[i].value, block, cursor);
+            break;
+        default:
+            old = val->str.s;
+            val->str.s = (char*)memcpy(h + 1, old, bytes);
+            JSON_FREE(old);
+            break;
+    }
+    val->flags |= VALUE_SHARED | VALUE_COMPACT;
+}
+
+void json_value_compact(json_value* val) {
+    compact_block* block;
+    char* cursor;
+    size_t bytes;
+    assert(val != NULL);
+    if ((val->flags & VALUE_FROZEN) || (bytes = compact_size(val)) == 0) return;
+    block = (compact_block*)JSON_MALLOC(COMPACT_ALIGN(sizeof(compact_block)) + bytes);
+    block->live = 0;
+    cursor = (char*)block + COMPACT_ALIGN(sizeof(compact_block));
+    compact_place(val, block, &cursor);
+    assert(cursor == (char*)block + COMPACT_ALIGN(sizeof(compact_block)) + bytes);
+}
+
+/* reads one more block behind the unread bytes, which are moved to the front first */
+int cursor_fill(json_cursor* cur) {
+    size_t got;
+    if (cur->eof) return 0;
+    if (cur->pos > 0) {
+        memmove(cur->buf, cur->buf + cur->pos, cur->len - cur->pos);
+        cur->len -= cur->pos;
+        cur->pos = 0;
+    }
+    if (cur->len + CURSOR_BLOCK_SIZE + 1 > cur->cap) {
+        cur->cap = cur->cap * 2 > cur->len + CURSOR_BLOCK_SIZE + 1 ? cur->cap * 2 : cur->len + CURSOR_BLOCK_SIZE + 1;
+        cur->buf = (char*)JSON_REALLOC(cur->buf, cur->cap);
+    }
+    got = fread(cur->buf + cur->len, 1, CURSOR_BLOCK_SIZE, cur->file);
+    cur->len += got;
+    if (got == 0) cur->eof = 1;
+    return got > 0;
+}
+
+/* the next byte that isn't whitespace, left unread; -1 at the end of the file */
+int cursor_peek(json_cursor* cur) {
+    for (;;) {
+        for (; cur->pos < cur->len; cur->pos++) {
+            char ch = cur->buf[cur->pos];
+            if (ch != ' ' && ch != '\t' && ch != '\n' && ch != '\r') return (unsigned char)ch;
+        }
+        if (!cursor_fill(cur)) return -1;
+    }
+}
+
+/* 
+ * length of the value at the cursor, reading blocks until all of it is buffered. only brackets
+ * and strings are tracked, the parser or validator that gets the slice does the checking.
+ */
+size_t cursor_extent(json_cursor* cur) {
+    size_t i = 0, depth = 0;
+    int in_string = 0;
+    for (;;) {
+        const char* p;
+        if (cur->pos + i >= cur->len) {
+            if (!cursor_fill(cur)) return i;
+            continue;
+        }
+        p = cur->buf + cur->pos + i;
+        if (in_string) {
+            i += string_plain_prefix((const unsigned char*)p, cur->len - cur->pos - i);
+            if (cur->pos + i >= cur->len) continue;
+            p = cur->buf + cur->pos + i;
+            if (*p == '\\') {
+                if (cur->pos + i + 1 >= cur->len && !cursor_fill(cur)) return cur->len - cur->pos;
+                i += 2;
+                continue;
+            }
+            if (*p == '"') {
+                in_string = 0;
+                if (depth == 0) return i + 1;
+            }
+        }
+        else switch (*p) {
+            case '"': in_string = 1; break;
+            case '[': case '{': depth++; break;
+            case ']': case '}':
+                if (depth == 0) return i > 0 ? i : 1;  /* a stray bracket is handed on to be rejected */
+                if (--depth == 0) return i + 1;
+                break;
+            case ',': case ' ': case '\t': case '\n': case '\r':
+                if (depth == 0) return i > 0 ? i : 1;
+                break;
+            default: break;
+        }
+        i++;
+    }
+}
+
+parse_result cursor_parse(json_cursor* cur, json_value* val) {
+    size_t n = cursor_extent(cur);
+    char* end = cur->buf + cur->pos + n;
+    char saved = *end;
+    parse_result ret;
+    *end = '\0';
+    cur->ph.json = cur->buf + cur->pos;
+    cur->ph.shape = &cur->slot;
+    ret = parse_document(&cur->ph, val);
+    cur->ph.shape = NULL;
+    if (ret == PARSE_OK && cur->ph.json != end) {
+        free_value(val);
+        ret = PARSE_ROOT_NOT_SINGULAR;  /* a NUL byte in the input */
+    }
+    *end = saved;
+    cur->pos += n;
+    return ret;
+}
+
+/* steps over a value, checked by the validator so nothing is built */
+parse_result cursor_skip(json_cursor* cur) {
+    binary_helper vh;
+    parse_result ret;
+    size_t n = cursor_extent(cur);
+    vh.p = (const unsigned char*)cur->buf + cur->pos;
+    vh.end = vh.p + n;
+    vh.depth = QGCJSON_MAX_DEPTH;
+    if ((ret = validate_value(&vh)) == PARSE_OK && vh.p != vh.end) ret = PARSE_ROOT_NOT_SINGULAR;
+    cur->pos += n;
+    return ret;
+}
+
+/* reads a member key and compares it with the current path token */
+parse_result cursor_key(json_cursor* cur, int* found) {
+    size_t n = cursor_extent(cur), len;
+    char* end = cur->buf + cur->pos + n;
+    char saved = *end;
+    char* key;
+    parse_result ret;
+    *end = '\0';
+    cur->ph.json = cur->buf + cur->pos;
+    cur->ph.top = 0;
+    if ((ret = parse_string(&cur->ph, &key, &len)) == PARSE_OK) {
+        if (cur->ph.json != end) ret = PARSE_MISS_MEMBER_COLON;
+        *found = len == cur->token.top && (len == 0 || memcmp(key, cur->token.stack, len) == 0);
+    }
+    *end = saved;
+    cur->pos += n;
+    return ret;
+}
+
+/* walks down to the value at cur->path, skipping everything before it */
+parse_result cursor_seek(json_cursor* cur) {
+    const char* p = cur->path;
+    const char* end = p + strlen(p);
+    parse_result ret;
+    size_t idx, i;
+    int ch, found;
+    while (p != end) {
+        if (*p != '/' || !pointer_token(&cur->token, &p, end)) return PARSE_PATH_NOT_FOUND;
+        if ((ch = cursor_peek(cur)) == '{') {
+            cur->pos++;
+            for (;;) {
+                if ((ch = cursor_peek(cur)) == '}') return PARSE_PATH_NOT_FOUND;
+                if (ch != '"') return PARSE_MISS_MEMBER_KEY;
+                if ((ret = cursor_key(cur, &found)) != PARSE_OK) return ret;
+                if (cursor_peek(cur) != ':') return PARSE_MISS_MEMBER_COLON;
+                cur->pos++;
+                if (found) break;
+                if (cursor_peek(cur) < 0) return PARSE_EXPECT_VALUR;
+                if ((ret = cursor_skip(cur)) != PARSE_OK) return ret;
+                if ((ch = cursor_peek(cur)) == '}') return PARSE_PATH_NOT_FOUND;
+                if (ch != ',') return PARSE_MISS_COMMA_OR_CURLY_BRACKET;
+                cur->pos++;
+            }
+        }
+        else if (ch == '[') {
+            cur->pos++;
+            if (!pointer_index(&cur->token, SIZE_MAX, 0, &idx)) return PARSE_PATH_NOT_FOUND;
+            for (i = 0; i <= idx; i++) {
+                if ((ch = cursor_peek(cur)) == ']') return PARSE_PATH_NOT_FOUND;
+                if (i == idx) break;
+                if (ch < 0) return PARSE_EXPECT_VALUR;
+                if ((ret = cursor_skip(cur)) != PARSE_OK) return ret;
+                if ((ch = cursor_peek(cur)) == ']') return PARSE_PATH_NOT_FOUND;
+                if (ch != ',') return PARSE_MISS_COMMA_OR_SQUARE_BRACKET;
+                cur->pos++;
+            }
+        }
+        else return ch < 0 ? PARSE_EXPECT_VALUR : PARSE_PATH_NOT_FOUND;
+    }
+    return PARSE_OK;
+}
+
+/* at the root only whitespace may follow, below a path the rest of the file is never read */
+parse_result cursor_end(json_cursor* cur) {
+    cur->state = CURSOR_DONE;
+    if (*cur->path == '\0' && cursor_peek(cur) >= 0) return PARSE_ROOT_NOT_SINGULAR;
+    return cur->eof && ferror(cur->file) ? CAN_NOT_OPEN_FILE : PARSE_OK;
+}
+
+json_cursor* json_cursor_open(FILE* file) {
+    return json_cursor_open_path(file, "");
+}
+
+json_cursor* json_cursor_open_path(FILE* file, const char* pointer) {
+    json_cursor* cur;
+    size_t len;
+    assert(file != NULL && pointer != NULL);
+    cur = (json_cursor*)JSON_MALLOC(sizeof(json_cursor));
+    cur->file = file;
+    cur->buf = NULL;
+    cur->pos = cur->len = cur->cap = 0;
+    cur->eof = 0;
+    cur->state = CURSOR_START;
+    cur->error = PARSE_OK;
+    len = strlen(pointer);
+    memcpy(cur->path = (char*)JSON_MALLOC(len + 1), pointer, len + 1);
+    helper_init(&cur->ph, NULL);
+    helper_init(&cur->token, NULL);
+    cur->slot.shape = NULL;
+    cur->slot.objects = 0;
+    cur->slot.relearned = 0;
+#if defined(POSIX_FADV_SEQUENTIAL)
+    posix_fadvise(fileno(file), 0, 0, POSIX_FADV_SEQUENTIAL);
+#endif
+    return cur;
+}
+
+int json_cursor_next(json_cursor* cur, json_value* val) {
+    int ch;
+    assert(cur != NULL && val != NULL);
+    free_value(val);
+    switch (cur->state) {
+        case CURSOR_START:
+            if ((cur->error = cursor_seek(cur)) != PARSE_OK) break;
+            if (cursor_peek(cur) != '[') {
+                /* not an array, the value itself is the one element */
+                if ((cur->error = cursor_parse(cur, val)) != PARSE_OK) break;
+                cur->state = CURSOR_LAST;
+                return 1;
+            }
+            cur->pos++;
+            cur->state = CURSOR_FIRST;
+            /* fall through */
+        case CURSOR_FIRST:
+        case CURSOR_NEXT:
+            if ((ch = cursor_peek(cur)) == ']') {
+                cur->pos++;
+                cur->error = cursor_end(cur);
+                break;
+            }
+            if (cur->state == CURSOR_NEXT) {
+                if (ch != ',') {
+                    cur->error = PARSE_MISS_COMMA_OR_SQUARE_BRACKET;
+                    break;
+                }
+                cur->pos++;
+                cursor_peek(cur);
+            }
+            if ((cur->error = cursor_parse(cur, val)) != PARSE_OK) break;
+            cur->state = CURSOR_NEXT;
+            return 1;
+        case CURSOR_LAST:
+            cur->error = cursor_end(cur);
+            break;
+        default:
+            break;
+    }
+    cur->state = CURSOR_DONE;
+    return 0;
+}
+
+parse_result json_cursor_error(const json_cursor* cur) {
+    assert(cur != NULL);
+    return cur->error;
+}
+
+void json_cursor_close(json_cursor* cur) {
+    if (cur == NULL) return;
+    JSON_FREE(cur->buf);
+    JSON_FREE(cur->path);
+    JSON_FREE(cur->ph.stack);
+    JSON_FREE(cur->token.stack);
+    if (cur->slot.shape != NULL) shape_release(cur->slot.shape);
+    JSON_FREE(cur);
+}
+
+void json_freeze(json_value* val) {
+    assert(val != NULL);
+    if (val->flags & VALUE_FROZEN) return;
+    json_value_compact(val);
+    json_value_hash(val, 1);
+    freeze_value(val);
+    val->flags |= VALUE_FROZEN_ROOT;
+}
+
+/* member indexes are kept up to date by every mutator, the lazy number caches are what's left */
+void freeze_value(json_value* val) {
+    size_t i;
+    switch (val->type) {
+        case VALUE_NUMBER:
+            if (val->flags & VALUE_RAW_NUMBER) raw_number_value(val);
+            break;
+        case VALUE_ARRAY:
+            for (i = 0; i < val->arr.size; i++) freeze_value(&val->arr.values[i]);
+            break;
+        case VALUE_OBJECT:
+            for (i = 0; i < val->obj.size; i++) freeze_value(&val->obj.members[i].value);
+            break;
+        default:
+            break;
+    }
+    val->flags |= VALUE_FROZEN;
+}
+
+int value_is_frozen(const json_value* val) {
+    assert(val != NULL);
+    return (val->flags & VALUE_FROZEN) != 0;
+}
+
+json_value* rcu_adopt(json_value* doc) {
+    json_value* v = (json_value*)JSON_MALLOC(sizeof(json_value));
+    memcpy(v, doc, sizeof(json_value));
+    value_init(doc);
+    json_freeze(v);
+    return v;
+}
+
+void json_rcu_init(json_rcu* rcu, json_value* doc) {
+    assert(rcu != NULL && doc != NULL);
+    rcu->doc = rcu_adopt(doc);
+    rcu->epoch = 0;
+    rcu->readers[0] = rcu->readers[1] = 0;
+    rcu->writer = 0;
+}
+
+/* 
+ * a reader counts itself in the current epoch's slot, a swap moves to the next epoch and waits
+ * for the old slot to drain. a reader that lost the race with the epoch change counts again.
+ */
+const json_value* json_rcu_read_lock(json_rcu* rcu, long* ticket) {
+    long e;
+    assert(rcu != NULL && ticket != NULL);
+    for (;;) {
+        e = RCU_LOAD(&rcu->epoch);
+        RCU_ADD(&rcu->readers[e & 1], 1);
+        if (RCU_LOAD(&rcu->epoch) == e) break;
+        RCU_ADD(&rcu->readers[e & 1], -1);
+    }
+    *ticket = e & 1;
+    return (const json_value*)RCU_LOAD_PTR(&rcu->doc);
+}
+
+void json_rcu_read_unlock(json_rcu* rcu, long ticket) {
+    assert(rcu != NULL && (ticket == 0 || ticket == 1));
+    RCU_ADD(&rcu->readers[ticket], -1);
+}
+
+void json_rcu_swap(json_rcu* rcu, json_value* doc) {
+    json_value* next;
+    json_value* old;
+    long e;
+    assert(rcu != NULL && doc != NULL);
+    next = rcu_adopt(doc);
+    while (RCU_SWAP(&rcu->writer, 1) != 0) RCU_YIELD();
+    old = (json_value*)RCU_SWAP_PTR(&rcu->doc, next);
+    e = RCU_LOAD(&rcu->epoch);
+    RCU_SWAP(&rcu->epoch, e + 1);
+    /* everyone who could have seen old counted themselves in e's slot before the change */
+    while (RCU_LOAD(&rcu->readers[e & 1]) != 0) RCU_YIELD();
+    RCU_SWAP(&rcu->writer, 0);
+    free_value(old);
+    JSON_FREE(old);
+}
+
+void json_rcu_destroy(json_rcu* rcu) {
+    assert(rcu != NULL && rcu->readers[0] == 0 && rcu->readers[1] == 0);
+    free_value(rcu->doc);
+    JSON_FREE(rcu->doc);
+    rcu->doc = NULL;
+}
@@ -2,9 +2,30 @@
 #define __QGCJSON_H__
 
 #include <stddef.h>
+#include <stdint.h>
 #include <stdio.h>
 
-typedef enum { VALUE_STRING, VALUE_NUMBER, VALUE_OBJECT, VALUE_ARRAY, VALUE_TRUE, VALUE_FALSE, VALUE_NULL } value_type;
+/* 
+ * every allocation the library makes goes through these hooks, ctx is passed back untouched.
+ * memory must be released with the allocator that made it, so switch before building documents.
+ * json_set_allocator sets the process-wide one and copies a; it is meant to be called once,
+ * before other threads use the library (the switch itself is atomic). json_set_thread_allocator
+ * overrides it for everything the calling thread allocates and frees until it is reset with
+ * NULL, e.g. a pool per request or memory local to the thread's NUMA node. a is used in place
+ * and must stay valid while set, and values made under it have to be freed under it as well.
+ */
+typedef struct json_allocator {
+    void* (*malloc_fn)(void* ctx, size_t size);
+    void* (*realloc_fn)(void* ctx, void* ptr, size_t size);
+    void (*free_fn)(void* ctx, void* ptr);
+    void* ctx;
+} json_allocator;
+void json_set_allocator(const json_allocator* allocator);  /* NULL restores malloc/realloc/free */
+void json_set_thread_allocator(const json_allocator* allocator);  /* NULL restores the process one */
+const json_allocator* json_get_allocator(void);  /* the calling thread's */
+void json_free(void* ptr);  /* for buffers returned by json_generate and friends */
+
+typedef enum { VALUE_STRING, VALUE_NUMBER, VALUE_OBJECT, VALUE_ARRAY, VALUE_TRUE, VALUE_FALSE, VALUE_NULL, VALUE_RAW } value_type;
 
 typedef struct json_value json_value;
 typedef struct json_member json_member;
@@ -17,6 +38,7 @@ struct json_value {
         double num;
     };
     value_type type;
+    unsigned flags;
 };
 void free_value(json_value* val);
 value_type get_value_type(const json_value* val);
@@ -41,6 +63,11 @@ void shrink_value_array(json_value* val);
 void clear_value_array(json_value* val);
 void array_push_back(json_value* val, const json_value* e);
 void array_push_front(json_value* val, const json_value* e);
+/* *_move take over e's storage and leave it null, emplace returns a fresh null slot */
+void array_push_back_move(json_value* val, json_value* e);
+void array_push_front_move(json_value* val, json_value* e);
+json_value* array_emplace_back(json_value* val);
+json_value* array_emplace_front(json_value* val);
 json_value* array_pop_back(json_value* val);
 json_value* array_pop_front(json_value* val);
 void array_insert_element(json_value* val, size_t idx);
@@ -56,27 +83,126 @@ void reverse_value_object(json_value* val, size_t capacity);
 void shrink_value_object(json_value* val);
 int object_find_member(const json_value* val, const char* key, size_t len);
 void insert_member(json_value* v, json_member* m);
+void object_insert_move(json_value* v, json_member* m);  /* takes over m's key and value */
+json_value* object_emplace(json_value* v, const char* key, size_t len);
 void remove_member(json_value* v, const char* key, size_t len);
 
+/* 
+ * bulk builder: values are appended to a scratch stack like the parser does, and a container
+ * gets its single exact-size allocation and key index when it is closed with builder_end.
+ * in an object every value is preceded by builder_key. slots returned by builder_value are
+ * only valid until the next builder call.
+ */
+typedef struct json_builder json_builder;
+json_builder* builder_create(void);
+void builder_free(json_builder* b);
+void builder_reserve(json_builder* b, size_t values);
+void builder_key(json_builder* b, const char* key, size_t len);
+json_value* builder_value(json_builder* b);
+json_value* builder_member(json_builder* b, const char* key, size_t len);
+void builder_begin_array(json_builder* b);
+void builder_begin_object(json_builder* b);
+void builder_end(json_builder* b);
+void builder_finish(json_builder* b, json_value* val);
+
 void value_copy(json_value* dst, const json_value* src);
 void value_move(json_value* dst, json_value* src);
-int value_is_equal(const json_value* lhs, const json_value* rhs);
+int value_is_equal(const json_value* lhs, const json_value* rhs);  /* object member order is ignored */
+/* 
+ * structural hash, equal values hash equally regardless of object member order. with cache set
+ * the tree is moved into shared storage (see value_share) and every container memoizes its
+ * hash there, value_is_equal then rejects on mismatching memoized hashes without recursing.
+ * a level drops its memo when it is unshared for mutation.
+ */
+unsigned long long json_value_hash(json_value* val, int cache);
+
+#define VALUE_SHARED 1  /* storage sits behind a refcount and may be referenced by other values */
+#define VALUE_RAW_NUMBER 2  /* number kept as its source text, see json_parse_options */
+#define VALUE_COMPACT 4  /* storage lives in a block made by json_value_compact */
+#define VALUE_FROZEN 8  /* part of a tree passed to json_freeze, see there */
+#define VALUE_SHAPED 16  /* object keys are those of a parsed sibling, owned by a shared shape */
+#define VALUE_FROZEN_ROOT 32  /* the value json_freeze was called on, the only frozen one free_value takes */
+
+/* 
+ * copy-on-write sharing: value_share makes src's whole tree refcounted (once) and lets dst
+ * reference it in O(1); value_copy of a shared value is O(1) as well. the array_* and object
+ * mutators unshare the level they change, reach nested values to modify through
+ * array_element_mut/object_member_mut so that only the path down to them is copied.
+ */
+void value_share(json_value* dst, json_value* src);
+void value_unshare(json_value* val);
+int value_is_shared(const json_value* val);
+json_value* array_element_mut(json_value* val, size_t idx);
+json_value* object_member_mut(json_value* val, const char* key, size_t len);
+/* 
+ * moves val's whole tree into one depth-first block with exact capacities, freeing the old
+ * fragments. compacted storage is shared storage: reading is unchanged, a mutation copies the
+ * level it touches back out, and the block is freed once nothing references it any more.
+ */
+void json_value_compact(json_value* val);
+/* 
+ * compacts val, memoizes every hash and decodes every lazy number, so that nothing reading the
+ * tree writes to it any more and any number of threads may read it without locking. the tree
+ * can't be mutated afterwards, only freed whole through val: setters and mutators abort on any
+ * part of it and free_value on any but val, in release builds too. value_copy of a frozen value is an
+ * ordinary copy-on-write value, which is how a changed version is made.
+ */
+void json_freeze(json_value* val);
+int value_is_frozen(const json_value* val);
+/* 
+ * publishes a frozen document to concurrent readers. a reader brackets its use of the document
+ * with read_lock/read_unlock (value_copy keeps parts of it past unlock); json_rcu_swap freezes
+ * and installs a new document, waits for the readers of the old one to finish and frees it.
+ * init and swap take over doc and leave it null; swaps may race each other.
+ */
+typedef struct json_rcu {
+    json_value* doc;
+    long epoch;
+    long readers[2];  /* by epoch parity */
+    long writer;
+} json_rcu;
+void json_rcu_init(json_rcu* rcu, json_value* doc);
+const json_value* json_rcu_read_lock(json_rcu* rcu, long* ticket);
+void json_rcu_read_unlock(json_rcu* rcu, long ticket);
+void json_rcu_swap(json_rcu* rcu, json_value* doc);
+void json_rcu_destroy(json_rcu* rcu);
 
-#define value_init(v) do { (v)->type = VALUE_NULL; } while(0)
+#define value_init(v) do { (v)->type = VALUE_NULL; (v)->flags = 0; } while(0)
 #define ARRAAY_VALUE(val, idx) (val)->arr.values[idx]
 #define OBJECT_MEMBER(val, idx) (val)->obj.members[idx]
 
+/* 
+ * members are 64 bytes: the key index is a search tree, kept within 2 log2 n deep, whose links are
+ * 1-based positions in the member array (0 for none), and key_prefix caches the first 8 key bytes
+ * so that comparisons rarely have to follow key. both are maintained by down_member and
+ * rebuild_member_tree.
+ */
 struct json_member {
     char* key;
     size_t key_length;
     json_value value;
-    json_member* sons[2];
+    uint32_t sons[2];
+    uint64_t key_prefix;
 };
 const char* get_member_key(const json_member* m, size_t* len);
 json_value* get_member_value(json_member* m);
-void down_member(json_member* f, json_member* m);
-json_member* search_member(json_member* f, const char* key, size_t len);
+void down_member(json_member* members, json_member* m);
+json_member* search_member(json_member* members, const char* key, size_t len);
 void rebuild_member_tree(json_value* val);
+/* 
+ * a key looked up over and over: its index prefix is worked out once, and the slot of the last
+ * hit is tried first, so objects sharing a layout resolve with one compare. the key bytes are
+ * referenced, not copied. a handle updates itself on lookup, give each thread its own.
+ */
+typedef struct json_key {
+    const char* key;
+    size_t length;
+    uint64_t prefix;
+    size_t slot;
+} json_key;
+void json_key_init(json_key* k, const char* key, size_t len);
+int object_find_key(const json_value* val, json_key* k);
+json_value* object_member_key(const json_value* val, json_key* k);  /* NULL if missing */
 
 void member_copy(json_member* dst, const json_member* src, json_value* dstr);
 void member_move(json_member* dst, json_member* src, json_value* dstr);
@@ -84,6 +210,7 @@ int member_is_equal(const json_member* lhs, const json_member* rhs);
 
 #define LS(member) (member)->sons[0]
 #define RS(member) (member)->sons[1]
+#define MEMBER_SON(members, m, i) ((m)->sons[i] != 0 ? (members) + (m)->sons[i] - 1 : NULL)
 
 typedef enum {
     PARSE_OK = 0,
@@ -106,7 +233,19 @@ typedef enum {
     PARSE_MISS_MEMBER_COLON,
     PARSE_MISS_COMMA_OR_CURLY_BRACKET,
 
-    CAN_NOT_OPEN_FILE
+    CAN_NOT_OPEN_FILE,
+
+    /* appended, the codes above keep their original values */
+    PARSE_INVALID_UTF8,
+    PARSE_INVALID_BINARY,
+    PARSE_SCHEMA_MISMATCH,
+    PARSE_PATH_NOT_FOUND,
+
+    PARSE_TOO_DEEP,
+    PARSE_TOO_LARGE,
+    PARSE_STRING_TOO_LONG,
+    PARSE_TOO_MANY_ELEMENTS,
+    PARSE_TOO_MANY_NODES
 } parse_result;
 
 typedef enum {
@@ -117,9 +256,223 @@ typedef enum {
     CAN_NOT_OPEN_FILE_W
 } generate_result;
 
+/* 
+ * per-call parse statistics, only collected when the library is built with QGCJSON_STATS;
+ * otherwise json_parse_ex leaves them zeroed. cycles are rdtsc ticks (clock ticks off x86)
+ * and only measured when json_parse_options.timing is set.
+ */
+typedef struct json_parse_stats {
+    size_t bytes;
+    size_t nodes[VALUE_RAW + 1];  /* indexed by value_type */
+    size_t string_bytes, escapes;
+    size_t max_depth, stack_high_water;
+    size_t allocations, reallocs;
+    unsigned long long cycles_total, cycles_strings, cycles_numbers;  /* the rest is containers */
+} json_parse_stats;
+
+/* 
+ * bounds for untrusted input, each checked as the parser goes so that a hostile document fails
+ * before it costs memory or time. 0 leaves a bound off. max_elements applies to each array or
+ * object, max_string_length to keys as well, counted in unescaped bytes.
+ */
+typedef struct json_parse_limits {
+    size_t max_depth;
+    size_t max_bytes;
+    size_t max_string_length;
+    size_t max_elements;
+    size_t max_nodes;
+} json_parse_limits;
+
+typedef struct json_parse_options {
+    json_parse_stats* stats;
+    int timing;
+    /* 
+     * keeps each number as its source text (VALUE_RAW_NUMBER): get_value_number decodes it on
+     * first use and caches the result, the generator writes the text back verbatim.
+     */
+    int lazy_numbers;
+    /* 
+     * asked before each member value (key) and array element (key NULL) at depth, 1 being
+     * the root's children; a nonzero answer keeps that value's text as VALUE_RAW.
+     */
+    int (*raw)(void* ctx, const char* key, size_t key_length, size_t depth);
+    void* raw_ctx;
+    const json_parse_limits* limits;
+} json_parse_options;
+
 parse_result json_parse(json_value* val, const char* json);
+parse_result json_parse_ex(json_value* val, const char* json, const json_parse_options* opt);
 parse_result jsonfile_parse(json_value *val, const char* path);
+/* 
+ * loads n files on a pool of threads (0 for one per cpu, the caller is one of them), each with
+ * its own read buffer and parser scratch. vals[i] and results[i] receive file i, failures leave
+ * a null value. returns how many parsed. every thread allocates with the caller's allocator
+ * (see json_get_allocator), so its hooks have to be thread-safe.
+ */
+size_t jsonfile_parse_many(const char* const* paths, size_t n, json_value* vals, parse_result* results, unsigned threads);
 generate_result json_generate(const json_value* val, char** json, size_t* len, int isFile);
 generate_result jsonfile_generate(const json_value* val, const char* path);
+/* 
+ * pull parser over a file that is read in fixed blocks and never held whole: each
+ * json_cursor_next parses the next element of the top-level array (or of the array at a json
+ * pointer, whatever comes before it is skipped and whatever follows is never read) into val,
+ * freeing what val held. a value that isn't an array is returned as the only element. memory is
+ * bounded by the largest element, buffers are kept between elements. it returns 0 at the end
+ * or on error, json_cursor_error tells which. closing leaves the FILE open.
+ */
+typedef struct json_cursor json_cursor;
+json_cursor* json_cursor_open(FILE* file);
+json_cursor* json_cursor_open_path(FILE* file, const char* pointer);
+int json_cursor_next(json_cursor* cur, json_value* val);
+parse_result json_cursor_error(const json_cursor* cur);
+void json_cursor_close(json_cursor* cur);
+
+/* 
+ * cache for parsed files, keyed by path and checked against device, inode, size and mtime on
+ * every call, so an unchanged file costs a stat(). with verify set the file is read and its
+ * content hash compared instead, an identical rewrite is then still a hit. documents come back
+ * in shared storage (see value_share): mutating them copies, the cached original stays intact.
+ * least recently used documents are evicted once their footprint exceeds budget bytes.
+ * all calls on one cache are thread-safe and allocate with the allocator that was current when
+ * it was created, whichever thread makes them.
+ */
+typedef struct json_file_cache json_file_cache;
+typedef struct json_file_cache_stats {
+    size_t hits, misses, evictions;
+    size_t entries, bytes;
+} json_file_cache_stats;
+json_file_cache* file_cache_create(size_t budget, int verify);
+void file_cache_free(json_file_cache* c);
+parse_result file_cache_parse(json_file_cache* c, json_value* val, const char* path);
+void file_cache_get_stats(json_file_cache* c, json_file_cache_stats* stats);
+
+/* 
+ * canonical output in the style of rfc 8785 (jcs): no whitespace, members ordered by walking the
+ * key index, only '"', '\\' and control characters escaped, numbers in their shortest round-trip
+ * form. keys are ordered by utf-8 bytes, i.e. by code point, which differs from jcs's utf-16
+ * order only between supplementary-plane characters and U+E000..U+FFFF. json_canonical_write
+ * streams the text to sink in chunks, json_canonical_hash is the 64-bit FNV-1a of it, or 0 when
+ * val has no canonical form (a nan or infinite number).
+ */
+typedef struct json_sink {
+    void (*write)(void* ctx, const char* data, size_t len);
+    void* ctx;
+} json_sink;
+generate_result json_canonical_generate(const json_value* val, char** json, size_t* len);
+generate_result json_canonical_write(const json_value* val, const json_sink* sink);
+unsigned long long json_canonical_hash(const json_value* val);
+/* 
+ * checks buf the way json_parse would, without allocating. len is authoritative, NUL is just a
+ * byte. nesting deeper than QGCJSON_MAX_DEPTH (a build option, 1024 by default) is PARSE_TOO_DEEP.
+ */
+parse_result json_validate(const char* buf, size_t len);
+
+/* 
+ * VALUE_RAW holds validated json text that the generator writes out verbatim, for splicing in
+ * serialized fragments. it compares and hashes by text, binary and canonical output expand it.
+ */
+parse_result set_value_raw(json_value* val, const char* json, size_t len);  /* val is unchanged on error */
+const char* get_value_raw(const json_value* val);
+size_t get_value_raw_length(const json_value* val);
+
+/* 
+ * schema-bound parsing: a struct described by JSON_FIELD entries is parsed into and generated
+ * from directly, without json_values. schema_init builds a perfect hash over the field names,
+ * nested schemas have to be initialized as well. members that are missing or null leave their
+ * field untouched and unknown members are skipped. FIELD_STRING is a char* allocated with the
+ * library allocator (an old one is released, so start from a zeroed struct), FIELD_CHARS a
+ * fixed char array that gets NUL-terminated. FIELD_INT and FIELD_BOOL are ints.
+ */
+typedef enum { FIELD_NUMBER, FIELD_INT, FIELD_BOOL, FIELD_STRING, FIELD_CHARS, FIELD_OBJECT } field_type;
+
+typedef struct json_schema json_schema;
+typedef struct json_field {
+    const char* name;
+    size_t name_length;
+    field_type type;
+    size_t offset, size;
+    const json_schema* schema;  /* FIELD_OBJECT */
+} json_field;
+struct json_schema {
+    const json_field* fields;
+    size_t count;
+    unsigned char* slots;  /* field index + 1 by key hash, 0 when empty */
+    size_t mask;
+    unsigned long long seed;
+};
+
+#define JSON_FIELD(type, member, kind) { #member, sizeof(#member) - 1, kind, offsetof(type, member), sizeof(((type*)0)->member), NULL }
+#define JSON_FIELD_OBJECT(type, member, s) { #member, sizeof(#member) - 1, FIELD_OBJECT, offsetof(type, member), sizeof(((type*)0)->member), s }
+
+int schema_init(json_schema* s, const json_field* fields, size_t count);  /* 0 on duplicate or mistyped fields */
+void schema_free(json_schema* s);
+parse_result json_parse_struct(void* out, const json_schema* s, const char* json);
+generate_result json_generate_struct(const void* in, const json_schema* s, char** json, size_t* len);
+
+/* binary encodings: numbers are written as raw IEEE doubles, strings and containers are length-prefixed */
+parse_result cbor_parse(json_value* val, const char* buf, size_t len);
+parse_result cborfile_parse(json_value* val, const char* path);
+generate_result cbor_generate(const json_value* val, char** buf, size_t* len);
+generate_result cborfile_generate(const json_value* val, const char* path);
+
+parse_result msgpack_parse(json_value* val, const char* buf, size_t len);
+parse_result msgpackfile_parse(json_value* val, const char* path);
+generate_result msgpack_generate(const json_value* val, char** buf, size_t* len);
+generate_result msgpackfile_generate(const json_value* val, const char* path);
+
+/* 
+ * position-independent snapshot of a document: one blob with offsets instead of pointers,
+ * read in place (e.g. straight from mmap) through the get_snapshot_* accessors. snapshot_open
+ * checks only the header and the accessors trust every offset; run snapshot_verify once after
+ * opening a blob that may be corrupt, it walks the whole of it in O(size) and gives
+ * PARSE_INVALID_BINARY unless it is laid out exactly as snapshot_generate writes it. a document
+ * nested deeper than QGCJSON_MAX_DEPTH can't be checked and gives PARSE_TOO_DEEP instead.
+ */
+typedef struct json_snapshot {
+    const char* data;
+    size_t size;
+    int mapped, owned;
+} json_snapshot;
+typedef struct snapshot_value {
+    const char* base;
+    const void* node;
+} snapshot_value;
+
+generate_result snapshot_generate(const json_value* val, char** buf, size_t* len);
+generate_result snapshotfile_generate(const json_value* val, const char* path);
+parse_result snapshot_open(json_snapshot* snap, const char* buf, size_t len);
+parse_result snapshotfile_open(json_snapshot* snap, const char* path);
+parse_result snapshot_verify(const json_snapshot* snap);
+void snapshot_close(json_snapshot* snap);
+snapshot_value get_snapshot_root(const json_snapshot* snap);
+
+value_type get_snapshot_type(const snapshot_value* v);
+double get_snapshot_number(const snapshot_value* v);
+const char* get_snapshot_string(const snapshot_value* v);
+size_t get_snapshot_string_length(const snapshot_value* v);
+size_t get_snapshot_array_size(const snapshot_value* v);
+snapshot_value get_snapshot_array_element(const snapshot_value* v, size_t idx);
+size_t get_snapshot_object_size(const snapshot_value* v);
+const char* get_snapshot_member_key(const snapshot_value* v, size_t idx, size_t* len);
+snapshot_value get_snapshot_member_value(const snapshot_value* v, size_t idx);
+int snapshot_find_member(const snapshot_value* v, const char* key, size_t len, snapshot_value* out);
+
+/* 
+ * json patch (rfc 6902). json_diff moves a and b into shared storage with memoized hashes (see
+ * json_value_hash), subtrees with the same storage are skipped in O(1) and differing hashes mark
+ * a change without comparing. values in the patch share b's storage. json_patch_apply moves the
+ * values out of the patch into doc, leaving nulls behind. it stops at the first failing operation
+ * with the earlier ones applied; for all-or-nothing, apply to a value_share'd copy and keep it
+ * only on PATCH_OK.
+ */
+typedef enum {
+    PATCH_OK = 0,
+    PATCH_INVALID_OPERATION,
+    PATCH_PATH_NOT_FOUND,
+    PATCH_TEST_FAILED
+} patch_result;
+
+void json_diff(json_value* patch, json_value* a, json_value* b);
+patch_result json_patch_apply(json_value* doc, json_value* patch);
 
 #endif //__QGCJSON_H__
\ No newline at end of file
@@ -1,5 +1,9 @@
+#if (defined(__unix__) || defined(__APPLE__)) && !defined(_POSIX_C_SOURCE)
+#define _POSIX_C_SOURCE 200809L  /* pthreads under -std=c99 */
+#endif
 #include "qgcjson.h"
 
+#include <math.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -7,6 +11,10 @@
 #define _CRTDBG_MAP_ALLOC
 #include <crtdbg.h>
 #endif
+#if defined(__unix__) || defined(__APPLE__)
+#include <pthread.h>
+#define TEST_THREADS
+#endif
 
 int main_ret = 0;
 int total_count = 0;
@@ -51,10 +59,17 @@ void test_parse_boolean() {
 #define TEST_NUMBER(expect, json)\
     do {\
         json_value v;\
+        json_parse_options lazy;\
+        memset(&lazy, 0, sizeof(lazy));\
+        lazy.lazy_numbers = 1;\
         (v).type = VALUE_NULL;\
         EXPECT_EQ_INT(PARSE_OK, json_parse(&v, json));\
         EXPECT_EQ_INT(VALUE_NUMBER, (v).type);\
         EXPECT_EQ_DOUBLE(expect, (v).num);\
+        EXPECT_EQ_INT(PARSE_OK, json_validate(json, strlen(json)));\
+        EXPECT_EQ_INT(PARSE_OK, json_parse_ex(&v, json, &lazy));\
+        EXPECT_EQ_DOUBLE(expect, get_value_number(&v));\
+        free_value(&v);\
     } while(0)
 
 void test_parse_number() {
@@ -96,6 +111,7 @@ void test_parse_number() {
         EXPECT_EQ_INT(PARSE_OK, json_parse(&v, json));\
         EXPECT_EQ_INT(VALUE_STRING, get_value_type(&v));\
         EXPECT_EQ_STRING(expect, get_value_string(&v), get_value_string_length(&v));\
+        EXPECT_EQ_INT(PARSE_OK, json_validate(json, strlen(json)));\
         free_value(&v);\
     } while(0)
 
@@ -175,6 +191,7 @@ void test_parse_object() {
     ));
     EXPECT_EQ_INT(VALUE_OBJECT, get_value_type(&v));
     EXPECT_EQ_SIZE_T(7, get_value_object_size(&v));
+    free_value(&v);
 }
 
 #define TEST_ERROR(error, json)\
@@ -183,6 +200,7 @@ void test_parse_object() {
         value_init(&v);\
         EXPECT_EQ_INT(error, json_parse(&v, (json)));\
         EXPECT_EQ_INT(VALUE_NULL, get_value_type(&v));\
+        EXPECT_EQ_INT(error, json_validate(json, strlen(json)));\
         free_value(&v);\
     } while(0)
 
@@ -265,6 +283,35 @@ void test_parse_miss_quotation_mark() {
     TEST_ERROR(PARSE_MISS_QUOTATION_MARK, "\"abc");
 }
 
+void test_parse_stats() {
+    const char* json = " {\"a\" : [1, \"x\\n\", {\"b\" : null}]} ";
+    json_parse_stats stats;
+    json_parse_options opt;
+    json_value v;
+    memset(&opt, 0, sizeof(opt));
+    opt.stats = &stats;
+    opt.timing = 1;
+    value_init(&v);
+    EXPECT_EQ_INT(PARSE_OK, json_parse_ex(&v, json, &opt));
+#ifdef QGCJSON_STATS
+    EXPECT_EQ_SIZE_T(strlen(json), stats.bytes);
+    EXPECT_EQ_SIZE_T(2, stats.nodes[VALUE_OBJECT]);
+    EXPECT_EQ_SIZE_T(1, stats.nodes[VALUE_ARRAY]);
+    EXPECT_EQ_SIZE_T(1, stats.nodes[VALUE_NUMBER]);
+    EXPECT_EQ_SIZE_T(1, stats.nodes[VALUE_STRING]);
+    EXPECT_EQ_SIZE_T(1, stats.nodes[VALUE_NULL]);
+    EXPECT_EQ_SIZE_T(4, stats.string_bytes);
+    EXPECT_EQ_SIZE_T(1, stats.escapes);
+    EXPECT_EQ_SIZE_T(3, stats.max_depth);
+    EXPECT_EQ_INT(1, stats.stack_high_water > 0);
+    EXPECT_EQ_SIZE_T(7, stats.allocations);  /* stack, 2 keys, 1 string, 3 containers */
+    EXPECT_EQ_INT(1, stats.cycles_total >= stats.cycles_strings + stats.cycles_numbers);
+#else
+    EXPECT_EQ_SIZE_T(0, stats.bytes);
+#endif
+    free_value(&v);
+}
+
 void test_parse() {
     test_parse_null();
     test_parse_boolean();
@@ -281,6 +328,7 @@ void test_parse() {
     test_parse_invalid_unicode_surrogate();
     test_parse_invalid_unicode_hex();
     test_parse_miss_quotation_mark();
+    test_parse_stats();
 }
 
 #define TEST_ROUNDTRIP(json)\
@@ -292,6 +340,7 @@ void test_parse() {
         EXPECT_EQ_INT(PARSE_OK, json_parse(&v, json));\
         EXPECT_EQ_INT(STRINGIFY_OK, json_generate(&v, &json2, &length, 0));\
         EXPECT_EQ_STRING(json, json2, length);\
+        EXPECT_EQ_INT(PARSE_OK, json_validate(json, strlen(json)));\
         free_value(&v);\
         free(json2);\
     } while(0)
@@ -325,6 +374,9 @@ void test_stringify_string() {
     TEST_ROUNDTRIP("\"Hello\\nWorld\"");
     TEST_ROUNDTRIP("\"\\\" \\\\ / \\b \\f \\n \\r \\t\"");
     TEST_ROUNDTRIP("\"Hello\\u0000World\"");
+    TEST_ROUNDTRIP("\"0123456789abcdef0123456789abcdef\"");
+    TEST_ROUNDTRIP("\"0123456789abcde\\\"0123456789abcdef\\n\"");
+    TEST_ROUNDTRIP("\"0123456789abcdef0123456789abcd\\u001F\\t0123456789abcdef01\\\\\"");
     #ifndef _WINDOWS
     TEST_ROUNDTRIP("\"亓\"");
     #endif
@@ -348,11 +400,1850 @@ void test_file() {
     #if 0
     for (size_t i = 0; i < get_value_object_size(&v); i++) {
         json_member* m = get_value_object_member(&v, i);
-        printf("LS: %s, RS: %s\n", (LS(m) == NULL ? "null" : LS(m)->key), (RS(m) == NULL ? "null" : RS(m)->key));
+        printf("LS: %s, RS: %s\n", (LS(m) == 0 ? "null" : get_value_object_member(&v, LS(m) - 1)->key), (RS(m) == 0 ? "null" : get_value_object_member(&v, RS(m) - 1)->key));
     }
     #endif
 
     EXPECT_EQ_INT(STRINGIFY_OK, jsonfile_generate(&v, "../w_test.json"));
+    free_value(&v);
+}
+
+#define TEST_BINARY_ROUNDTRIP(json, generate, parse)\
+    do {\
+        json_value v, v2;\
+        char* buf;\
+        char* json2;\
+        size_t length;\
+        value_init(&v);\
+        value_init(&v2);\
+        EXPECT_EQ_INT(PARSE_OK, json_parse(&v, json));\
+        EXPECT_EQ_INT(STRINGIFY_OK, generate(&v, &buf, &length));\
+        EXPECT_EQ_INT(PARSE_OK, parse(&v2, buf, length));\
+        EXPECT_EQ_INT(STRINGIFY_OK, json_generate(&v2, &json2, &length, 0));\
+        EXPECT_EQ_STRING(json, json2, length);\
+        free_value(&v);\
+        free_value(&v2);\
+        free(buf);\
+        free(json2);\
+    } while(0)
+
+#define TEST_BINARY_ERROR(error, parse, buf)\
+    do {\
+        json_value v;\
+        value_init(&v);\
+        EXPECT_EQ_INT(error, parse(&v, buf, sizeof(buf) - 1));\
+        EXPECT_EQ_INT(VALUE_NULL, get_value_type(&v));\
+    } while(0)
+
+#define TEST_BINARY_ROUNDTRIPS(json)\
+    do {\
+        TEST_BINARY_ROUNDTRIP(json, cbor_generate, cbor_parse);\
+        TEST_BINARY_ROUNDTRIP(json, msgpack_generate, msgpack_parse);\
+    } while(0)
+
+void test_binary() {
+    json_value v;
+    char* buf;
+    size_t length;
+
+    TEST_BINARY_ROUNDTRIPS("null");
+    TEST_BINARY_ROUNDTRIPS("[true,false,-1.5,1.234e+20,\"\",\"Hello\\u0000World\"]");
+    TEST_BINARY_ROUNDTRIPS("{\"n\":null,\"a\":[1,2,3],\"o\":{\"1\":1,\"2\":{}}}");
+    TEST_BINARY_ROUNDTRIPS("[\"0123456789abcdef0123456789abcdef0123456789abcdef\",[[],[[]]]]");
+    TEST_BINARY_ROUNDTRIPS("{\"\xC3\xA9\":\"\xE2\x82\xAC\xF0\x9D\x84\x9E\"}");
+
+    /* integers from other encoders decode to numbers */
+    value_init(&v);
+    EXPECT_EQ_INT(PARSE_OK, cbor_parse(&v, "\x83\x01\x38\x63\x19\x01\x00", 7));
+    EXPECT_EQ_SIZE_T(3, get_value_array_size(&v));
+    EXPECT_EQ_SIZE_T(3, get_value_array_capacity(&v));
+    EXPECT_EQ_DOUBLE(-100.0, get_value_number(get_value_array_element(&v, 1)));
+    EXPECT_EQ_DOUBLE(256.0, get_value_number(get_value_array_element(&v, 2)));
+    free_value(&v);
+    EXPECT_EQ_INT(PARSE_OK, msgpack_parse(&v, "\x93\x01\xff\xd1\xfe\x00", 6));
+    EXPECT_EQ_DOUBLE(-1.0, get_value_number(get_value_array_element(&v, 1)));
+    EXPECT_EQ_DOUBLE(-512.0, get_value_number(get_value_array_element(&v, 2)));
+    free_value(&v);
+    EXPECT_EQ_INT(PARSE_OK, cbor_parse(&v, "\xa1\x61k\xf9\x3c\x00", 6));
+    EXPECT_EQ_INT(1, object_find_member(&v, "k", 1));
+    EXPECT_EQ_DOUBLE(1.0, get_value_number(&v.obj.members[0].value));
+    free_value(&v);
+
+    /* containers are length-prefixed */
+    EXPECT_EQ_INT(PARSE_OK, json_parse(&v, "[1]"));
+    EXPECT_EQ_INT(STRINGIFY_OK, msgpack_generate(&v, &buf, &length));
+    EXPECT_EQ_SIZE_T(10, length);
+    EXPECT_EQ_INT(0x91, (unsigned char)buf[0]);
+    EXPECT_EQ_INT(0xCB, (unsigned char)buf[1]);
+    free(buf);
+    free_value(&v);
+
+    TEST_BINARY_ERROR(PARSE_EXPECT_VALUR, cbor_parse, "");
+    TEST_BINARY_ERROR(PARSE_INVALID_BINARY, cbor_parse, "\x9f\x01\xff");  /* indefinite length */
+    TEST_BINARY_ERROR(PARSE_INVALID_BINARY, cbor_parse, "\x82\x01");
+    TEST_BINARY_ERROR(PARSE_INVALID_BINARY, cbor_parse, "\x63" "ab");
+    TEST_BINARY_ERROR(PARSE_INVALID_BINARY, cbor_parse, "\x9b\xff\xff\xff\xff\xff\xff\xff\xff");
+    TEST_BINARY_ERROR(PARSE_MISS_MEMBER_KEY, cbor_parse, "\xa1\x01\x01");
+    TEST_BINARY_ERROR(PARSE_ROOT_NOT_SINGULAR, cbor_parse, "\xf6\xf6");
+    TEST_BINARY_ERROR(PARSE_INVALID_BINARY, msgpack_parse, "\xc4\x01\x00");  /* bin */
+    TEST_BINARY_ERROR(PARSE_INVALID_BINARY, msgpack_parse, "\xdd\x7f\xff\xff\xff\x01");
+    TEST_BINARY_ERROR(PARSE_INVALID_BINARY, msgpack_parse, "\x92\xa1");
+    TEST_BINARY_ERROR(PARSE_INVALID_UTF8, cbor_parse, "\x62\xc0\xaf");  /* overlong '/' */
+    TEST_BINARY_ERROR(PARSE_INVALID_UTF8, cbor_parse, "\xa1\x61\xff\xf6");  /* in a key */
+    TEST_BINARY_ERROR(PARSE_INVALID_UTF8, cbor_parse, "\x63\xed\xa0\x80");  /* surrogate */
+    TEST_BINARY_ERROR(PARSE_INVALID_UTF8, msgpack_parse, "\xa1\xff");
+    TEST_BINARY_ERROR(PARSE_INVALID_UTF8, msgpack_parse, "\x91\xa2\xe2\x82");  /* truncated sequence */
+
+    /* nesting is bounded, tags are skipped without recursing */
+    length = 1 << 20;
+    buf = (char*)malloc(length);
+    memset(buf, 0x81, length);
+    EXPECT_EQ_INT(PARSE_INVALID_BINARY, cbor_parse(&v, buf, length));
+    buf[1024] = (char)0xF6;
+    EXPECT_EQ_INT(PARSE_OK, cbor_parse(&v, buf, 1025));
+    free_value(&v);
+    buf[1024] = (char)0x81;
+    buf[1025] = (char)0xF6;
+    EXPECT_EQ_INT(PARSE_INVALID_BINARY, cbor_parse(&v, buf, 1026));
+    memset(buf, 0x91, length);
+    EXPECT_EQ_INT(PARSE_INVALID_BINARY, msgpack_parse(&v, buf, length));
+    memset(buf, 0xC6, length);
+    buf[length - 1] = (char)0xF5;
+    EXPECT_EQ_INT(PARSE_OK, cbor_parse(&v, buf, length));
+    EXPECT_EQ_INT(VALUE_TRUE, get_value_type(&v));
+    free_value(&v);
+    free(buf);
+}
+
+/* overwrites sizeof(x) bytes at off in a copy of the blob, which must then fail to verify */
+#define TEST_SNAPSHOT_CORRUPT(buf, size, off, type, x)\
+    do {\
+        json_snapshot snap;\
+        char* copy = (char*)malloc(size);\
+        type tmp = (x);\
+        memcpy(copy, buf, size);\
+        memcpy(copy + (off), &tmp, sizeof(type));\
+        EXPECT_EQ_INT(PARSE_OK, snapshot_open(&snap, copy, size));\
+        EXPECT_EQ_INT(PARSE_INVALID_BINARY, snapshot_verify(&snap));\
+        free(copy);\
+    } while(0)
+
+#define TEST_SNAPSHOT_VERIFY(json)\
+    do {\
+        json_value v;\
+        json_snapshot snap;\
+        char* buf;\
+        size_t size;\
+        value_init(&v);\
+        EXPECT_EQ_INT(PARSE_OK, json_parse(&v, json));\
+        EXPECT_EQ_INT(STRINGIFY_OK, snapshot_generate(&v, &buf, &size));\
+        EXPECT_EQ_INT(PARSE_OK, snapshot_open(&snap, buf, size));\
+        EXPECT_EQ_INT(PARSE_OK, snapshot_verify(&snap));\
+        free(buf);\
+        free_value(&v);\
+    } while(0)
+
+void test_snapshot_verify() {
+    json_value v;
+    char* buf;
+    size_t size, depth, i;
+    uint64_t members;
+    uint32_t index[2];
+
+    TEST_SNAPSHOT_VERIFY("1");
+    TEST_SNAPSHOT_VERIFY("\"\"");
+    TEST_SNAPSHOT_VERIFY("[[],{},\"\",[[null]],{\"\":{}}]");
+    TEST_SNAPSHOT_VERIFY("{\"b\":1,\"a\":2,\"b\":3,\"a\":4,\"b\":5}");
+
+    /* root node at 24 in the header, its payload offset at 32 and length at 40 */
+    value_init(&v);
+    EXPECT_EQ_INT(PARSE_OK, json_parse(&v, "{\"z\":[1.5,\"abc\",null],\"a\":{\"k\":true},\"m\":\"\\u0000x\",\"ab\":false}"));
+    EXPECT_EQ_INT(STRINGIFY_OK, snapshot_generate(&v, &buf, &size));
+    memcpy(&members, buf + 32, sizeof(members));
+    memcpy(index, buf + members + 4 * 40, sizeof(index));
+    TEST_SNAPSHOT_CORRUPT(buf, size, 24, uint32_t, 9);
+    TEST_SNAPSHOT_CORRUPT(buf, size, 32, uint64_t, members + 8);
+    TEST_SNAPSHOT_CORRUPT(buf, size, 32, uint64_t, (uint64_t)size);
+    TEST_SNAPSHOT_CORRUPT(buf, size, 40, uint64_t, 5);
+    TEST_SNAPSHOT_CORRUPT(buf, size, 40, uint64_t, UINT64_MAX / 8);
+    TEST_SNAPSHOT_CORRUPT(buf, size, members + 8, uint64_t, UINT64_MAX);
+    TEST_SNAPSHOT_CORRUPT(buf, size, members + 4 * 40, uint32_t, 4);
+    TEST_SNAPSHOT_CORRUPT(buf, size, members + 4 * 40, uint32_t, index[1]);
+    TEST_SNAPSHOT_CORRUPT(buf, size, size - 1, char, 'x');
+    free(buf);
+    free_value(&v);
+
+    /* a number uses only the first field */
+    EXPECT_EQ_INT(PARSE_OK, json_parse(&v, "1.5"));
+    EXPECT_EQ_INT(STRINGIFY_OK, snapshot_generate(&v, &buf, &size));
+    TEST_SNAPSHOT_CORRUPT(buf, size, 40, uint64_t, 1);
+    free(buf);
+    free_value(&v);
+
+    /* nesting past QGCJSON_MAX_DEPTH isn't mistaken for corruption */
+    for (depth = 1024; depth <= 1025; depth++) {
+        json_value* e = &v;
+        json_snapshot snap;
+        for (i = 0; i < depth; i++) {
+            set_value_array(e, 1);
+            e = array_emplace_back(e);
+        }
+        EXPECT_EQ_INT(STRINGIFY_OK, snapshot_generate(&v, &buf, &size));
+        EXPECT_EQ_INT(PARSE_OK, snapshot_open(&snap, buf, size));
+        EXPECT_EQ_INT(depth <= 1024 ? PARSE_OK : PARSE_TOO_DEEP, snapshot_verify(&snap));
+        free(buf);
+        free_value(&v);
+    }
+}
+
+void test_snapshot() {
+    json_value v;
+    json_snapshot snap;
+    snapshot_value root, e, m;
+    const char* key;
+    char* buf;
+    size_t size, length;
+
+    value_init(&v);
+    EXPECT_EQ_INT(PARSE_OK, json_parse(&v, "{\"z\":[1.5,\"abc\",null],\"a\":{\"k\":true},\"m\":\"\\u0000x\",\"ab\":false}"));
+    EXPECT_EQ_INT(STRINGIFY_OK, snapshot_generate(&v, &buf, &size));
+    EXPECT_EQ_INT(PARSE_OK, snapshot_open(&snap, buf, size));
+    EXPECT_EQ_INT(PARSE_OK, snapshot_verify(&snap));
+    root = get_snapshot_root(&snap);
+    EXPECT_EQ_INT(VALUE_OBJECT, get_snapshot_type(&root));
+    EXPECT_EQ_SIZE_T(4, get_snapshot_object_size(&root));
+    key = get_snapshot_member_key(&root, 0, &length);
+    EXPECT_EQ_STRING("z", key, length);
+    key = get_snapshot_member_key(&root, 3, &length);
+    EXPECT_EQ_STRING("ab", key, length);
+
+    EXPECT_EQ_INT(1, snapshot_find_member(&root, "z", 1, &m));
+    EXPECT_EQ_SIZE_T(3, get_snapshot_array_size(&m));
+    e = get_snapshot_array_element(&m, 0);
+    EXPECT_EQ_DOUBLE(1.5, get_snapshot_number(&e));
+    e = get_snapshot_array_element(&m, 1);
+    EXPECT_EQ_STRING("abc", get_snapshot_string(&e), get_snapshot_string_length(&e));
+    e = get_snapshot_array_element(&m, 2);
+    EXPECT_EQ_INT(VALUE_NULL, get_snapshot_type(&e));
+    EXPECT_EQ_INT(1, snapshot_find_member(&root, "m", 1, &m));
+    EXPECT_EQ_STRING("\0x", get_snapshot_string(&m), get_snapshot_string_length(&m));
+    EXPECT_EQ_INT(1, snapshot_find_member(&root, "ab", 2, &m));
+    EXPECT_EQ_INT(VALUE_FALSE, get_snapshot_type(&m));
+    EXPECT_EQ_INT(1, snapshot_find_member(&root, "a", 1, &m));
+    EXPECT_EQ_INT(1, snapshot_find_member(&m, "k", 1, &e));
+    EXPECT_EQ_INT(VALUE_TRUE, get_snapshot_type(&e));
+    EXPECT_EQ_INT(0, snapshot_find_member(&root, "b", 1, NULL));
+    EXPECT_EQ_INT(0, snapshot_find_member(&root, "", 0, NULL));
+    snapshot_close(&snap);
+
+    EXPECT_EQ_INT(PARSE_INVALID_BINARY, snapshot_open(&snap, buf, size - 8));
+    buf[0] = 'X';
+    EXPECT_EQ_INT(PARSE_INVALID_BINARY, snapshot_open(&snap, buf, size));
+    free(buf);
+
+    EXPECT_EQ_INT(STRINGIFY_OK, snapshotfile_generate(&v, "snapshot_test.bin"));
+    EXPECT_EQ_INT(PARSE_OK, snapshotfile_open(&snap, "snapshot_test.bin"));
+    EXPECT_EQ_INT(PARSE_OK, snapshot_verify(&snap));
+    root = get_snapshot_root(&snap);
+    EXPECT_EQ_INT(1, snapshot_find_member(&root, "z", 1, &m));
+    EXPECT_EQ_SIZE_T(3, get_snapshot_array_size(&m));
+    snapshot_close(&snap);
+    remove("snapshot_test.bin");
+    free_value(&v);
+}
+
+typedef struct counting_ctx {
+    size_t allocs, frees;
+} counting_ctx;
+
+/* one ctx may be shared by library worker threads */
+#ifdef TEST_THREADS
+static pthread_mutex_t counting_lock = PTHREAD_MUTEX_INITIALIZER;
+#define COUNT(ctx, n)\
+    do {\
+        pthread_mutex_lock(&counting_lock);\
+        ((counting_ctx*)(ctx))->n++;\
+        pthread_mutex_unlock(&counting_lock);\
+    } while(0)
+#else
+#define COUNT(ctx, n) (((counting_ctx*)(ctx))->n++)
+#endif
+
+void* counting_malloc(void* ctx, size_t size) {
+    COUNT(ctx, allocs);
+    return malloc(size);
+}
+
+void* counting_realloc(void* ctx, void* ptr, size_t size) {
+    if (ptr == NULL) COUNT(ctx, allocs);
+    return realloc(ptr, size);
+}
+
+void counting_free(void* ctx, void* ptr) {
+    if (ptr != NULL) COUNT(ctx, frees);
+    free(ptr);
+}
+
+/* parses and frees under an allocator of the thread's own, arg comes back if all went well */
+static void* counting_thread(void* arg) {
+    json_allocator a = { counting_malloc, counting_realloc, counting_free, NULL };
+    json_value v;
+    int ok;
+    a.ctx = arg;
+    json_set_thread_allocator(&a);
+    value_init(&v);
+    ok = json_parse(&v, "[\"x\",{\"y\":[1,2]}]") == PARSE_OK && json_get_allocator()->ctx == arg;
+    free_value(&v);
+    json_set_thread_allocator(NULL);
+    return ok ? arg : NULL;
+}
+
+void test_allocator() {
+    counting_ctx ctx = { 0, 0 }, mine = { 0, 0 }, theirs = { 0, 0 };
+    json_allocator a = { counting_malloc, counting_realloc, counting_free, NULL };
+    json_value v;
+    char* json;
+    size_t length;
+#ifdef TEST_THREADS
+    pthread_t thread;
+    void* ret;
+#endif
+    a.ctx = &ctx;
+
+    json_set_allocator(&a);
+    value_init(&v);
+    EXPECT_EQ_INT(PARSE_OK, json_parse(&v, "{\"a\":[1,\"x\",{\"b\":null}],\"c\":\"d\"}"));
+    EXPECT_EQ_INT(STRINGIFY_OK, json_generate(&v, &json, &length, 0));
+    json_free(json);
+    free_value(&v);
+    json_set_allocator(NULL);
+
+    EXPECT_EQ_INT(1, ctx.allocs > 0);
+    EXPECT_EQ_SIZE_T(ctx.allocs, ctx.frees);
+    EXPECT_EQ_INT(1, json_get_allocator()->ctx == NULL);
+
+    /* a thread's own allocator takes precedence over the process one, for that thread only */
+    json_set_allocator(&a);
+    EXPECT_EQ_INT(1, counting_thread(&mine) == &mine);
+    EXPECT_EQ_INT(1, mine.allocs > 0);
+    EXPECT_EQ_SIZE_T(mine.allocs, mine.frees);
+    EXPECT_EQ_INT(1, json_get_allocator()->ctx == &ctx);
+#ifdef TEST_THREADS
+    ctx.allocs = ctx.frees = 0;
+    EXPECT_EQ_INT(0, pthread_create(&thread, NULL, counting_thread, &theirs));
+    value_init(&v);
+    EXPECT_EQ_INT(PARSE_OK, json_parse(&v, "{\"a\":\"b\"}"));
+    free_value(&v);
+    EXPECT_EQ_INT(0, pthread_join(thread, &ret));
+    EXPECT_EQ_INT(1, ret == &theirs);
+    EXPECT_EQ_INT(1, theirs.allocs > 0);
+    EXPECT_EQ_SIZE_T(theirs.allocs, theirs.frees);
+    EXPECT_EQ_INT(1, ctx.allocs > 0);
+    EXPECT_EQ_SIZE_T(ctx.allocs, ctx.frees);
+#else
+    (void)theirs;
+#endif
+    json_set_allocator(NULL);
+}
+
+void test_array_mutation() {
+    json_value a, e;
+    size_t i;
+    value_init(&a);
+    value_init(&e);
+    set_value_array(&a, 0);
+    EXPECT_EQ_INT(VALUE_ARRAY, get_value_type(&a));
+    for (i = 0; i < 100; i++) set_value_number(array_emplace_back(&a), (double)i);
+    EXPECT_EQ_SIZE_T(100, get_value_array_size(&a));
+    EXPECT_EQ_INT(1, get_value_array_capacity(&a) >= 100);
+
+    set_value_string(&e, "front", 5);
+    array_push_front(&a, &e);
+    EXPECT_EQ_INT(VALUE_STRING, get_value_type(&e));
+    array_push_front_move(&a, &e);
+    EXPECT_EQ_INT(VALUE_NULL, get_value_type(&e));
+    set_value_string(&e, "back", 4);
+    array_push_back_move(&a, &e);
+    EXPECT_EQ_INT(VALUE_NULL, get_value_type(&e));
+    EXPECT_EQ_SIZE_T(103, get_value_array_size(&a));
+    EXPECT_EQ_STRING("front", get_value_string(get_value_array_element(&a, 0)), get_value_string_length(get_value_array_element(&a, 0)));
+    EXPECT_EQ_STRING("front", get_value_string(get_value_array_element(&a, 1)), get_value_string_length(get_value_array_element(&a, 1)));
+    EXPECT_EQ_DOUBLE(0.0, get_value_number(get_value_array_element(&a, 2)));
+    EXPECT_EQ_DOUBLE(99.0, get_value_number(get_value_array_element(&a, 101)));
+    EXPECT_EQ_STRING("back", get_value_string(get_value_array_element(&a, 102)), get_value_string_length(get_value_array_element(&a, 102)));
+
+    array_insert_element(&a, 2);
+    EXPECT_EQ_INT(VALUE_NULL, get_value_type(get_value_array_element(&a, 2)));
+    EXPECT_EQ_DOUBLE(0.0, get_value_number(get_value_array_element(&a, 3)));
+    shrink_value_array(&a);
+    EXPECT_EQ_SIZE_T(104, get_value_array_capacity(&a));
+    free_value(&a);
+}
+
+static size_t index_height(const json_member* members, const json_member* m) {
+    size_t l, r;
+    if (m == NULL) return 0;
+    l = index_height(members, MEMBER_SON(members, m, 0));
+    r = index_height(members, MEMBER_SON(members, m, 1));
+    return 1 + (l > r ? l : r);
+}
+
+void test_object_mutation() {
+    json_value o, *e;
+    json_member m;
+    char key[16];
+    size_t i, len;
+    value_init(&o);
+    set_value_object(&o, 0);
+    for (i = 0; i < 1000; i++) {
+        len = (size_t)sprintf(key, "k%04d", (int)i);  /* sorted order, the worst case for the tree */
+        set_value_number(object_emplace(&o, key, len), (double)i);
+    }
+    EXPECT_EQ_SIZE_T(1000, get_value_object_size(&o));
+    for (i = 0; i < 1000; i++) {
+        len = (size_t)sprintf(key, "k%04d", (int)i);
+        EXPECT_EQ_INT(1, object_find_member(&o, key, len));
+    }
+    EXPECT_EQ_INT(0, object_find_member(&o, "k", 1));
+    EXPECT_EQ_INT(0, object_find_member(&o, "k10000", 6));
+    EXPECT_EQ_INT(1, index_height(o.obj.members, o.obj.members) <= 2 * 10 + 2);
+
+    m.key = (char*)malloc(4);
+    memcpy(m.key, "new", 4);
+    m.key_length = 3;
+    value_init(&m.value);
+    set_value_string(&m.value, "v", 1);
+    insert_member(&o, &m);
+    EXPECT_EQ_INT(VALUE_STRING, get_value_type(&m.value));
+    free_value(&m.value);
+    free(m.key);
+
+    m.key = (char*)malloc(6);
+    memcpy(m.key, "moved", 6);
+    m.key_length = 5;
+    value_init(&m.value);
+    set_value_true(&m.value);
+    object_insert_move(&o, &m);
+    EXPECT_EQ_INT(1, m.key == NULL);
+    EXPECT_EQ_INT(VALUE_NULL, get_value_type(&m.value));
+    EXPECT_EQ_SIZE_T(1002, get_value_object_size(&o));
+    EXPECT_EQ_INT(1, object_find_member(&o, "new", 3));
+    EXPECT_EQ_INT(1, object_find_member(&o, "moved", 5));
+
+    remove_member(&o, "k0500", 5);
+    remove_member(&o, "new", 3);
+    remove_member(&o, "missing", 7);
+    EXPECT_EQ_SIZE_T(1000, get_value_object_size(&o));
+    EXPECT_EQ_INT(0, object_find_member(&o, "k0500", 5));
+    EXPECT_EQ_INT(1, object_find_member(&o, "k0501", 5));
+    EXPECT_EQ_INT(1, object_find_member(&o, "moved", 5));
+    e = get_member_value(get_value_object_member(&o, 500));
+    EXPECT_EQ_DOUBLE(501.0, get_value_number(e));
+    shrink_value_object(&o);
+    EXPECT_EQ_INT(1, object_find_member(&o, "k0999", 5));
+    free_value(&o);
+
+    /* descending keys are rebalanced just the same */
+    set_value_object(&o, 0);
+    for (i = 1000; i-- > 0;) {
+        len = (size_t)sprintf(key, "k%04d", (int)i);
+        set_value_number(object_emplace(&o, key, len), (double)i);
+    }
+    EXPECT_EQ_INT(1, index_height(o.obj.members, o.obj.members) <= 2 * 10 + 2);
+    for (i = 0; i < 1000; i++) {
+        len = (size_t)sprintf(key, "k%04d", (int)i);
+        EXPECT_EQ_DOUBLE((double)i, get_value_number(object_member_mut(&o, key, len)));
+    }
+    free_value(&o);
+
+    set_value_object(&o, 0);
+    EXPECT_EQ_INT(0, object_find_member(&o, "a", 1));
+    free_value(&o);
+}
+
+void test_builder() {
+    json_builder* b = builder_create();
+    json_value v;
+    char* json;
+    size_t i, length;
+
+    builder_begin_object(b);
+    set_value_number(builder_member(b, "id", 2), 1.0);
+    builder_key(b, "tags", 4);
+    builder_begin_array(b);
+    set_value_string(builder_value(b), "a", 1);
+    set_value_string(builder_value(b), "b", 1);
+    builder_end(b);
+    builder_key(b, "o", 1);
+    builder_begin_object(b);
+    builder_end(b);
+    builder_key(b, "e", 1);
+    builder_begin_array(b);
+    builder_end(b);
+    set_value_null(builder_member(b, "n", 1));
+    builder_end(b);
+    builder_finish(b, &v);
+    EXPECT_EQ_INT(STRINGIFY_OK, json_generate(&v, &json, &length, 0));
+    EXPECT_EQ_STRING("{\"id\":1,\"tags\":[\"a\",\"b\"],\"o\":{},\"e\":[],\"n\":null}", json, length);
+    EXPECT_EQ_SIZE_T(5, get_value_object_capacity(&v));
+    EXPECT_EQ_INT(1, object_find_member(&v, "tags", 4));
+    EXPECT_EQ_INT(1, object_find_member(&v, "n", 1));
+    free(json);
+    free_value(&v);
+
+    /* the builder is reusable after finish, and a reservation too big to make is ignored */
+    builder_reserve(b, SIZE_MAX / 2);
+    builder_reserve(b, 100000);
+    builder_begin_array(b);
+    for (i = 0; i < 100000; i++) set_value_number(builder_value(b), (double)i);
+    builder_end(b);
+    builder_finish(b, &v);
+    EXPECT_EQ_SIZE_T(100000, get_value_array_size(&v));
+    EXPECT_EQ_SIZE_T(100000, get_value_array_capacity(&v));
+    EXPECT_EQ_DOUBLE(99999.0, get_value_number(get_value_array_element(&v, 99999)));
+    free_value(&v);
+
+    /* unfinished documents are released by builder_free */
+    builder_begin_object(b);
+    builder_key(b, "a", 1);
+    builder_begin_array(b);
+    set_value_string(builder_value(b), "x", 1);
+    builder_end(b);
+    builder_key(b, "b", 1);
+    builder_begin_object(b);
+    set_value_string(builder_member(b, "c", 1), "y", 1);
+    builder_key(b, "d", 1);
+    builder_free(b);
+}
+
+#define MEMBER_VALUE(v, i) (&get_value_object_member(v, i)->value)
+
+void test_share() {
+    json_value a, b, c;
+    json_value* v;
+    const char* s;
+    size_t len;
+    value_init(&a);
+    value_init(&b);
+    value_init(&c);
+    EXPECT_EQ_INT(PARSE_OK, json_parse(&a, "{\"x\":[\"s\",{\"y\":\"old\"}],\"z\":[true]}"));
+    value_share(&b, &a);
+    EXPECT_EQ_INT(1, value_is_shared(&a));
+    EXPECT_EQ_INT(1, value_is_shared(&b));
+    EXPECT_EQ_INT(1, value_is_equal(&a, &b));
+    value_copy(&c, &b);
+    EXPECT_EQ_INT(1, value_is_shared(&c));
+
+    /* only the path down to "y" is copied, "z" stays shared */
+    v = object_member_mut(&b, "x", 1);
+    v = array_element_mut(v, 1);
+    v = object_member_mut(v, "y", 1);
+    set_value_string(v, "new", 3);
+    EXPECT_EQ_INT(0, value_is_shared(&b));
+    EXPECT_EQ_INT(1, value_is_shared(MEMBER_VALUE(&b, 1)));
+    EXPECT_EQ_INT(0, value_is_shared(MEMBER_VALUE(&b, 0)));
+    EXPECT_EQ_INT(1, value_is_shared(get_value_array_element(MEMBER_VALUE(&b, 0), 0)));
+    EXPECT_EQ_INT(0, value_is_equal(&a, &b));
+    v = MEMBER_VALUE(get_value_array_element(MEMBER_VALUE(&a, 0), 1), 0);
+    s = get_value_string(v);
+    len = get_value_string_length(v);
+    EXPECT_EQ_STRING("old", s, len);
+    v = MEMBER_VALUE(get_value_array_element(MEMBER_VALUE(&b, 0), 1), 0);
+    s = get_value_string(v);
+    len = get_value_string_length(v);
+    EXPECT_EQ_STRING("new", s, len);
+    EXPECT_EQ_INT(1, value_is_equal(&a, &c));
+
+    /* plain mutators unshare the level they change */
+    array_push_back(object_member_mut(&c, "z", 1), &b);
+    EXPECT_EQ_SIZE_T(1, get_value_array_size(MEMBER_VALUE(&a, 1)));
+    EXPECT_EQ_SIZE_T(2, get_value_array_size(MEMBER_VALUE(&c, 1)));
+    remove_member(&c, "x", 1);
+    EXPECT_EQ_SIZE_T(2, get_value_object_size(&a));
+    EXPECT_EQ_SIZE_T(1, get_value_object_size(&c));
+
+    /* the last reference takes the storage over instead of copying it */
+    free_value(&a);
+    value_unshare(&b);
+    EXPECT_EQ_INT(0, value_is_shared(&b));
+    free_value(&b);
+    free_value(&c);
+}
+
+#define TEST_EQUAL(expect, lhs, rhs)\
+    do {\
+        json_value l, r;\
+        EXPECT_EQ_INT(PARSE_OK, json_parse(&l, lhs));\
+        EXPECT_EQ_INT(PARSE_OK, json_parse(&r, rhs));\
+        EXPECT_EQ_INT(expect, value_is_equal(&l, &r));\
+        EXPECT_EQ_INT(expect, value_is_equal(&r, &l));\
+        if (expect) EXPECT_EQ_INT(1, json_value_hash(&l, 0) == json_value_hash(&r, 0));\
+        free_value(&l);\
+        free_value(&r);\
+    } while(0)
+
+void test_hash() {
+    json_value a, b;
+    json_value* v;
+    unsigned long long h;
+    value_init(&a);
+    value_init(&b);
+    EXPECT_EQ_INT(PARSE_OK, json_parse(&a, "{\"a\":1,\"b\":[true,null,\"s\"],\"c\":{\"x\":0,\"y\":{}}}"));
+    EXPECT_EQ_INT(PARSE_OK, json_parse(&b, "{\"c\":{\"y\":{},\"x\":-0},\"a\":1,\"b\":[true,null,\"s\"]}"));
+    EXPECT_EQ_INT(1, value_is_equal(&a, &b));
+    EXPECT_EQ_INT(1, json_value_hash(&a, 0) == json_value_hash(&b, 0));
+    EXPECT_EQ_INT(0, value_is_shared(&a));
+
+    /* memoized hashes survive until the level is unshared for mutation */
+    h = json_value_hash(&a, 1);
+    EXPECT_EQ_INT(1, value_is_shared(&a));
+    EXPECT_EQ_INT(1, h == json_value_hash(&b, 1));
+    EXPECT_EQ_INT(1, value_is_equal(&a, &b));
+    v = array_element_mut(object_member_mut(&b, "b", 1), 1);
+    set_value_false(v);
+    EXPECT_EQ_INT(0, h == json_value_hash(&b, 1));
+    EXPECT_EQ_INT(0, value_is_equal(&a, &b));
+    EXPECT_EQ_INT(0, value_is_equal(&b, &a));
+    free_value(&b);
+
+    EXPECT_EQ_INT(PARSE_OK, json_parse(&b, "{\"a\":1,\"b\":[null,true,\"s\"],\"c\":{\"x\":0,\"y\":{}}}"));
+    EXPECT_EQ_INT(0, value_is_equal(&a, &b));
+    EXPECT_EQ_INT(0, h == json_value_hash(&b, 0));
+    free_value(&b);
+    EXPECT_EQ_INT(PARSE_OK, json_parse(&b, "{\"a\":1,\"b\":[true,null,\"s\"],\"z\":{\"x\":0,\"y\":{}}}"));
+    EXPECT_EQ_INT(0, value_is_equal(&a, &b));
+    EXPECT_EQ_INT(0, h == json_value_hash(&b, 0));
+    free_value(&b);
+    free_value(&a);
+
+    /* members pair up one to one, repeated keys included */
+    TEST_EQUAL(1, "{\"x\":1,\"y\":2}", "{\"y\":2,\"x\":1}");
+    TEST_EQUAL(0, "{\"x\":1,\"y\":2}", "{\"y\":1,\"x\":2}");
+    TEST_EQUAL(0, "{\"a\":1,\"a\":1}", "{\"a\":1,\"b\":2}");
+    TEST_EQUAL(1, "{\"a\":1,\"a\":2}", "{\"a\":2,\"a\":1}");
+    TEST_EQUAL(0, "{\"a\":1,\"a\":2}", "{\"a\":1,\"a\":1}");
+    TEST_EQUAL(0, "{\"a\":1,\"a\":2,\"b\":0}", "{\"a\":1,\"b\":0,\"a\":1}");
+    TEST_EQUAL(1, "{\"b\":0,\"a\":[1],\"a\":{}}", "{\"a\":{},\"b\":0,\"a\":[1]}");
+    TEST_EQUAL(1, "{\"k\":\"aaaaaaaabbbbbbbb\",\"k\":\"CLCAAAAAM{cB|O-N\"}", "{\"k\":\"CLCAAAAAM{cB|O-N\",\"k\":\"aaaaaaaabbbbbbbb\"}");
+    TEST_EQUAL(0, "{\"k\":\"aaaaaaaabbbbbbbb\",\"k\":\"CLCAAAAAM{cB|O-N\"}", "{\"k\":\"aaaaaaaabbbbbbbb\",\"k\":\"aaaaaaaabbbbbbbb\"}");
+}
+
+#define TEST_PATCH(doc, patch, expect, result)\
+    do {\
+        json_value d, p, e;\
+        value_init(&d);\
+        value_init(&p);\
+        value_init(&e);\
+        EXPECT_EQ_INT(PARSE_OK, json_parse(&d, doc));\
+        EXPECT_EQ_INT(PARSE_OK, json_parse(&p, patch));\
+        EXPECT_EQ_INT(PARSE_OK, json_parse(&e, expect));\
+        EXPECT_EQ_INT(result, json_patch_apply(&d, &p));\
+        if (result == PATCH_OK) EXPECT_EQ_INT(1, value_is_equal(&d, &e));\
+        free_value(&d);\
+        free_value(&p);\
+        free_value(&e);\
+    } while(0)
+
+/* a failing operation leaves the document as the operations before it left it */
+#define TEST_PATCH_UNCHANGED(doc, patch, result)\
+    do {\
+        json_value d, p, e;\
+        value_init(&d);\
+        value_init(&p);\
+        value_init(&e);\
+        EXPECT_EQ_INT(PARSE_OK, json_parse(&d, doc));\
+        EXPECT_EQ_INT(PARSE_OK, json_parse(&p, patch));\
+        EXPECT_EQ_INT(PARSE_OK, json_parse(&e, doc));\
+        EXPECT_EQ_INT(result, json_patch_apply(&d, &p));\
+        EXPECT_EQ_INT(1, value_is_equal(&d, &e));\
+        free_value(&d);\
+        free_value(&p);\
+        free_value(&e);\
+    } while(0)
+
+#define TEST_DIFF(from, to)\
+    do {\
+        json_value a, b, c, p;\
+        value_init(&a);\
+        value_init(&b);\
+        value_init(&c);\
+        value_init(&p);\
+        EXPECT_EQ_INT(PARSE_OK, json_parse(&a, from));\
+        EXPECT_EQ_INT(PARSE_OK, json_parse(&b, to));\
+        json_diff(&p, &a, &b);\
+        value_copy(&c, &a);\
+        EXPECT_EQ_INT(PATCH_OK, json_patch_apply(&c, &p));\
+        EXPECT_EQ_INT(1, value_is_equal(&c, &b));\
+        free_value(&p);\
+        free_value(&c);\
+        EXPECT_EQ_INT(PARSE_OK, json_parse(&c, from));\
+        EXPECT_EQ_INT(1, value_is_equal(&c, &a));\
+        free_value(&a);\
+        free_value(&b);\
+        free_value(&c);\
+    } while(0)
+
+void test_patch() {
+    json_value a, b, p;
+    char* json;
+    size_t len;
+
+    TEST_PATCH("{\"a\":1}", "[{\"op\":\"add\",\"path\":\"/b\",\"value\":[2]}]", "{\"a\":1,\"b\":[2]}", PATCH_OK);
+    TEST_PATCH("[1,2]", "[{\"op\":\"add\",\"path\":\"/1\",\"value\":3},{\"op\":\"add\",\"path\":\"/-\",\"value\":4}]", "[1,3,2,4]", PATCH_OK);
+    TEST_PATCH("{\"a\":{\"b\":[1,2]}}", "[{\"op\":\"remove\",\"path\":\"/a/b/0\"}]", "{\"a\":{\"b\":[2]}}", PATCH_OK);
+    TEST_PATCH("{\"a\":1}", "[{\"op\":\"replace\",\"path\":\"\",\"value\":[]}]", "[]", PATCH_OK);
+    TEST_PATCH("{\"a\":1}", "[{\"op\":\"replace\",\"path\":\"/a\",\"value\":{\"x\":null}}]", "{\"a\":{\"x\":null}}", PATCH_OK);
+    TEST_PATCH("{\"a\":{\"b\":1},\"c\":[]}", "[{\"op\":\"move\",\"from\":\"/a/b\",\"path\":\"/c/0\"}]", "{\"a\":{},\"c\":[1]}", PATCH_OK);
+    TEST_PATCH("{\"a\":[1,2]}", "[{\"op\":\"copy\",\"from\":\"/a\",\"path\":\"/b\"}]", "{\"a\":[1,2],\"b\":[1,2]}", PATCH_OK);
+    TEST_PATCH("{\"a/b\":1,\"m~n\":2}", "[{\"op\":\"test\",\"path\":\"/a~1b\",\"value\":1},{\"op\":\"remove\",\"path\":\"/m~0n\"}]", "{\"a/b\":1}", PATCH_OK);
+    TEST_PATCH("{\"\":1}", "[{\"op\":\"replace\",\"path\":\"/\",\"value\":2}]", "{\"\":2}", PATCH_OK);
+
+    TEST_PATCH("{\"a\":1}", "[{\"op\":\"test\",\"path\":\"/a\",\"value\":2}]", "null", PATCH_TEST_FAILED);
+    TEST_PATCH("{\"a\":1}", "[{\"op\":\"remove\",\"path\":\"/b\"}]", "null", PATCH_PATH_NOT_FOUND);
+    TEST_PATCH("[1]", "[{\"op\":\"add\",\"path\":\"/2\",\"value\":0}]", "null", PATCH_PATH_NOT_FOUND);
+    TEST_PATCH("[1]", "[{\"op\":\"replace\",\"path\":\"/01\",\"value\":0}]", "null", PATCH_PATH_NOT_FOUND);
+    TEST_PATCH("[1]", "[{\"op\":\"replace\",\"path\":\"/-\",\"value\":0}]", "null", PATCH_PATH_NOT_FOUND);
+    TEST_PATCH("{\"a\":1}", "[{\"op\":\"remove\",\"path\":\"/a~2\"}]", "null", PATCH_PATH_NOT_FOUND);
+    TEST_PATCH("{\"a\":{}}", "[{\"op\":\"move\",\"from\":\"/a\",\"path\":\"/a/b\"}]", "null", PATCH_INVALID_OPERATION);
+    TEST_PATCH("{\"a\":1}", "[{\"op\":\"add\",\"path\":\"/b\"}]", "null", PATCH_INVALID_OPERATION);
+    TEST_PATCH("{\"a\":1}", "[{\"op\":\"frobnicate\",\"path\":\"/a\"}]", "null", PATCH_INVALID_OPERATION);
+    TEST_PATCH("{\"a\":1}", "{}", "null", PATCH_INVALID_OPERATION);
+    TEST_PATCH_UNCHANGED("{\"a\":1,\"b\":{}}", "[{\"op\":\"move\",\"from\":\"/a\",\"path\":\"/missing/x\"}]", PATCH_PATH_NOT_FOUND);
+    TEST_PATCH_UNCHANGED("[1,2,3]", "[{\"op\":\"move\",\"from\":\"/0\",\"path\":\"/5\"}]", PATCH_PATH_NOT_FOUND);
+    TEST_PATCH_UNCHANGED("{\"a\":[1,2],\"b\":3}", "[{\"op\":\"move\",\"from\":\"/a/1\",\"path\":\"/b/x\"}]", PATCH_PATH_NOT_FOUND);
+
+    TEST_DIFF("null", "null");
+    TEST_DIFF("{\"a\":1,\"b\":[1,2,3]}", "{\"b\":[1,2,3],\"a\":2}");
+    TEST_DIFF("{\"a\":1,\"b\":{\"c\":\"x\"}}", "{\"b\":{\"d\":\"x\"},\"e\":true}");
+    TEST_DIFF("[1,2,3,4,5]", "[1,2,9,4,5]");
+    TEST_DIFF("[1,2,3,4,5]", "[1,5]");
+    TEST_DIFF("[1,5]", "[0,1,2,3,4,5,6]");
+    TEST_DIFF("[{\"a\":[1,{\"b\":2}]},\"s\"]", "[{\"a\":[1,{\"b\":3}]},\"s\",[]]");
+    TEST_DIFF("{\"a/b\":{\"m~n\":1}}", "{\"a/b\":{\"m~n\":2}}");
+    TEST_DIFF("[]", "{}");
+    TEST_DIFF("{\"k\":\"aaaaaaaabbbbbbbb\"}", "{\"k\":\"CLCAAAAAM{cB|O-N\"}");  /* same hash */
+
+    /* only the changed leaf is sent */
+    value_init(&a);
+    value_init(&b);
+    value_init(&p);
+    EXPECT_EQ_INT(PARSE_OK, json_parse(&a, "{\"big\":[1,2,3,[4,5,6]],\"x\":{\"y\":[true,false]}}"));
+    value_copy(&b, &a);
+    set_value_null(array_element_mut(object_member_mut(object_member_mut(&b, "x", 1), "y", 1), 1));
+    json_diff(&p, &a, &b);
+    EXPECT_EQ_INT(STRINGIFY_OK, json_generate(&p, &json, &len, 0));
+    EXPECT_EQ_STRING("[{\"op\":\"replace\",\"path\":\"/x/y/1\",\"value\":null}]", json, len);
+    json_free(json);
+    free_value(&a);
+    free_value(&b);
+    free_value(&p);
+}
+
+typedef struct test_point {
+    double x, y;
+} test_point;
+typedef struct test_record {
+    int id, ok;
+    char name[8];
+    char* note;
+    double score;
+    test_point pos;
+} test_record;
+
+static const json_field point_fields[] = {
+    JSON_FIELD(test_point, x, FIELD_NUMBER),
+    JSON_FIELD(test_point, y, FIELD_NUMBER)
+};
+static json_schema point_schema;
+static const json_field record_fields[] = {
+    JSON_FIELD(test_record, id, FIELD_INT),
+    JSON_FIELD(test_record, ok, FIELD_BOOL),
+    JSON_FIELD(test_record, name, FIELD_CHARS),
+    JSON_FIELD(test_record, note, FIELD_STRING),
+    JSON_FIELD(test_record, score, FIELD_NUMBER),
+    JSON_FIELD_OBJECT(test_record, pos, &point_schema)
+};
+static json_schema record_schema;
+
+#define TEST_STRUCT_ERROR(error, json)\
+    do {\
+        test_record r;\
+        memset(&r, 0, sizeof(r));\
+        EXPECT_EQ_INT(error, json_parse_struct(&r, &record_schema, json));\
+        json_free(r.note);\
+    } while(0)
+
+void test_struct() {
+    static const json_field duplicate[] = {
+        JSON_FIELD(test_point, x, FIELD_NUMBER),
+        JSON_FIELD(test_point, x, FIELD_NUMBER)
+    };
+    static const json_field mistyped[] = {
+        JSON_FIELD(test_point, x, FIELD_INT)
+    };
+    json_schema bad;
+    test_record r;
+    char* json;
+    size_t len;
+
+    EXPECT_EQ_INT(1, schema_init(&point_schema, point_fields, 2));
+    EXPECT_EQ_INT(1, schema_init(&record_schema, record_fields, sizeof(record_fields) / sizeof(record_fields[0])));
+    EXPECT_EQ_INT(0, schema_init(&bad, duplicate, 2));
+    schema_free(&bad);
+    EXPECT_EQ_INT(0, schema_init(&bad, mistyped, 1));
+    schema_free(&bad);
+
+    memset(&r, 0, sizeof(r));
+    r.score = 9;
+    EXPECT_EQ_INT(PARSE_OK, json_parse_struct(&r, &record_schema,
+        " { \"id\" : -7, \"name\":\"abc\", \"extra\":[1,{\"k\":[\"v\",null,false]}], \"pos\":{\"y\":2.5,\"x\":1,\"z\":{}},"
+        "\"ok\":true, \"note\":\"hi\\nthere\", \"score\":null, \"\":0 } "));
+    EXPECT_EQ_INT(-7, r.id);
+    EXPECT_EQ_INT(1, r.ok);
+    EXPECT_EQ_STRING("abc", r.name, strlen(r.name));
+    EXPECT_EQ_STRING("hi\nthere", r.note, strlen(r.note));
+    EXPECT_EQ_DOUBLE(9.0, r.score);
+    EXPECT_EQ_DOUBLE(1.0, r.pos.x);
+    EXPECT_EQ_DOUBLE(2.5, r.pos.y);
+
+    EXPECT_EQ_INT(STRINGIFY_OK, json_generate_struct(&r, &record_schema, &json, &len));
+    EXPECT_EQ_STRING("{\"id\":-7,\"ok\":true,\"name\":\"abc\",\"note\":\"hi\\nthere\",\"score\":9,\"pos\":{\"x\":1,\"y\":2.5}}", json, len);
+    json_free(json);
+    /* reparsing replaces the string */
+    EXPECT_EQ_INT(PARSE_OK, json_parse_struct(&r, &record_schema, "{\"note\":\"\",\"ok\":false}"));
+    EXPECT_EQ_STRING("", r.note, strlen(r.note));
+    EXPECT_EQ_INT(0, r.ok);
+    json_free(r.note);
+
+    TEST_STRUCT_ERROR(PARSE_SCHEMA_MISMATCH, "{\"id\":1.5}");
+    TEST_STRUCT_ERROR(PARSE_SCHEMA_MISMATCH, "{\"id\":1e10}");
+    TEST_STRUCT_ERROR(PARSE_SCHEMA_MISMATCH, "{\"id\":\"1\"}");
+    TEST_STRUCT_ERROR(PARSE_SCHEMA_MISMATCH, "{\"ok\":1}");
+    TEST_STRUCT_ERROR(PARSE_SCHEMA_MISMATCH, "{\"name\":\"12345678\"}");
+    TEST_STRUCT_ERROR(PARSE_SCHEMA_MISMATCH, "{\"pos\":[]}");
+    TEST_STRUCT_ERROR(PARSE_SCHEMA_MISMATCH, "[]");
+    TEST_STRUCT_ERROR(PARSE_EXPECT_VALUR, "");
+    TEST_STRUCT_ERROR(PARSE_ROOT_NOT_SINGULAR, "{} x");
+    TEST_STRUCT_ERROR(PARSE_MISS_MEMBER_COLON, "{\"id\" 1}");
+    TEST_STRUCT_ERROR(PARSE_MISS_COMMA_OR_CURLY_BRACKET, "{\"id\":1 \"ok\":true}");
+    TEST_STRUCT_ERROR(PARSE_MISS_COMMA_OR_SQUARE_BRACKET, "{\"x\":[1 2]}");
+    TEST_STRUCT_ERROR(PARSE_INVALID_VALUE, "{\"x\":[tru]}");
+    TEST_STRUCT_ERROR(PARSE_MISS_QUOTATION_MARK, "{\"note\":\"abc");
+
+    schema_free(&record_schema);
+    schema_free(&point_schema);
+}
+
+void test_validate() {
+    static const char doc[] = "{\"a\":[1,-0.5e3,\"x\\u00e9\xc3\xa9\xe2\x82\xac\xf0\x9d\x84\x9e\",true,false,null,{}],\"b\":{\"c\":[]}}";
+    char big[64];
+    char* deep;
+    size_t deep_len = 1 << 20;
+
+    /* utf-8 is checked by the parser and the validator alike */
+    TEST_STRING("\xC2\xA2\xE2\x82\xAC\xF0\x9D\x84\x9E", "\"\xC2\xA2\xE2\x82\xAC\xF0\x9D\x84\x9E\"");
+    TEST_STRING("\xEF\xBF\xBF\xF4\x8F\xBF\xBF", "\"\xEF\xBF\xBF\xF4\x8F\xBF\xBF\"");
+    TEST_STRING("0123456789abcdef\xC3\xA9" "0123456789abcdef", "\"0123456789abcdef\xC3\xA9" "0123456789abcdef\"");
+    TEST_ERROR(PARSE_INVALID_UTF8, "\"\x80\"");
+    TEST_ERROR(PARSE_INVALID_UTF8, "\"\xC0\xAF\"");  /* overlong '/' */
+    TEST_ERROR(PARSE_INVALID_UTF8, "\"\xE0\x80\xAF\"");
+    TEST_ERROR(PARSE_INVALID_UTF8, "\"\xF0\x80\x80\xAF\"");
+    TEST_ERROR(PARSE_INVALID_UTF8, "\"\xED\xA0\x80\"");  /* surrogate */
+    TEST_ERROR(PARSE_INVALID_UTF8, "\"\xF4\x90\x80\x80\"");  /* > U+10FFFF */
+    TEST_ERROR(PARSE_INVALID_UTF8, "\"\xF5\x80\x80\x80\"");
+    TEST_ERROR(PARSE_INVALID_UTF8, "\"\xE2\x82\"");
+    TEST_ERROR(PARSE_INVALID_UTF8, "\"\xE2\x82");
+    TEST_ERROR(PARSE_INVALID_UTF8, "\"0123456789abcdef0123456789\xFF\"");
+
+    TEST_ERROR(PARSE_NUMBER_TOO_BIG, "1.7976931348623159e308");
+    TEST_ERROR(PARSE_NUMBER_TOO_BIG, "179769313486231580793728971405303415079934132710037826936173778980444968292764750946649017977587207096330286416692887910946555547851940402630657488671505820681908902000708383676273854845817711531764475730270069855571366959622842914819860834936475292719074168444365510704342711559699508093042880177904174497792");
+    TEST_ERROR(PARSE_NUMBER_TOO_BIG, "0.01e311");
+    TEST_NUMBER(1.7976931348623157e308, "17976931348623157e292");
+    /* past the first 40 digits the rest of the threshold still decides */
+    TEST_NUMBER(1.7976931348623157e308, "1.79769313486231580793728971405303415079934e308");
+    TEST_NUMBER(1.7976931348623157e308, "1.7976931348623158079372897140530341507993413271e308");
+    TEST_NUMBER(1.7976931348623157e308, "179769313486231580793728971405303415079934132710037826936173778980444968292764750946649017977587207096330286416692887910946555547851940402630657488671505820681908902000708383676273854845817711531764475730270069855571366959622842914819860834936475292719074168444365510704342711559699508093042880177904174497791.999");
+    TEST_ERROR(PARSE_NUMBER_TOO_BIG, "179769313486231580793728971405303415079934132710037826936173778980444968292764750946649017977587207096330286416692887910946555547851940402630657488671505820681908902000708383676273854845817711531764475730270069855571366959622842914819860834936475292719074168444365510704342711559699508093042880177904174497792.0000001");
+    TEST_NUMBER(1e308, "0.0001e312");
+    TEST_NUMBER(0.0, "0.000e99999");
+
+    EXPECT_EQ_INT(PARSE_OK, json_validate(doc, sizeof(doc) - 1));
+    /* every proper prefix is incomplete */
+    for (size_t i = 0; i < sizeof(doc) - 1; i++) EXPECT_EQ_INT(0, json_validate(doc, i) == PARSE_OK);
+    /* the length bounds the input, not a terminator */
+    EXPECT_EQ_INT(PARSE_OK, json_validate("[1] x", 3));
+    EXPECT_EQ_INT(PARSE_ROOT_NOT_SINGULAR, json_validate("1\0", 2));
+    EXPECT_EQ_INT(PARSE_INVALID_STRING_CHAR, json_validate("\"\0\"", 3));
+    EXPECT_EQ_INT(PARSE_MISS_QUOTATION_MARK, json_validate("\"abc\"", 4));
+    EXPECT_EQ_INT(PARSE_INVALID_VALUE, json_validate("true", 3));
+    EXPECT_EQ_INT(PARSE_EXPECT_VALUR, json_validate(NULL, 0));
+    memset(big, '[', sizeof(big));
+    EXPECT_EQ_INT(PARSE_EXPECT_VALUR, json_validate(big, sizeof(big)));
+
+    /* nesting is bounded, a wall of brackets is an error and not a crash */
+    deep = (char*)malloc(deep_len);
+    memset(deep, '[', deep_len);
+    EXPECT_EQ_INT(PARSE_TOO_DEEP, json_validate(deep, deep_len));
+    memset(deep + 1024, ']', 1024);
+    EXPECT_EQ_INT(PARSE_OK, json_validate(deep, 2048));
+    deep[1024] = '[';
+    deep[2048] = ']';
+    EXPECT_EQ_INT(PARSE_TOO_DEEP, json_validate(deep, 2050));
+    free(deep);
+}
+
+#define TEST_CANONICAL(expect, json)\
+    do {\
+        json_value v;\
+        char* out;\
+        size_t length;\
+        value_init(&v);\
+        EXPECT_EQ_INT(PARSE_OK, json_parse(&v, json));\
+        EXPECT_EQ_INT(STRINGIFY_OK, json_canonical_generate(&v, &out, &length));\
+        EXPECT_EQ_STRING(expect, out, length);\
+        json_free(out);\
+        free_value(&v);\
+    } while(0)
+
+typedef struct test_chunks {
+    char* data;
+    size_t size, writes;
+} test_chunks;
+
+void test_chunks_write(void* ctx, const char* data, size_t len) {
+    test_chunks* c = (test_chunks*)ctx;
+    c->data = (char*)realloc(c->data, c->size + len);
+    memcpy(c->data + c->size, data, len);
+    c->size += len;
+    c->writes++;
+}
+
+void test_canonical() {
+    json_value a, b;
+    json_sink sink;
+    test_chunks chunks = { NULL, 0, 0 };
+    char* out;
+    size_t len, i;
+    unsigned long long h;
+
+    TEST_CANONICAL("[0,0,1,-1,100,0.1,123.456,1e+21,100000000000000000000,0.000001,1e-7,1.5e+300,5e-324]",
+        "[0, -0, 1.0, -1, 1e2, 0.1, 123.456, 1e21, 1e20, 1e-6, 1e-7, 15e299, 4.9406564584124654e-324]");
+    TEST_CANONICAL("[1.7976931348623157e+308,0.30000000000000004,333333333.3333333]",
+        "[1.7976931348623157e308, 0.30000000000000004, 333333333.33333333]");
+    TEST_CANONICAL("\"\\u000f\\\"/\xC3\xA9\\n\"", "\"\\u000F\\\"\\/\xC3\xA9\\n\"");
+    TEST_CANONICAL("{\"\":{\"y\":null,\"z\":true},\"a\":[],\"aa\":{},\"b\":1}", "{\"b\":1,\"aa\":{},\"a\":[],\"\":{\"z\":true,\"y\":null}}");
+
+    value_init(&a);
+    value_init(&b);
+    EXPECT_EQ_INT(PARSE_OK, json_parse(&a, "{\"k\":[1,2,{\"x\":1,\"y\":2}],\"j\":\"s\"}"));
+    EXPECT_EQ_INT(PARSE_OK, json_parse(&b, "{ \"j\" : \"s\", \"k\" : [1.0, 2, {\"y\":2e0, \"x\":1}] }"));
+    EXPECT_EQ_INT(1, json_canonical_hash(&a) == json_canonical_hash(&b));
+    set_value_number(get_value_array_element(&get_value_object_member(&b, 1)->value, 1), 3);
+    EXPECT_EQ_INT(0, json_canonical_hash(&a) == json_canonical_hash(&b));
+    set_value_number(get_value_array_element(&get_value_object_member(&b, 1)->value, 1), HUGE_VAL);
+    EXPECT_EQ_INT(1, json_canonical_hash(&b) == 0);
+    set_value_number(get_value_array_element(&get_value_object_member(&b, 1)->value, 1), -HUGE_VAL);
+    EXPECT_EQ_INT(1, json_canonical_hash(&b) == 0);
+    free_value(&b);
+
+    /* the sink gets the same text in chunks */
+    set_value_array(&b, 0);
+    for (i = 0; i < 2000; i++) set_value_string(array_emplace_back(&b), "0123456789", 10);
+    array_push_back(&b, &a);
+    EXPECT_EQ_INT(STRINGIFY_OK, json_canonical_generate(&b, &out, &len));
+    sink.write = test_chunks_write;
+    sink.ctx = &chunks;
+    EXPECT_EQ_INT(STRINGIFY_OK, json_canonical_write(&b, &sink));
+    EXPECT_EQ_INT(1, chunks.writes > 1);
+    EXPECT_EQ_SIZE_T(len, chunks.size);
+    EXPECT_EQ_INT(0, memcmp(out, chunks.data, len));
+    h = 0xCBF29CE484222325ULL;
+    for (i = 0; i < len; i++) h = (h ^ (unsigned char)out[i]) * 0x100000001B3ULL;
+    EXPECT_EQ_INT(1, h == json_canonical_hash(&b));
+    free(chunks.data);
+    json_free(out);
+    free_value(&a);
+    free_value(&b);
+}
+
+#define TEST_CACHE_STATS(c, h, m, e)\
+    do {\
+        json_file_cache_stats stats;\
+        file_cache_get_stats(c, &stats);\
+        EXPECT_EQ_SIZE_T(h, stats.hits);\
+        EXPECT_EQ_SIZE_T(m, stats.misses);\
+        EXPECT_EQ_SIZE_T(e, stats.entries);\
+    } while(0)
+
+void test_file_cache() {
+    static const char path[] = "cache_test.json";
+    static const char path2[] = "cache_test2.json";
+    json_file_cache* c = file_cache_create(1 << 20, 0);
+    json_value v, w;
+    json_file_cache_stats stats;
+    counting_ctx pool = { 0, 0 };
+    json_allocator a = { counting_malloc, counting_realloc, counting_free, NULL };
+    FILE* f;
+
+    a.ctx = &pool;
+    value_init(&v);
+    value_init(&w);
+    f = fopen(path, "wb");
+    fputs("{\"a\":[1,2,3],\"b\":\"text\"}", f);
+    fclose(f);
+    EXPECT_EQ_INT(PARSE_OK, file_cache_parse(c, &v, path));
+    TEST_CACHE_STATS(c, 0, 1, 1);
+    EXPECT_EQ_INT(PARSE_OK, file_cache_parse(c, &w, path));
+    TEST_CACHE_STATS(c, 1, 1, 1);
+    EXPECT_EQ_INT(1, value_is_shared(&w));
+    EXPECT_EQ_INT(1, value_is_equal(&v, &w));
+
+    /* callers own copy-on-write views, the cached document is untouched */
+    set_value_null(array_element_mut(object_member_mut(&w, "a", 1), 0));
+    free_value(&w);
+    EXPECT_EQ_INT(PARSE_OK, file_cache_parse(c, &w, path));
+    EXPECT_EQ_INT(1, value_is_equal(&v, &w));
+    free_value(&w);
+
+    /* a changed file is parsed again */
+    f = fopen(path, "wb");
+    fputs("[true]", f);
+    fclose(f);
+    EXPECT_EQ_INT(PARSE_OK, file_cache_parse(c, &w, path));
+    EXPECT_EQ_INT(VALUE_ARRAY, get_value_type(&w));
+    TEST_CACHE_STATS(c, 2, 2, 1);
+    free_value(&w);
+    free_value(&v);
+    set_value_true(&w);
+    EXPECT_EQ_INT(CAN_NOT_OPEN_FILE, file_cache_parse(c, &w, "no_such_file.json"));
+    EXPECT_EQ_INT(VALUE_NULL, get_value_type(&w));
+    f = fopen(path2, "wb");
+    fputs("[tru]", f);
+    fclose(f);
+    EXPECT_EQ_INT(PARSE_INVALID_VALUE, file_cache_parse(c, &w, path2));
+    TEST_CACHE_STATS(c, 2, 3, 1);
+    file_cache_free(c);
+
+    /* with verify, identical content is a hit however the file was rewritten */
+    c = file_cache_create(1 << 20, 1);
+    EXPECT_EQ_INT(PARSE_OK, file_cache_parse(c, &v, path));
+    f = fopen(path, "wb");
+    fputs("[true]", f);
+    fclose(f);
+    EXPECT_EQ_INT(PARSE_OK, file_cache_parse(c, &w, path));
+    TEST_CACHE_STATS(c, 1, 1, 1);
+    free_value(&v);
+    free_value(&w);
+    file_cache_free(c);
+
+    /* the budget evicts least recently used documents */
+    f = fopen(path2, "wb");
+    fputs("[\"0123456789\",\"0123456789\"]", f);
+    fclose(f);
+    c = file_cache_create(300, 0);
+    EXPECT_EQ_INT(PARSE_OK, file_cache_parse(c, &v, path));
+    free_value(&v);
+    EXPECT_EQ_INT(PARSE_OK, file_cache_parse(c, &v, path2));
+    free_value(&v);
+    file_cache_get_stats(c, &stats);
+    EXPECT_EQ_SIZE_T(1, stats.evictions);
+    EXPECT_EQ_SIZE_T(1, stats.entries);
+    EXPECT_EQ_INT(1, stats.bytes <= 300);
+    EXPECT_EQ_INT(PARSE_OK, file_cache_parse(c, &v, path2));
+    free_value(&v);
+    TEST_CACHE_STATS(c, 1, 2, 1);
+    file_cache_free(c);
+
+    /* the cache keeps the allocator it was created under, whoever calls it later */
+    json_set_thread_allocator(&a);
+    c = file_cache_create(300, 0);
+    json_set_thread_allocator(NULL);
+    EXPECT_EQ_INT(PARSE_OK, file_cache_parse(c, &v, path));
+    free_value(&v);
+    EXPECT_EQ_INT(PARSE_OK, file_cache_parse(c, &v, path2));
+    free_value(&v);
+    file_cache_free(c);
+    EXPECT_EQ_INT(1, pool.allocs > 0);
+    EXPECT_EQ_SIZE_T(pool.allocs, pool.frees);
+    remove(path);
+    remove(path2);
+}
+
+void test_parse_many() {
+    static const char* const texts[] = { "[1,2,3]", "{\"k\":\"v\"}", "[tru]", "\"s\"", "1 2" };
+    static const parse_result expect[] = { PARSE_OK, PARSE_OK, PARSE_INVALID_VALUE, PARSE_OK, PARSE_ROOT_NOT_SINGULAR };
+    char names[16][24];
+    const char* paths[16];
+    json_value vals[16], w;
+    parse_result results[16];
+    counting_ctx pool = { 0, 0 };
+    json_allocator a = { counting_malloc, counting_realloc, counting_free, NULL };
+    size_t i, k, ok = 0;
+    unsigned threads;
+    FILE* f;
+
+    a.ctx = &pool;
+    for (i = 0; i < 16; i++) {
+        k = i % 6;
+        memcpy(names[i], "many_test_00.json", 18);
+        names[i][10] = (char)('0' + i / 10);
+        names[i][11] = (char)('0' + i % 10);
+        paths[i] = names[i];
+        if (k == 5) continue;  /* left missing */
+        f = fopen(names[i], "wb");
+        fputs(texts[k], f);
+        fclose(f);
+        ok += expect[k] == PARSE_OK;
+    }
+    for (threads = 0; threads <= 4; threads += 2) {
+        EXPECT_EQ_SIZE_T(ok, jsonfile_parse_many(paths, 16, vals, results, threads));
+        for (i = 0; i < 16; i++) {
+            if (i % 6 == 5) {
+                EXPECT_EQ_INT(CAN_NOT_OPEN_FILE, results[i]);
+                EXPECT_EQ_INT(VALUE_NULL, get_value_type(&vals[i]));
+            }
+            else {
+                EXPECT_EQ_INT(expect[i % 6], results[i]);
+                EXPECT_EQ_INT(results[i], jsonfile_parse(&w, paths[i]));
+                EXPECT_EQ_INT(1, value_is_equal(&vals[i], &w));
+                free_value(&w);
+            }
+            free_value(&vals[i]);
+        }
+    }
+    EXPECT_EQ_SIZE_T(0, jsonfile_parse_many(NULL, 0, NULL, NULL, 0));
+
+    /* 
+     * the workers allocate with the caller's allocator, so the values free cleanly under it.
+     * the documents are made big enough that the workers get a share before the caller is done
+     */
+    for (i = 0; i < 16; i++) {
+        if (i % 6 == 5 || expect[i % 6] != PARSE_OK) continue;
+        f = fopen(names[i], "wb");
+        fputc('[', f);
+        for (k = 0; k < 4000; k++) fputs(k == 0 ? "\"0123456789\"" : ",\"0123456789\"", f);
+        fputc(']', f);
+        fclose(f);
+    }
+    json_set_thread_allocator(&a);
+    for (k = 0; k < 4; k++) {
+        EXPECT_EQ_SIZE_T(ok, jsonfile_parse_many(paths, 16, vals, results, 4));
+        for (i = 0; i < 16; i++) free_value(&vals[i]);
+    }
+    json_set_thread_allocator(NULL);
+    EXPECT_EQ_INT(1, pool.allocs > 0);
+    EXPECT_EQ_SIZE_T(pool.allocs, pool.frees);
+    for (i = 0; i < 16; i++) remove(names[i]);
+}
+
+#define TEST_LAZY_ROUNDTRIP(json)\
+    do {\
+        json_value v;\
+        char* json2;\
+        size_t length;\
+        value_init(&v);\
+        EXPECT_EQ_INT(PARSE_OK, json_parse_ex(&v, json, &lazy));\
+        EXPECT_EQ_INT(STRINGIFY_OK, json_generate(&v, &json2, &length, 0));\
+        EXPECT_EQ_STRING(json, json2, length);\
+        free_value(&v);\
+        free(json2);\
+    } while(0)
+
+void test_lazy_number() {
+    json_parse_options lazy;
+    json_value v, w;
+    char* json;
+    size_t length;
+
+    memset(&lazy, 0, sizeof(lazy));
+    lazy.lazy_numbers = 1;
+
+    /* numbers are written back exactly as they were read */
+    TEST_LAZY_ROUNDTRIP("1.50");
+    TEST_LAZY_ROUNDTRIP("-0");
+    TEST_LAZY_ROUNDTRIP("1E+10");
+    TEST_LAZY_ROUNDTRIP("[0.1000000000000000055511151231257827,12345678901234567890,1e-10000]");
+    TEST_LAZY_ROUNDTRIP("{\"a\":1.0,\"b\":[2.50e3]}");
+
+    value_init(&v);
+    value_init(&w);
+    EXPECT_EQ_INT(PARSE_NUMBER_TOO_BIG, json_parse_ex(&v, "[1e309]", &lazy));
+    EXPECT_EQ_INT(PARSE_INVALID_VALUE, json_parse_ex(&v, "[1.]", &lazy));
+    EXPECT_EQ_INT(PARSE_ROOT_NOT_SINGULAR, json_parse_ex(&v, "1-2", &lazy));
+    EXPECT_EQ_INT(PARSE_OK, json_parse_ex(&v, "[1.50,2.5e0]", &lazy));
+    EXPECT_EQ_INT(VALUE_RAW_NUMBER, get_value_array_element(&v, 0)->flags);
+    EXPECT_EQ_DOUBLE(1.5, get_value_number(get_value_array_element(&v, 0)));
+    EXPECT_EQ_DOUBLE(1.5, get_value_number(get_value_array_element(&v, 0)));
+
+    /* equal, hashed and copied by value, shared like strings */
+    EXPECT_EQ_INT(PARSE_OK, json_parse(&w, "[1.5,2.5]"));
+    EXPECT_EQ_INT(1, value_is_equal(&v, &w));
+    EXPECT_EQ_INT(1, json_value_hash(&v, 0) == json_value_hash(&w, 0));
+    value_copy(&w, &v);
+    EXPECT_EQ_INT(1, value_is_equal(&v, &w));
+    EXPECT_EQ_INT(1, json_value_hash(&v, 1) == json_value_hash(&w, 0));
+    EXPECT_EQ_INT(1, value_is_shared(get_value_array_element(&v, 1)));
+    EXPECT_EQ_DOUBLE(2.5, get_value_number(get_value_array_element(&v, 1)));
+    set_value_number(array_element_mut(&w, 0), 4);
+    EXPECT_EQ_INT(STRINGIFY_OK, json_generate(&w, &json, &length, 0));
+    EXPECT_EQ_STRING("[4,2.5e0]", json, length);
+    free(json);
+    value_share(&w, &v);
+    free_value(&v);
+    EXPECT_EQ_INT(STRINGIFY_OK, json_generate(&w, &json, &length, 0));
+    EXPECT_EQ_STRING("[1.50,2.5e0]", json, length);
+    free(json);
+    EXPECT_EQ_INT(STRINGIFY_OK, json_canonical_generate(&w, &json, &length));
+    EXPECT_EQ_STRING("[1.5,2.5]", json, length);
+    free(json);
+    free_value(&w);
+}
+
+int test_raw_keys(void* ctx, const char* key, size_t key_length, size_t depth) {
+    (void)ctx;
+    if (key == NULL) return depth == 2;  /* elements of a top-level array member */
+    return key_length == 7 && memcmp(key, "payload", 7) == 0;
+}
+
+void test_raw() {
+    json_parse_options opt;
+    json_value v, w, *e;
+    char* json;
+    size_t length;
+
+    memset(&opt, 0, sizeof(opt));
+    opt.raw = test_raw_keys;
+
+    value_init(&v);
+    value_init(&w);
+    EXPECT_EQ_INT(PARSE_OK, set_value_raw(&v, " {\"a\": [1, 2]}\n", 15));
+    EXPECT_EQ_INT(VALUE_RAW, get_value_type(&v));
+    EXPECT_EQ_STRING("{\"a\": [1, 2]}", get_value_raw(&v), get_value_raw_length(&v));
+    EXPECT_EQ_INT(PARSE_MISS_COMMA_OR_SQUARE_BRACKET, set_value_raw(&v, "[1 2]", 5));
+    EXPECT_EQ_INT(PARSE_ROOT_NOT_SINGULAR, set_value_raw(&v, "1 2", 3));
+    EXPECT_EQ_INT(VALUE_RAW, get_value_type(&v));
+
+    /* spliced into a document and written out verbatim */
+    set_value_object(&w, 0);
+    value_move(object_emplace(&w, "cached", 6), &v);
+    set_value_number(object_emplace(&w, "n", 1), 1);
+    EXPECT_EQ_INT(STRINGIFY_OK, json_generate(&w, &json, &length, 0));
+    EXPECT_EQ_STRING("{\"cached\":{\"a\": [1, 2]},\"n\":1}", json, length);
+    free(json);
+    EXPECT_EQ_INT(STRINGIFY_OK, json_canonical_generate(&w, &json, &length));
+    EXPECT_EQ_STRING("{\"cached\":{\"a\":[1,2]},\"n\":1}", json, length);
+    free(json);
+    value_copy(&v, &w);
+    EXPECT_EQ_INT(1, value_is_equal(&v, &w));
+    EXPECT_EQ_INT(1, json_value_hash(&v, 1) == json_value_hash(&w, 0));
+    free_value(&v);
+    free_value(&w);
+
+    /* chosen subtrees are captured as text while parsing */
+    EXPECT_EQ_INT(PARSE_OK, json_parse_ex(&v, "{\"id\":1,\"payload\":{ \"x\" : [true] },\"list\":[ [1,2] ,\"s\"],\"o\":{\"payload\":null}}", &opt));
+    e = object_member_mut(&v, "payload", 7);
+    EXPECT_EQ_INT(VALUE_RAW, get_value_type(e));
+    EXPECT_EQ_STRING("{ \"x\" : [true] }", get_value_raw(e), get_value_raw_length(e));
+    e = get_value_array_element(object_member_mut(&v, "list", 4), 0);
+    EXPECT_EQ_STRING("[1,2]", get_value_raw(e), get_value_raw_length(e));
+    EXPECT_EQ_INT(VALUE_RAW, get_value_type(get_value_array_element(object_member_mut(&v, "list", 4), 1)));
+    EXPECT_EQ_INT(VALUE_RAW, get_value_type(object_member_mut(object_member_mut(&v, "o", 1), "payload", 7)));
+    EXPECT_EQ_INT(VALUE_NUMBER, get_value_type(object_member_mut(&v, "id", 2)));
+    EXPECT_EQ_INT(STRINGIFY_OK, json_generate(&v, &json, &length, 0));
+    EXPECT_EQ_STRING("{\"id\":1,\"payload\":{ \"x\" : [true] },\"list\":[[1,2],\"s\"],\"o\":{\"payload\":null}}", json, length);
+    free(json);
+    free_value(&v);
+    EXPECT_EQ_INT(PARSE_MISS_QUOTATION_MARK, json_parse_ex(&v, "{\"payload\":[\"x]}", &opt));
+    EXPECT_EQ_INT(PARSE_EXPECT_VALUR, json_parse_ex(&v, "{\"payload\":", &opt));
+    EXPECT_EQ_INT(VALUE_NULL, get_value_type(&v));
+}
+
+void test_compact() {
+    static const char doc[] = "{\"name\":\"state\",\"items\":[1,\"two\",[3,{\"k\":null}],{}],\"map\":{\"b\":true,\"a\":[],\"c\":\"x\"}}";
+    json_parse_options lazy;
+    json_value v, w, u;
+    char* json;
+    size_t length;
+    int i;
+
+    memset(&lazy, 0, sizeof(lazy));
+    lazy.lazy_numbers = 1;
+
+    value_init(&v);
+    value_init(&w);
+    value_init(&u);
+    EXPECT_EQ_INT(PARSE_OK, json_parse(&v, doc));
+    for (i = 0; i < 20; i++) array_push_back(object_member_mut(&v, "items", 5), object_member_mut(&v, "name", 4));
+    for (i = 0; i < 20; i++) free_value(array_pop_back(object_member_mut(&v, "items", 5)));
+    json_value_compact(&v);
+    EXPECT_EQ_INT(VALUE_SHARED | VALUE_COMPACT, v.flags);
+    EXPECT_EQ_SIZE_T(4, get_value_array_capacity(object_member_mut(&v, "items", 5)));
+    EXPECT_EQ_INT(STRINGIFY_OK, json_generate(&v, &json, &length, 0));
+    EXPECT_EQ_STRING(doc, json, length);
+    free(json);
+    EXPECT_EQ_INT(1, object_find_member(object_member_mut(&v, "map", 3), "c", 1));
+    EXPECT_EQ_INT(PARSE_OK, json_parse(&w, doc));
+    EXPECT_EQ_INT(1, value_is_equal(&v, &w));
+    free_value(&w);
+
+    /* a mutation copies its level out, a value taken out keeps the block alive */
+    value_copy(&w, object_member_mut(&v, "items", 5));
+    set_value_string(object_member_mut(&v, "name", 4), "changed", 7);
+    array_push_back(object_member_mut(&v, "items", 5), get_value_array_element(&w, 1));
+    object_emplace(object_member_mut(&v, "map", 3), "d", 1);
+    remove_member(object_member_mut(&v, "map", 3), "b", 1);
+    EXPECT_EQ_INT(0, value_is_shared(&v));
+    EXPECT_EQ_INT(STRINGIFY_OK, json_generate(&v, &json, &length, 0));
+    EXPECT_EQ_STRING("{\"name\":\"changed\",\"items\":[1,\"two\",[3,{\"k\":null}],{},\"two\"],\"map\":{\"a\":[],\"c\":\"x\",\"d\":null}}", json, length);
+    free(json);
+    json_value_compact(&v);
+    EXPECT_EQ_INT(1, object_find_member(object_member_mut(&v, "map", 3), "a", 1));
+    EXPECT_EQ_INT(0, object_find_member(object_member_mut(&v, "map", 3), "b", 1));
+    free_value(&v);
+    EXPECT_EQ_INT(STRINGIFY_OK, json_generate(&w, &json, &length, 0));
+    EXPECT_EQ_STRING("[1,\"two\",[3,{\"k\":null}],{}]", json, length);
+    free(json);
+
+    /* shared payloads are copied, the other owner is left as it was */
+    value_share(&u, &w);
+    json_value_compact(&w);
+    EXPECT_EQ_INT(1, value_is_equal(&u, &w));
+    free_value(&w);
+    free_value(&u);
+
+    /* scalars, empty containers and raw numbers */
+    EXPECT_EQ_INT(PARSE_OK, json_parse_ex(&v, "[1.50,[],\"\",2]", &lazy));
+    json_value_compact(&v);
+    EXPECT_EQ_INT(STRINGIFY_OK, json_generate(&v, &json, &length, 0));
+    EXPECT_EQ_STRING("[1.50,[],\"\",2]", json, length);
+    free(json);
+    EXPECT_EQ_DOUBLE(1.5, get_value_number(get_value_array_element(&v, 0)));
+    free_value(&v);
+    set_value_number(&v, 1);
+    json_value_compact(&v);
+    EXPECT_EQ_INT(0, v.flags);
+}
+
+void test_member_index() {
+    static const char* const keys[] = { "", "a", "a\0", "ab", "abcdefgh", "abcdefghi", "abcdefgh\0", "abcdefghij", "abcdefgg", "b", "\xff", "abcdefghia" };
+    static const size_t lens[] = { 0, 1, 2, 2, 8, 9, 9, 10, 8, 1, 1, 10 };
+    const size_t n = sizeof(lens) / sizeof(lens[0]);
+    json_value v, w;
+    size_t i, j;
+    char* json;
+    size_t length;
+
+    EXPECT_EQ_SIZE_T(sizeof(void*) == 8 ? 64 : sizeof(json_member), sizeof(json_member));
+    value_init(&v);
+    value_init(&w);
+    set_value_object(&v, 0);
+    for (i = 0; i < n; i++) set_value_number(object_emplace(&v, keys[i], lens[i]), (double)i);
+    for (i = 0; i < n; i++) {
+        json_member* m = search_member(v.obj.members, keys[i], lens[i]);
+        EXPECT_EQ_INT(1, m != NULL);
+        if (m != NULL) EXPECT_EQ_DOUBLE((double)i, get_value_number(get_member_value(m)));
+    }
+    EXPECT_EQ_INT(0, object_find_member(&v, "abcdefgi", 8));
+    EXPECT_EQ_INT(0, object_find_member(&v, "abcdefghib", 10));
+    EXPECT_EQ_INT(0, object_find_member(&v, "a\0\0", 3));
+
+    /* the index survives relocation and removal, and is sorted for canonical output */
+    reverse_value_object(&v, 64);
+    remove_member(&v, "abcdefgh", 8);
+    EXPECT_EQ_INT(0, object_find_member(&v, "abcdefgh", 8));
+    for (i = 0; i < n; i++) if (i != 4) EXPECT_EQ_INT(1, object_find_member(&v, keys[i], lens[i]));
+    set_value_object(&w, 0);
+    for (j = n; j-- > 0;) if (j != 4) set_value_number(object_emplace(&w, keys[j], lens[j]), (double)j);
+    EXPECT_EQ_INT(1, value_is_equal(&v, &w));
+    set_value_number(object_member_mut(&w, "abcdefghij", 10), -1);
+    EXPECT_EQ_INT(0, value_is_equal(&v, &w));
+    free_value(&w);
+    EXPECT_EQ_INT(PARSE_OK, json_parse(&w, "{\"kb\":1,\"ka\":2,\"k\":3,\"key_number_b\":4,\"key_number_a\":5}"));
+    EXPECT_EQ_INT(STRINGIFY_OK, json_canonical_generate(&w, &json, &length));
+    EXPECT_EQ_STRING("{\"k\":3,\"ka\":2,\"kb\":1,\"key_number_a\":5,\"key_number_b\":4}", json, length);
+    free(json);
+    free_value(&w);
+
+    /* the first of repeated keys is the one found, however the index was rebalanced */
+    EXPECT_EQ_INT(PARSE_OK, json_parse(&w, "{\"a\":1,\"b\":2,\"a\":3,\"c\":4,\"a\":5,\"a\":6,\"d\":7,\"e\":8,\"f\":9}"));
+    EXPECT_EQ_DOUBLE(1.0, get_value_number(object_member_mut(&w, "a", 1)));
+    free_value(&w);
+    free_value(&v);
+}
+
+static void write_test_file(const char* path, const char* text) {
+    FILE* f = fopen(path, "wb");
+    fputs(text, f);
+    fclose(f);
+}
+
+static size_t cursor_count(const char* path, const char* pointer, parse_result* err) {
+    FILE* f = fopen(path, "rb");
+    json_cursor* cur = json_cursor_open_path(f, pointer);
+    json_value v;
+    size_t n = 0;
+    value_init(&v);
+    while (json_cursor_next(cur, &v)) n++;
+    *err = json_cursor_error(cur);
+    json_cursor_close(cur);
+    fclose(f);
+    return n;
+}
+
+void test_cursor() {
+    const char* path = "cursor_test.json";
+    json_value v;
+    json_cursor* cur;
+    FILE* f;
+    parse_result err;
+    char* json;
+    char* big;
+    size_t i, length, good = 0, n = 20000, big_len = 150000;
+
+    /* an array spanning many blocks, with one string longer than a block */
+    big = (char*)malloc(big_len + 1);
+    memset(big, 'x', big_len);
+    big[big_len] = '\0';
+    f = fopen(path, "wb");
+    fputs(" [\n", f);
+    for (i = 0; i < n; i++) {
+        if (i == n / 2) fprintf(f, "\"%s\\n\",", big);
+        fprintf(f, "{\"id\":%u,\"tags\":[\"a\\\"]\",\"}\"],\"n\":null}%s", (unsigned)i, i + 1 < n ? " ,\n" : "");
+    }
+    fputs("]\n", f);
+    fclose(f);
+    f = fopen(path, "rb");
+    cur = json_cursor_open(f);
+    value_init(&v);
+    for (i = 0; json_cursor_next(cur, &v); i++) {
+        if (i == n / 2) {
+            EXPECT_EQ_INT(VALUE_STRING, get_value_type(&v));
+            EXPECT_EQ_SIZE_T(big_len + 1, get_value_string_length(&v));
+            continue;
+        }
+        if (get_value_type(&v) == VALUE_OBJECT && get_value_number(object_member_mut(&v, "id", 2)) == (double)(i > n / 2 ? i - 1 : i)) good++;
+    }
+    EXPECT_EQ_SIZE_T(n + 1, i);
+    EXPECT_EQ_SIZE_T(n, good);
+    EXPECT_EQ_INT(PARSE_OK, json_cursor_error(cur));
+    EXPECT_EQ_INT(VALUE_NULL, get_value_type(&v));
+    EXPECT_EQ_INT(0, json_cursor_next(cur, &v));
+    json_cursor_close(cur);
+    fclose(f);
+    free(big);
+
+    /* values at a path, with the members before it skipped */
+    write_test_file(path, "{\"meta\":{\"items\":[0],\"s\":\"]}\"},\"data\":{\"x\":[1,{}],\"items\":[[1,2],\"a\",3.5,{\"k\":[]}]},\"tail\":}");
+    f = fopen(path, "rb");
+    cur = json_cursor_open_path(f, "/data/items");
+    value_init(&v);
+    EXPECT_EQ_INT(1, json_cursor_next(cur, &v));
+    EXPECT_EQ_INT(STRINGIFY_OK, json_generate(&v, &json, &length, 0));
+    EXPECT_EQ_STRING("[1,2]", json, length);
+    free(json);
+    EXPECT_EQ_INT(1, json_cursor_next(cur, &v));
+    EXPECT_EQ_STRING("a", get_value_string(&v), get_value_string_length(&v));
+    EXPECT_EQ_INT(1, json_cursor_next(cur, &v));
+    EXPECT_EQ_DOUBLE(3.5, get_value_number(&v));
+    EXPECT_EQ_INT(1, json_cursor_next(cur, &v));
+    EXPECT_EQ_INT(STRINGIFY_OK, json_generate(&v, &json, &length, 0));
+    EXPECT_EQ_STRING("{\"k\":[]}", json, length);
+    free(json);
+    EXPECT_EQ_INT(0, json_cursor_next(cur, &v));
+    EXPECT_EQ_INT(PARSE_OK, json_cursor_error(cur));
+    json_cursor_close(cur);
+    fclose(f);
+    EXPECT_EQ_SIZE_T(1, cursor_count(path, "/data/items/3", &err));
+    EXPECT_EQ_INT(PARSE_OK, err);
+    EXPECT_EQ_SIZE_T(2, cursor_count(path, "/data/items/0", &err));
+    EXPECT_EQ_INT(PARSE_OK, err);
+    EXPECT_EQ_SIZE_T(0, cursor_count(path, "/data/items/4", &err));
+    EXPECT_EQ_INT(PARSE_PATH_NOT_FOUND, err);
+    EXPECT_EQ_SIZE_T(0, cursor_count(path, "/data/nope", &err));
+    EXPECT_EQ_INT(PARSE_PATH_NOT_FOUND, err);
+    EXPECT_EQ_SIZE_T(0, cursor_count(path, "/meta/s/0", &err));
+    EXPECT_EQ_INT(PARSE_PATH_NOT_FOUND, err);
+    EXPECT_EQ_SIZE_T(0, cursor_count(path, "/tail", &err));
+    EXPECT_EQ_INT(PARSE_INVALID_VALUE, err);
+
+    /* an index too large for size_t is missing, it doesn't wrap around to a small one */
+    write_test_file(path, "[10,11,12,13,14,15]");
+    EXPECT_EQ_SIZE_T(1, cursor_count(path, "/5", &err));
+    EXPECT_EQ_INT(PARSE_OK, err);
+    EXPECT_EQ_SIZE_T(0, cursor_count(path, "/18446744073709551621", &err));
+    EXPECT_EQ_INT(PARSE_PATH_NOT_FOUND, err);
+    EXPECT_EQ_SIZE_T(0, cursor_count(path, "/184467440737095516150000000000000000000005", &err));
+    EXPECT_EQ_INT(PARSE_PATH_NOT_FOUND, err);
+
+    /* a value that isn't an array is the only element */
+    write_test_file(path, " \"abc\" \n");
+    EXPECT_EQ_SIZE_T(1, cursor_count(path, "", &err));
+    EXPECT_EQ_INT(PARSE_OK, err);
+    write_test_file(path, "[]");
+    EXPECT_EQ_SIZE_T(0, cursor_count(path, "", &err));
+    EXPECT_EQ_INT(PARSE_OK, err);
+
+    /* errors stop the cursor after the good elements */
+    write_test_file(path, "[1,2 3]");
+    EXPECT_EQ_SIZE_T(2, cursor_count(path, "", &err));
+    EXPECT_EQ_INT(PARSE_MISS_COMMA_OR_SQUARE_BRACKET, err);
+    write_test_file(path, "[1,[2,]]");
+    EXPECT_EQ_SIZE_T(1, cursor_count(path, "", &err));
+    EXPECT_EQ_INT(PARSE_INVALID_VALUE, err);
+    write_test_file(path, "[1,2");
+    EXPECT_EQ_SIZE_T(2, cursor_count(path, "", &err));
+    EXPECT_EQ_INT(PARSE_MISS_COMMA_OR_SQUARE_BRACKET, err);
+    write_test_file(path, "[1,");
+    EXPECT_EQ_SIZE_T(1, cursor_count(path, "", &err));
+    EXPECT_EQ_INT(PARSE_EXPECT_VALUR, err);
+    write_test_file(path, "[1] x");
+    EXPECT_EQ_SIZE_T(1, cursor_count(path, "", &err));
+    EXPECT_EQ_INT(PARSE_ROOT_NOT_SINGULAR, err);
+    write_test_file(path, "");
+    EXPECT_EQ_SIZE_T(0, cursor_count(path, "", &err));
+    EXPECT_EQ_INT(PARSE_EXPECT_VALUR, err);
+
+    /* members skipped on the way to the path are bounded in depth too */
+    f = fopen(path, "wb");
+    fputs("{\"skip\":", f);
+    for (i = 0; i < 100000; i++) fputc('[', f);
+    fputs("}", f);
+    fclose(f);
+    EXPECT_EQ_SIZE_T(0, cursor_count(path, "/data", &err));
+    EXPECT_EQ_INT(PARSE_TOO_DEEP, err);
+    remove(path);
+}
+
+static int test_raw_all(void* ctx, const char* key, size_t key_length, size_t depth) {
+    (void)ctx; (void)key; (void)key_length; (void)depth;
+    return 1;
+}
+
+#define TEST_LIMIT(error, json)\
+    do {\
+        json_value v;\
+        value_init(&v);\
+        EXPECT_EQ_INT(error, json_parse_ex(&v, (json), &opt));\
+        if ((error) != PARSE_OK) EXPECT_EQ_INT(VALUE_NULL, get_value_type(&v));\
+        free_value(&v);\
+    } while(0)
+
+void test_limits() {
+    json_parse_limits limits;
+    json_parse_options opt;
+    char deep[100001];
+    size_t i;
+
+    memset(&limits, 0, sizeof(limits));
+    memset(&opt, 0, sizeof(opt));
+    opt.limits = &limits;
+
+    limits.max_depth = 3;
+    TEST_LIMIT(PARSE_OK, "[[[]],{\"a\":[1]}]");
+    TEST_LIMIT(PARSE_TOO_DEEP, "[[[[]]]]");
+    TEST_LIMIT(PARSE_TOO_DEEP, "{\"a\":{\"b\":[{}]}}");
+    for (i = 0; i < 100000; i++) deep[i] = '[';
+    deep[100000] = '\0';
+    TEST_LIMIT(PARSE_TOO_DEEP, deep);
+    opt.raw = test_raw_all;  /* captured text counts as parsed */
+    TEST_LIMIT(PARSE_OK, "[[[]],{\"a\":[1]}]");
+    TEST_LIMIT(PARSE_TOO_DEEP, "[[[[]]]]");
+    TEST_LIMIT(PARSE_TOO_DEEP, "{\"a\":{\"b\":[{}]}}");
+    TEST_LIMIT(PARSE_TOO_DEEP, deep);
+    opt.raw = NULL;
+    limits.max_depth = 0;
+
+    limits.max_bytes = 8;
+    TEST_LIMIT(PARSE_OK, "[1,2,34]");
+    TEST_LIMIT(PARSE_TOO_LARGE, "[1,2,345]");
+    TEST_LIMIT(PARSE_TOO_LARGE, deep);
+    limits.max_bytes = 0;
+
+    limits.max_string_length = 3;
+    TEST_LIMIT(PARSE_OK, "[\"abc\",\"\\u00e9\\n\",{\"key\":\"\"}]");
+    TEST_LIMIT(PARSE_STRING_TOO_LONG, "\"abcd\"");
+    TEST_LIMIT(PARSE_STRING_TOO_LONG, "\"ab\\u00e9\"");
+    TEST_LIMIT(PARSE_STRING_TOO_LONG, "{\"keys\":1}");
+    TEST_LIMIT(PARSE_STRING_TOO_LONG, "[1,\"abcdefgh");
+    limits.max_string_length = 0;
+
+    limits.max_elements = 2;
+    TEST_LIMIT(PARSE_OK, "[[1,2],{\"a\":1,\"b\":[3,4]}]");
+    TEST_LIMIT(PARSE_TOO_MANY_ELEMENTS, "[1,2,3]");
+    TEST_LIMIT(PARSE_TOO_MANY_ELEMENTS, "{\"a\":\"x\",\"b\":2,\"c\":3}");
+    TEST_LIMIT(PARSE_TOO_MANY_ELEMENTS, "[[1,2,3");
+    limits.max_elements = 0;
+
+    limits.max_nodes = 4;
+    TEST_LIMIT(PARSE_OK, "[1,{\"a\":2}]");
+    TEST_LIMIT(PARSE_TOO_MANY_NODES, "[1,[2,3]]");
+    TEST_LIMIT(PARSE_TOO_MANY_NODES, "{\"a\":\"x\",\"b\":{\"c\":[null]}}");
+    limits.max_nodes = 0;
+
+    /* all off is the plain parser, failed objects free the keys they took once */
+    TEST_LIMIT(PARSE_OK, "[[[[\"abcdefgh\",1,2,3]]]]");
+    TEST_LIMIT(PARSE_MISS_MEMBER_KEY, "{\"a\":1,1}");
+    TEST_LIMIT(PARSE_MISS_MEMBER_KEY, "{\"a\":1,\"b\":[2],}");
+}
+
+/* lookup that only reads, as any thread may on a frozen tree */
+static json_value* member_of(const json_value* v, const char* key) {
+    return get_member_value(search_member(v->obj.members, key, strlen(key)));
+}
+
+#ifdef TEST_THREADS
+#define RCU_READS 20000
+#define RCU_SWAPS 500
+
+/* version i is {"v":i,"a":[i,...]}, a reader seeing mixed numbers saw a torn or freed document */
+static void rcu_version(json_value* v, int i) {
+    json_parse_options lazy;
+    char buf[1024];
+    int k, o = sprintf(buf, "{\"v\":%d,\"a\":[", i);
+    memset(&lazy, 0, sizeof(lazy));
+    lazy.lazy_numbers = 1;
+    for (k = 0; k < 64; k++) o += sprintf(buf + o, "%d%s", i, k < 63 ? "," : "]}");
+    value_init(v);
+    json_parse_ex(v, buf, &lazy);
+}
+
+static void* rcu_reader(void* arg) {
+    json_rcu* rcu = (json_rcu*)arg;
+    json_value kept;
+    long ticket, i, torn = 0;
+    size_t k;
+    value_init(&kept);
+    for (i = 0; i < RCU_READS; i++) {
+        const json_value* doc = json_rcu_read_lock(rcu, &ticket);
+        const json_value* a = member_of(doc, "a");
+        double v = get_value_number(member_of(doc, "v"));
+        for (k = 0; k < get_value_array_size(a); k++) torn += get_value_number(get_value_array_element(a, k)) != v;
+        if (i % 64 == 0) value_copy(&kept, a);  /* outlives the unlock */
+        json_rcu_read_unlock(rcu, ticket);
+        if (i % 64 == 0) {
+            torn += get_value_array_size(&kept) != 64 || get_value_number(get_value_array_element(&kept, 63)) != get_value_number(get_value_array_element(&kept, 0));
+            free_value(&kept);
+        }
+    }
+    return (void*)torn;
+}
+#endif
+
+void test_freeze() {
+    json_parse_options lazy;
+    json_value v, w, doc;
+    json_rcu rcu;
+    const json_value* cur;
+    long ticket;
+    char* json;
+    size_t length;
+
+    memset(&lazy, 0, sizeof(lazy));
+    lazy.lazy_numbers = 1;
+    EXPECT_EQ_INT(PARSE_OK, json_parse_ex(&v, "{\"name\":\"a\",\"list\":[1.5,{\"k\":2e1}],\"n\":null}", &lazy));
+    json_freeze(&v);
+    EXPECT_EQ_INT(1, value_is_frozen(&v));
+    EXPECT_EQ_INT(1, value_is_frozen(get_value_array_element(member_of(&v, "list"), 1)));
+    EXPECT_EQ_DOUBLE(20.0, get_value_number(member_of(get_value_array_element(member_of(&v, "list"), 1), "k")));
+    json_freeze(&v);
+    EXPECT_EQ_INT(1, value_is_frozen(&v));
+
+    /* a copy is mutable and leaves the frozen tree alone */
+    value_init(&w);
+    value_copy(&w, &v);
+    EXPECT_EQ_INT(0, value_is_frozen(&w));
+    set_value_string(array_element_mut(object_member_mut(&w, "list", 4), 0), "x", 1);
+    set_value_true(object_member_mut(array_element_mut(object_member_mut(&w, "list", 4), 1), "k", 1));
+    EXPECT_EQ_INT(STRINGIFY_OK, json_generate(&v, &json, &length, 0));
+    EXPECT_EQ_STRING("{\"name\":\"a\",\"list\":[1.5,{\"k\":2e1}],\"n\":null}", json, length);
+    free(json);
+    EXPECT_EQ_INT(STRINGIFY_OK, json_generate(&w, &json, &length, 0));
+    EXPECT_EQ_STRING("{\"name\":\"a\",\"list\":[\"x\",{\"k\":true}],\"n\":null}", json, length);
+    free(json);
+    EXPECT_EQ_INT(0, value_is_equal(&v, &w));
+
+    /* publishing: the old document outlives a swap as long as a copy of it is held */
+    json_rcu_init(&rcu, &v);
+    EXPECT_EQ_INT(VALUE_NULL, get_value_type(&v));
+    cur = json_rcu_read_lock(&rcu, &ticket);
+    EXPECT_EQ_INT(1, value_is_frozen(cur));
+    EXPECT_EQ_STRING("a", get_value_string(member_of(cur, "name")), 1);
+    value_copy(&v, cur);
+    json_rcu_read_unlock(&rcu, ticket);
+    json_rcu_swap(&rcu, &w);
+    EXPECT_EQ_INT(VALUE_NULL, get_value_type(&w));
+    cur = json_rcu_read_lock(&rcu, &ticket);
+    EXPECT_EQ_INT(VALUE_TRUE, get_value_type(member_of(get_value_array_element(member_of(cur, "list"), 1), "k")));
+    json_rcu_read_unlock(&rcu, ticket);
+    EXPECT_EQ_INT(VALUE_NUMBER, get_value_type(get_value_array_element(member_of(&v, "list"), 0)));
+    value_init(&doc);
+    set_value_number(&doc, 1);
+    json_rcu_swap(&rcu, &doc);
+    cur = json_rcu_read_lock(&rcu, &ticket);
+    EXPECT_EQ_DOUBLE(1.0, get_value_number(cur));
+    json_rcu_read_unlock(&rcu, ticket);
+    json_rcu_destroy(&rcu);
+    free_value(&v);
+
+#ifdef TEST_THREADS
+    /* readers on other threads while documents are swapped under them */
+    {
+        pthread_t readers[4];
+        void* torn;
+        int i;
+        rcu_version(&doc, 0);
+        json_rcu_init(&rcu, &doc);
+        for (i = 0; i < 4; i++) EXPECT_EQ_INT(0, pthread_create(&readers[i], NULL, rcu_reader, &rcu));
+        for (i = 1; i <= RCU_SWAPS; i++) {
+            rcu_version(&doc, i);
+            json_rcu_swap(&rcu, &doc);
+        }
+        for (i = 0; i < 4; i++) {
+            EXPECT_EQ_INT(0, pthread_join(readers[i], &torn));
+            EXPECT_EQ_INT(1, torn == NULL);
+        }
+        cur = json_rcu_read_lock(&rcu, &ticket);
+        EXPECT_EQ_DOUBLE((double)RCU_SWAPS, get_value_number(member_of(cur, "v")));
+        json_rcu_read_unlock(&rcu, ticket);
+        json_rcu_destroy(&rcu);
+    }
+#endif
+}
+
+void test_key() {
+    json_key id, name, longer, missing, empty;
+    json_value v, w;
+    size_t i;
+
+    json_key_init(&id, "id", 2);
+    json_key_init(&name, "name", 4);
+    json_key_init(&longer, "identifier_long", 15);
+    json_key_init(&missing, "identifier_lonG", 15);
+    json_key_init(&empty, "", 0);
+    EXPECT_EQ_INT(PARSE_OK, json_parse(&v, "[{\"name\":\"a\",\"id\":1,\"identifier_long\":true},{\"name\":\"b\",\"id\":2,\"identifier_long\":false},"
+        "{\"id\":3,\"x\":0},{\"\":4,\"idx\":5,\"i\":6},{}]"));
+    for (i = 0; i < 3; i++) {
+        EXPECT_EQ_DOUBLE((double)(i + 1), get_value_number(object_member_key(get_value_array_element(&v, i), &id)));
+        EXPECT_EQ_INT(i < 2, object_find_key(get_value_array_element(&v, i), &name));
+        EXPECT_EQ_INT(i < 2, object_find_key(get_value_array_element(&v, i), &longer));
+        EXPECT_EQ_INT(0, object_find_key(get_value_array_element(&v, i), &missing));
+    }
+    /* a stale slot holding another key falls back to the index */
+    EXPECT_EQ_SIZE_T(0, id.slot);
+    EXPECT_EQ_INT(1, object_member_key(get_value_array_element(&v, 3), &id) == NULL);
+    EXPECT_EQ_DOUBLE(4.0, get_value_number(object_member_key(get_value_array_element(&v, 3), &empty)));
+    EXPECT_EQ_INT(1, object_member_key(get_value_array_element(&v, 4), &id) == NULL);
+    EXPECT_EQ_DOUBLE(1.0, get_value_number(object_member_key(get_value_array_element(&v, 0), &id)));
+    EXPECT_EQ_SIZE_T(1, id.slot);
+
+    /* same answers as a plain lookup after removal and compaction */
+    value_init(&w);
+    value_copy(&w, get_value_array_element(&v, 1));
+    remove_member(&w, "name", 4);
+    json_value_compact(&w);
+    EXPECT_EQ_INT(0, object_find_key(&w, &name));
+    EXPECT_EQ_INT(1, object_find_key(&w, &longer));
+    EXPECT_EQ_INT(VALUE_FALSE, get_value_type(object_member_key(&w, &longer)));
+    EXPECT_EQ_DOUBLE(2.0, get_value_number(object_member_key(&w, &id)));
+    free_value(&w);
+    free_value(&v);
+}
+
+static const char* member_key_at(const json_value* v, size_t i) {
+    size_t len;
+    return get_member_key(get_value_object_member(v, i), &len);
+}
+
+void test_shape() {
+    json_value v, w, c;
+    json_cursor* cur;
+    FILE* f;
+    char* json;
+    size_t i, length;
+
+    /* from the second sibling on, objects with the same keys share them and their index */
+    EXPECT_EQ_INT(PARSE_OK, json_parse(&v, "[{\"id\":1,\"ts\":2,\"type\":\"a\"},{\"id\":3, \"ts\" :4,\"type\":\"b\"},{\"id\":5,\"ts\":6,\"type\":\"c\"}]"));
+    for (i = 0; i < 3; i++) {
+        json_value* e = get_value_array_element(&v, i);
+        EXPECT_EQ_INT(i > 0 ? VALUE_SHAPED : 0, e->flags & VALUE_SHAPED);
+        EXPECT_EQ_INT(i > 0, member_key_at(e, 1) == member_key_at(get_value_array_element(&v, 1), 1));
+        EXPECT_EQ_DOUBLE((double)(2 * i + 2), get_value_number(member_of(e, "ts")));
+        EXPECT_EQ_INT(1, object_find_member(e, "type", 4));
+        EXPECT_EQ_INT(0, object_find_member(e, "id2", 3));
+    }
+
+    /* mutation gives an object its own keys, copies and sharing keep working */
+    value_init(&w);
+    value_init(&c);
+    value_copy(&w, get_value_array_element(&v, 1));
+    EXPECT_EQ_INT(0, w.flags & VALUE_SHAPED);
+    value_share(&c, get_value_array_element(&v, 2));
+    set_value_true(object_emplace(get_value_array_element(&v, 1), "extra", 5));
+    remove_member(get_value_array_element(&v, 2), "id", 2);
+    set_value_null(object_member_mut(&c, "type", 4));
+    EXPECT_EQ_INT(0, get_value_array_element(&v, 1)->flags & VALUE_SHAPED);
+    EXPECT_EQ_INT(STRINGIFY_OK, json_generate(&v, &json, &length, 0));
+    EXPECT_EQ_STRING("[{\"id\":1,\"ts\":2,\"type\":\"a\"},{\"id\":3,\"ts\":4,\"type\":\"b\",\"extra\":true},{\"ts\":6,\"type\":\"c\"}]", json, length);
+    free(json);
+    json_value_compact(&v);
+    EXPECT_EQ_INT(1, object_find_member(get_value_array_element(&v, 0), "id", 2));
+    free_value(&v);
+    EXPECT_EQ_DOUBLE(3.0, get_value_number(member_of(&w, "id")));
+    EXPECT_EQ_INT(VALUE_NULL, get_value_type(member_of(&c, "type")));
+    EXPECT_EQ_DOUBLE(5.0, get_value_number(member_of(&c, "id")));
+    free_value(&w);
+    free_value(&c);
+
+    /* diverging siblings fall back to keys of their own and are still right */
+    EXPECT_EQ_INT(PARSE_OK, json_parse(&v, "[{\"a\":1,\"b\":2},{\"a\":1},{\"a\":1,\"b\":2,\"c\":3},{\"b\":2,\"a\":1},{\"a\\u0062\":1},"
+        "{\"ab\":1,\"b\":2},{\"\":0},{\"\":0},7,[{\"a\":1}],{\"a\":{\"a\":1,\"b\":2},\"b\":[{\"a\":1,\"b\":2}]}]"));
+    EXPECT_EQ_INT(STRINGIFY_OK, json_generate(&v, &json, &length, 0));
+    EXPECT_EQ_STRING("[{\"a\":1,\"b\":2},{\"a\":1},{\"a\":1,\"b\":2,\"c\":3},{\"b\":2,\"a\":1},{\"ab\":1},"
+        "{\"ab\":1,\"b\":2},{\"\":0},{\"\":0},7,[{\"a\":1}],{\"a\":{\"a\":1,\"b\":2},\"b\":[{\"a\":1,\"b\":2}]}]", json, length);
+    EXPECT_EQ_INT(PARSE_OK, json_parse(&w, json));
+    free(json);
+    EXPECT_EQ_INT(1, value_is_equal(&v, &w));
+    EXPECT_EQ_INT(1, object_find_member(get_value_array_element(&v, 3), "b", 1));
+    EXPECT_EQ_INT(0, object_find_member(get_value_array_element(&v, 1), "b", 1));
+    EXPECT_EQ_INT(1, object_find_member(get_value_array_element(&v, 4), "ab", 2));
+    EXPECT_EQ_INT(VALUE_SHAPED, get_value_array_element(&v, 7)->flags & VALUE_SHAPED);
+    EXPECT_EQ_DOUBLE(0.0, get_value_number(member_of(get_value_array_element(&v, 7), "")));
+    free_value(&w);
+    free_value(&v);
+
+    /* an array that keeps changing shape stops learning */
+    EXPECT_EQ_INT(PARSE_OK, json_parse(&v, "[{\"a\":1},{\"b\":1},{\"c\":1},{\"d\":1},{\"e\":1},{\"f\":1},{\"g\":1},{\"g\":2},{\"f\":2}]"));
+    EXPECT_EQ_INT(VALUE_SHAPED, get_value_array_element(&v, 5)->flags & VALUE_SHAPED);
+    EXPECT_EQ_INT(0, get_value_array_element(&v, 7)->flags & VALUE_SHAPED);
+    EXPECT_EQ_INT(VALUE_SHAPED, get_value_array_element(&v, 8)->flags & VALUE_SHAPED);
+    free_value(&v);
+
+    /* keys with escapes are never learned */
+    EXPECT_EQ_INT(PARSE_OK, json_parse(&v, "[{\"a\\n\":1},{\"a\\n\":2}]"));
+    EXPECT_EQ_INT(0, get_value_array_element(&v, 1)->flags & VALUE_SHAPED);
+    free_value(&v);
+
+    /* errors part way through a speculated object */
+    TEST_ERROR(PARSE_MISS_MEMBER_COLON, "[{\"a\":1,\"b\":2},{\"a\":1,\"b\" 2}]");
+    TEST_ERROR(PARSE_INVALID_VALUE, "[{\"a\":1,\"b\":2},{\"a\":1,\"b\":x}]");
+    TEST_ERROR(PARSE_MISS_COMMA_OR_CURLY_BRACKET, "[{\"a\":1,\"b\":2},{\"a\":1,\"b\":2]");
+    TEST_ERROR(PARSE_MISS_MEMBER_KEY, "[{\"a\":1,\"b\":2},{\"a\":1,}]");
+    TEST_ERROR(PARSE_MISS_QUOTATION_MARK, "[{\"a\":1,\"b\":2},{\"a\":1,\"b");
+    TEST_ERROR(PARSE_MISS_COMMA_OR_SQUARE_BRACKET, "[{\"a\":1,\"b\":2},{\"a\":1,\"b\":2}");
+
+    /* the cursor carries the shape from one element to the next */
+    write_test_file("shape_test.json", "[{\"id\":1,\"name\":\"x\"},{\"id\":2,\"name\":\"y\"},{\"id\":3,\"name\":\"z\"}]");
+    f = fopen("shape_test.json", "rb");
+    cur = json_cursor_open(f);
+    value_init(&v);
+    for (i = 0; json_cursor_next(cur, &v); i++) {
+        EXPECT_EQ_INT(i > 0 ? VALUE_SHAPED : 0, v.flags & VALUE_SHAPED);
+        EXPECT_EQ_DOUBLE((double)(i + 1), get_value_number(member_of(&v, "id")));
+    }
+    EXPECT_EQ_SIZE_T(3, i);
+    json_cursor_close(cur);
+    fclose(f);
+    remove("shape_test.json");
 }
 
 void test_generate() {
@@ -371,6 +2262,30 @@ int main() {
     #endif
     test_parse(); 
     test_generate();
+    test_binary();
+    test_snapshot();
+    test_snapshot_verify();
+    test_allocator();
+    test_array_mutation();
+    test_object_mutation();
+    test_builder();
+    test_share();
+    test_hash();
+    test_patch();
+    test_struct();
+    test_validate();
+    test_canonical();
+    test_file_cache();
+    test_parse_many();
+    test_lazy_number();
+    test_raw();
+    test_compact();
+    test_member_index();
+    test_cursor();
+    test_limits();
+    test_freeze();
+    test_key();
+    test_shape();
     test_file();
     printf("%d/%d (%3.2f%%) passed\n", pass_count, total_count, pass_count * 100.0 / total_count);
     return main_ret;